@@ -42,6 +42,14 @@ const char *bb_pm_method_string[PM_METHODS_COUNT] = {
   /* the below names are used in switch/switching.c */
   "bbswitch",
   "switcheroo",
+  "runtimepm",
+};
+
+/* config values for NUMA policies, edit bb_numa_policy in bbconfig.h as well! */
+const char *bb_numa_policy_string[NUMA_POLICIES_COUNT] = {
+  "none",
+  "xorg",
+  "all",
 };
 
 struct bb_status_struct bb_status;
@@ -115,6 +123,21 @@ enum bb_pm_method bb_pm_method_from_string(char *value) {
   return method_index;
 }
 
+/**
+ * Converts a string to the internal representation of a NUMA policy
+ * @param value The string to be converted
+ * @return An index in the NUMA policies array, NUMA_NONE if value is invalid
+ */
+enum bb_numa_policy bb_numa_policy_from_string(char *value) {
+  enum bb_numa_policy policy = NUMA_POLICIES_COUNT;
+  while (policy > 0) {
+    if (strcmp(value, bb_numa_policy_string[--policy]) == 0) {
+      break;
+    }
+  }
+  return policy;
+}
+
 /**
  * Prints a usage message and exits with given exit code
  * @param exit_val The exit code to be passed to exit(). If non-zero, an hint is
@@ -166,7 +189,9 @@ void print_usage(int exit_val) {
                              override the settings from optirun so be careful\n\
                              with setting it\n\
       --primus-ldpath PATH  a colon-separated list of paths which are searched\n\
-                            for the primus libGL.so.1\n",
+                            for the primus libGL.so.1\n\
+      --card N        run on discrete card N (counting from 0), or on the\n\
+                        least loaded card if N is any\n",
             out);
   } else {
     //server-only options
@@ -183,13 +208,15 @@ void print_usage(int exit_val) {
   -k, --driver-module NAME    Name of kernel module to be loaded if different\n\
                                 from the driver\n\
       --pm-method METHOD  method to use for disabling the discrete video card,\n\
-                            valid values are auto, bbswitch, switcheroo and\n\
-                            none. auto selects a sensible method,\n\
+                            valid values are auto, bbswitch, switcheroo,\n\
+                            runtimepm and none. auto selects a sensible\n\
+                            method,\n\
                             bbswitch (kernel module) is available for nvidia\n\
                             and nouveau drivers,\n\
                             switcheroo (vga_switcheroo) is usually for\n\
-			    nouveau and radeon drivers and none disables PM\n\
-			    completely\n",
+			    nouveau and radeon drivers, runtimepm uses the\n\
+			    runtime power management of the kernel and none\n\
+			    disables PM completely\n",
             out);
 #ifdef WITH_PIDFILE
     fputs("\
@@ -386,6 +413,10 @@ GKeyFile *bbconfig_parse_conf(void) {
   if (g_key_file_has_key(bbcfg, section, key, NULL)) {
     free_and_set_value(&bb_config.vgl_compress, g_key_file_get_string(bbcfg, section, key, NULL));
   }
+  key = "Card";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    free_and_set_value(&bb_config.card, g_key_file_get_string(bbcfg, section, key, NULL));
+  }
   key = "AllowFallbackToIGC";
   if (g_key_file_has_key(bbcfg, section, key, NULL)) {
     bb_config.fallback_start = g_key_file_get_boolean(bbcfg, section, key, NULL);
@@ -402,6 +433,48 @@ GKeyFile *bbconfig_parse_conf(void) {
   if (g_key_file_has_key(bbcfg, section, key, NULL)) {
     bb_config.stop_on_exit = !g_key_file_get_boolean(bbcfg, section, key, NULL);
   }
+  key = "LingerTimeout";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.linger_timeout = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "StandbyTimeout";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.standby_timeout = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "PoolMin";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.pool_min = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "PoolMax";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.pool_max = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "StatusFile";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    free_and_set_value(&bb_config.status_file, g_key_file_get_string(bbcfg, section, key, NULL));
+  }
+  key = "HistoryFile";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    free_and_set_value(&bb_config.history_file, g_key_file_get_string(bbcfg, section, key, NULL));
+  }
+  key = "EnergyFile";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    free_and_set_value(&bb_config.energy_file, g_key_file_get_string(bbcfg, section, key, NULL));
+  }
+  key = "PrewarmLead";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.prewarm_lead = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "PrewarmBudget";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    bb_config.prewarm_budget = g_key_file_get_integer(bbcfg, section, key, NULL);
+  }
+  key = "NumaPolicy";
+  if (g_key_file_has_key(bbcfg, section, key, NULL)) {
+    char *val = g_key_file_get_string(bbcfg, section, key, NULL);
+    bb_config.numa_policy = bb_numa_policy_from_string(val);
+    g_free(val);
+  }
   key = "Driver";
   if (g_key_file_has_key(bbcfg, section, key, NULL)) {
     char *driver = g_key_file_get_string(bbcfg, section, key, NULL);
@@ -495,9 +568,6 @@ void init_early_config(char **argv, int runmode) {
   bb_status.verbosity = VERB_NOTICE;
   bb_status.bb_socket = -1;
   bb_status.appcount = 0;
-  bb_status.x_pid = 0;
-  bb_status.x_pipe[0] = -1;
-  bb_status.x_pipe[1] = -1;
   bb_status.runmode = runmode;
   bb_status.program_name = argv[0];
 }
@@ -520,11 +590,22 @@ void init_config(void) {
   set_string_value(&bb_config.optirun_bridge, CONF_BRIDGE);
   set_string_value(&bb_config.primus_ld_path, CONF_PRIMUS_LD_PATH);
   set_string_value(&bb_config.vgl_compress, CONF_VGLCOMPRESS);
+  set_string_value(&bb_config.card, CONF_CARD);
   // default to auto-detect
   set_string_value(&bb_config.driver, "");
   set_string_value(&bb_config.module_name, "");
   bb_config.pm_method = bb_pm_method_from_string(CONF_PM_METHOD);
   bb_config.stop_on_exit = bb_bool_from_string(CONF_KEEPONEXIT);
+  bb_config.linger_timeout = atoi(CONF_LINGERTIMEOUT);
+  bb_config.standby_timeout = atoi(CONF_STANDBYTIMEOUT);
+  bb_config.pool_min = atoi(CONF_POOLMIN);
+  bb_config.pool_max = atoi(CONF_POOLMAX);
+  set_string_value(&bb_config.status_file, CONF_STATUSFILE);
+  set_string_value(&bb_config.history_file, CONF_HISTORYFILE);
+  set_string_value(&bb_config.energy_file, CONF_ENERGYFILE);
+  bb_config.prewarm_lead = atoi(CONF_PREWARMLEAD);
+  bb_config.prewarm_budget = atoi(CONF_PREWARMBUDGET);
+  bb_config.numa_policy = bb_numa_policy_from_string(CONF_NUMAPOLICY);
   bb_config.fallback_start = bb_bool_from_string(CONF_FALLBACKSTART);
   bb_config.card_shutdown_state = bb_bool_from_string(CONF_TURNOFFATEXIT);
 #ifdef WITH_PIDFILE
@@ -543,6 +624,7 @@ void config_dump(void) {
   bb_log(LOG_DEBUG, " X display: %s\n", bb_config.x_display);
   bb_log(LOG_DEBUG, " LD_LIBRARY_PATH: %s\n", bb_config.ld_path);
   bb_log(LOG_DEBUG, " Socket path: %s\n", bb_config.socket_path);
+  bb_log(LOG_DEBUG, " Status file: %s\n", bb_config.status_file);
   if (bb_status.runmode == BB_RUN_SERVER || bb_status.runmode == BB_RUN_DAEMON) {
     /* daemon options */
 #ifdef WITH_PIDFILE
@@ -555,6 +637,16 @@ void config_dump(void) {
     bb_log(LOG_DEBUG, " Power method: %s\n",
             bb_pm_method_string[bb_config.pm_method]);
     bb_log(LOG_DEBUG, " Stop X on exit: %i\n", bb_config.stop_on_exit);
+    bb_log(LOG_DEBUG, " Linger timeout: %i\n", bb_config.linger_timeout);
+    bb_log(LOG_DEBUG, " Standby timeout: %i\n", bb_config.standby_timeout);
+    bb_log(LOG_DEBUG, " X server pool: %i to %i\n", bb_config.pool_min,
+            bb_config.pool_max);
+    bb_log(LOG_DEBUG, " History file: %s\n", bb_config.history_file);
+    bb_log(LOG_DEBUG, " Energy file: %s\n", bb_config.energy_file);
+    bb_log(LOG_DEBUG, " Pre-warm lead: %i\n", bb_config.prewarm_lead);
+    bb_log(LOG_DEBUG, " Pre-warm budget: %i\n", bb_config.prewarm_budget);
+    bb_log(LOG_DEBUG, " NUMA policy: %s\n",
+            bb_numa_policy_string[bb_config.numa_policy]);
     bb_log(LOG_DEBUG, " Driver: %s\n", bb_config.driver);
     bb_log(LOG_DEBUG, " Driver module: %s\n", bb_config.module_name);
     bb_log(LOG_DEBUG, " Card shutdown state: %i\n",
@@ -565,6 +657,7 @@ void config_dump(void) {
     bb_log(LOG_DEBUG, " VGL Compression: %s\n", bb_config.vgl_compress);
     bb_log(LOG_DEBUG, " VGLrun extra options: %s\n", bb_config.vglrun_options ? bb_config.vglrun_options : "");
     bb_log(LOG_DEBUG, " Primus LD Path: %s\n", bb_config.primus_ld_path);
+    bb_log(LOG_DEBUG, " Card: %s\n", bb_config.card);
   }
 }
 
@@ -585,6 +678,15 @@ int config_validate(void) {
     bb_log(LOG_ERR, "Invalid configuration: no driver configured.\n");
     error = 1;
   }
+  if (bb_config.pool_max < 1) {
+    /* the upper bound is checked by the daemon, see SECONDARY_POOL_MAX */
+    bb_log(LOG_ERR, "Invalid configuration: PoolMax must be at least 1.\n");
+    error = 1;
+  } else if (bb_config.pool_min < 0 || bb_config.pool_min > bb_config.pool_max) {
+    bb_log(LOG_ERR, "Invalid configuration: PoolMin must be between 0 and"
+            " PoolMax.\n");
+    error = 1;
+  }
   if (!error) {
     bb_log(LOG_DEBUG, "Configuration test passed.\n");
   }
@@ -601,12 +703,18 @@ void set_bb_error(char * msg) {
     //earliest error is the most important!
     if (bb_status.errors[0] == 0){
       set_string_value(&bb_status.errors, msg);
+      if (bb_status.error_changed) {
+        bb_status.error_changed();
+      }
     }
     bb_log(LOG_ERR, "%s\n", msg);
   } else {
     //clear set error message, if any.
     if (bb_status.errors[0] != 0) {
       set_string_value(&bb_status.errors, "");
+      if (bb_status.error_changed) {
+        bb_status.error_changed();
+      }
     }
   }
 }//set_bb_error
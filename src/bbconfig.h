@@ -72,6 +72,7 @@ enum {
     OPT_PM_METHOD,
     OPT_PRIMUS_LD_PATH,
     OPT_X_CONF_DIR_PATH,
+    OPT_CARD,
 };
 
 /* Verbosity levels */
@@ -100,10 +101,20 @@ enum bb_pm_method {
     PM_AUTO, /* at detection time, this value will be changed */
     PM_BBSWITCH,
     PM_VGASWITCHEROO,
+    PM_RUNTIMEPM,
     PM_METHODS_COUNT /* not a method but a marker for the end */
 };
 const char *bb_pm_method_string[PM_METHODS_COUNT];
 
+/* NUMA placement policies, edit bb_numa_policy_string in bbconfig.c as well! */
+enum bb_numa_policy {
+    NUMA_NONE, /* no placement */
+    NUMA_XORG, /* the secondary X server runs next to the card */
+    NUMA_ALL, /* applications started by optirun as well */
+    NUMA_POLICIES_COUNT /* not a policy but a marker for the end */
+};
+const char *bb_numa_policy_string[NUMA_POLICIES_COUNT];
+
 /* String buffer size */
 #define BUFFER_SIZE 1024
 
@@ -113,9 +124,8 @@ struct bb_status_struct {
     int bb_socket; /// The socket file descriptor of the application.
     unsigned int appcount; /// Count applications using the X server.
     char * errors; /// Error message if any. First byte is 0 otherwise.
+    void (*error_changed)(void); /// Called when errors has changed, may be NULL.
     enum bb_run_mode runmode; /// Running mode.
-    pid_t x_pid;
-    int x_pipe[2];//pipes for reading/writing output from X's stdout/stderr
     gboolean use_syslog;
     char *program_name;
 };
@@ -132,8 +142,19 @@ struct bb_config_struct {
     char * gid_name; /// Group name for setgid.
     enum bb_pm_method pm_method; /// Which method to use for power management.
     int stop_on_exit; /// Whether to stop the X server on last optirun instance exit.
+    int linger_timeout; /// Seconds to wait before stopping an unused X server.
+    int standby_timeout; /// Seconds to keep the driver loaded after stopping X.
+    int pool_min; /// X servers kept running per card while it is in use.
+    int pool_max; /// Maximum number of X servers per card.
+    char * status_file; /// Shared memory status page, disabled if empty.
+    char * history_file; /// File in which the usage history is kept.
+    char * energy_file; /// File to which the energy per state is appended.
+    int prewarm_lead; /// Seconds to start the secondary before predicted use.
+    int prewarm_budget; /// Seconds of unused pre-warming allowed per day.
+    enum bb_numa_policy numa_policy; /// What runs on the CPUs and memory of the card.
     int fallback_start; /// Wheter the application should be launched on the integrated card when X is not available.
     int no_xorg; /// Do not start secondary X server
+    char * card; /// Discrete card to run on, "any" for the least loaded one.
     char * optirun_bridge; /// Accel/display bridge for optirun.
     char * primus_ld_path; /// LD_LIBRARY_PATH containing primus libGL.so.1
     char * vgl_compress; /// VGL transport method.
@@ -184,4 +205,6 @@ gboolean bb_bool_from_string(char* str);
 
 enum bb_pm_method bb_pm_method_from_string(char *value);
 
+enum bb_numa_policy bb_numa_policy_from_string(char *value);
+
 size_t ensureZeroTerminated(char *buff, size_t size, size_t max);
@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Energy and residency accounting of the discrete cards. Every change of the
+ * state of the cards is reported by bbsecondary and the daemon, the time spent
+ * in each state is accounted from these transitions. The power draw is read
+ * from the power sensor of the cards (hwmon) if the driver provides one,
+ * otherwise from the discharge rate of the battery, and multiplied with the
+ * time to estimate the energy per state. Every period spent in a state can be
+ * appended to a file as a fixed size record for later analysis.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "bbenergy.h"
+#include "bbsecondary.h"
+#include "bbevent.h"
+#include "bblogger.h"
+
+/* On-disk format of a period spent in a state, 16 bytes */
+struct energy_record {
+  uint32_t time; /* seconds since the epoch at which the state was left */
+  uint32_t duration; /* ms spent in the state */
+  uint32_t energy; /* estimated mJ used in the state */
+  uint8_t state; /* enum energy_state that was left */
+  uint8_t next; /* state that was entered, ENERGY_STATES if the daemon quit */
+  uint8_t source; /* enum energy_source of the last reading in the state */
+  uint8_t reserved;
+};
+
+static const char *state_names[ENERGY_STATES] = {
+  [ENERGY_OFF] = "off",
+  [ENERGY_ON] = "on",
+  [ENERGY_DRIVER] = "driver",
+  [ENERGY_X] = "X/0",
+  [ENERGY_X + 1] = "X/1",
+  [ENERGY_X + 2] = "X/2",
+  [ENERGY_X + 3] = "X/3",
+  [ENERGY_X + 4] = "X/4+",
+};
+
+static const char *source_names[] = {
+  [ENERGY_SOURCE_NONE] = "none",
+  [ENERGY_SOURCE_HWMON] = "hwmon",
+  [ENERGY_SOURCE_BATTERY] = "battery",
+};
+
+static struct {
+  struct energy_stats stats;
+  enum energy_state base; /* state reported by the cards, without clients */
+  unsigned int clients; /* applications using the cards */
+  long long since; /* time up to which the current state is accounted */
+  long long entered; /* time at which the current state was entered */
+  long long period_energy; /* mJ used since the current state was entered */
+  int hwmon_seen; /* whether a power sensor of the cards has been read */
+  struct pci_bus_id cards[SECONDARY_MAX];
+  int card_count;
+  struct bb_timer sample;
+  char *path; /* energy log, NULL if not kept */
+  int fd;
+  off_t size; /* size of the energy log */
+} energy = {.stats = {.state = ENERGY_STATES}, .fd = -1};
+
+/**
+ * Returns the name of a state for reporting
+ */
+const char *energy_state_name(enum energy_state state) {
+  return state < ENERGY_STATES ? state_names[state] : "unknown";
+}
+
+/**
+ * Returns the name of a source of power readings for reporting
+ */
+const char *energy_source_name(enum energy_source source) {
+  return source <= ENERGY_SOURCE_BATTERY ? source_names[source] : "unknown";
+}
+
+/**
+ * Reads a small sysfs attribute
+ * @param path The attribute
+ * @param buf Receives the null-terminated contents without trailing newline
+ * @param len The size of buf
+ * @return 0 on success, -1 if the attribute could not be read
+ */
+static int read_attribute(const char *path, char *buf, size_t len) {
+  ssize_t r;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return -1;
+  }
+  r = read(fd, buf, len - 1);
+  close(fd);
+  if (r <= 0) {
+    return -1;
+  }
+  buf[r] = 0;
+  buf[strcspn(buf, "\n")] = 0;
+  return 0;
+}
+
+/**
+ * Reads a numeric sysfs attribute
+ * @return The value, -1 if the attribute could not be read
+ */
+static long long read_number(const char *path) {
+  char buf[32];
+
+  if (read_attribute(path, buf, sizeof buf)) {
+    return -1;
+  }
+  return strtoll(buf, NULL, 10);
+}
+
+/**
+ * Reads the power draw of a card from its hwmon power sensor
+ * @return The power in mW, -1 if the card has no power sensor
+ */
+static long long hwmon_power(const struct pci_bus_id *bus_id) {
+  char path[1024];
+  struct dirent *entry;
+  long long power = -1;
+  DIR *dir;
+
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME "/hwmon",
+          bus_id->domain, bus_id->bus, bus_id->slot, bus_id->func);
+  dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+  while (power < 0 && (entry = readdir(dir))) {
+    if (strncmp(entry->d_name, "hwmon", 5)) {
+      continue;
+    }
+    snprintf(path, sizeof path, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME
+            "/hwmon/%s/power1_average", bus_id->domain, bus_id->bus,
+            bus_id->slot, bus_id->func, entry->d_name);
+    power = read_number(path);
+    if (power < 0) {
+      strcpy(path + strlen(path) - strlen("average"), "input");
+      power = read_number(path);
+    }
+  }
+  closedir(dir);
+  /* the sensor reports microwatts */
+  return power < 0 ? -1 : power / 1000;
+}
+
+/**
+ * Reads the power the system draws from its batteries while discharging
+ * @return The power in mW, -1 if not running on battery
+ */
+static long long battery_power(void) {
+  char path[1024], value[32];
+  struct dirent *entry;
+  long long total = -1;
+  DIR *dir = opendir(PCI_ROOT "/sys/class/power_supply");
+
+  if (!dir) {
+    return -1;
+  }
+  while ((entry = readdir(dir))) {
+    long long power;
+
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof path, PCI_ROOT "/sys/class/power_supply/%s/status",
+            entry->d_name);
+    if (read_attribute(path, value, sizeof value) ||
+            strcmp(value, "Discharging")) {
+      continue;
+    }
+    snprintf(path, sizeof path, PCI_ROOT "/sys/class/power_supply/%s/"
+            "power_now", entry->d_name);
+    power = read_number(path);
+    if (power < 0) {
+      /* some batteries report current and voltage instead */
+      long long current, voltage;
+      snprintf(path, sizeof path, PCI_ROOT "/sys/class/power_supply/%s/"
+              "current_now", entry->d_name);
+      current = read_number(path);
+      snprintf(path, sizeof path, PCI_ROOT "/sys/class/power_supply/%s/"
+              "voltage_now", entry->d_name);
+      voltage = read_number(path);
+      if (current < 0 || voltage < 0) {
+        continue;
+      }
+      power = current * voltage / 1000000;
+    }
+    total = (total < 0 ? 0 : total) + power;
+  }
+  closedir(dir);
+  /* power_supply reports microwatts */
+  return total < 0 ? -1 : total / 1000;
+}
+
+/**
+ * Reads the current power draw, preferring the sensors of the cards
+ */
+static void energy_sample(void) {
+  struct energy_stats *stats = &energy.stats;
+  long long power, total = -1;
+  int i;
+
+  for (i = 0; i < energy.card_count; i++) {
+    power = hwmon_power(&energy.cards[i]);
+    if (power >= 0) {
+      total = (total < 0 ? 0 : total) + power;
+    }
+  }
+  if (total >= 0) {
+    energy.hwmon_seen = 1;
+    stats->source = ENERGY_SOURCE_HWMON;
+    stats->power = total;
+  } else if (energy.hwmon_seen && stats->state == ENERGY_OFF) {
+    /* the sensor is gone with the driver, a card that is off draws nothing */
+    stats->source = ENERGY_SOURCE_HWMON;
+    stats->power = 0;
+  } else if ((power = battery_power()) >= 0) {
+    stats->source = ENERGY_SOURCE_BATTERY;
+    stats->power = power;
+  } else {
+    stats->source = ENERGY_SOURCE_NONE;
+    stats->power = 0;
+  }
+}
+
+/**
+ * Accounts the time since the last call to the current state, with the power
+ * that was read last
+ */
+static void energy_account(long long now) {
+  struct energy_stats *stats = &energy.stats;
+  long long used;
+
+  if (stats->state == ENERGY_STATES) {
+    return;
+  }
+  /* mW * ms = uJ */
+  used = stats->power * (now - energy.since) / 1000;
+  stats->residency[stats->state] += now - energy.since;
+  stats->energy[stats->state] += used;
+  energy.period_energy += used;
+  energy.since = now;
+}
+
+/**
+ * Starts a new energy log after moving the full one to PATH.old
+ */
+static void energy_rotate(void) {
+  char old[1024];
+
+  snprintf(old, sizeof old, "%s.old", energy.path);
+  close(energy.fd);
+  if (rename(energy.path, old)) {
+    bb_log(LOG_WARNING, "Could not rotate energy log: %s\n", strerror(errno));
+  }
+  energy.fd = open(energy.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+          0644);
+  energy.size = 0;
+  if (energy.fd == -1) {
+    bb_log(LOG_WARNING, "Could not open energy log %s: %s\n", energy.path,
+            strerror(errno));
+  }
+}
+
+/**
+ * Appends the period that was spent in the current state to the energy log
+ * @param next The state that is entered
+ */
+static void energy_record(long long now, enum energy_state next) {
+  struct energy_record rec;
+
+  if (energy.fd == -1 || energy.stats.state == ENERGY_STATES) {
+    return;
+  }
+  if (energy.size >= ENERGY_FILE_MAX) {
+    energy_rotate();
+    if (energy.fd == -1) {
+      return;
+    }
+  }
+  memset(&rec, 0, sizeof rec);
+  rec.time = time(NULL);
+  rec.duration = now - energy.entered;
+  rec.energy = energy.period_energy;
+  rec.state = energy.stats.state;
+  rec.next = next;
+  rec.source = energy.stats.source;
+  if (write(energy.fd, &rec, sizeof rec) == sizeof rec) {
+    energy.size += sizeof rec;
+  } else {
+    bb_log(LOG_WARNING, "Could not write energy log: %s\n", strerror(errno));
+  }
+}
+
+/**
+ * Enters the state that follows from the state of the cards and the number of
+ * clients, if it has changed
+ */
+static void energy_update(void) {
+  struct energy_stats *stats = &energy.stats;
+  enum energy_state state = energy.base;
+  long long now = bb_event_now();
+
+  if (state == ENERGY_X) {
+    state += energy.clients < ENERGY_CLIENTS_MAX ? energy.clients :
+            ENERGY_CLIENTS_MAX;
+  }
+  if (state == stats->state) {
+    return;
+  }
+  energy_account(now);
+  energy_record(now, state);
+  bb_log(LOG_DEBUG, "Energy state changed from %s to %s\n",
+          energy_state_name(stats->state), energy_state_name(state));
+  stats->state = state;
+  stats->transitions[state]++;
+  energy.since = energy.entered = now;
+  energy.period_energy = 0;
+  /* the power draw changes with the state, and the sensors with the driver */
+  energy_sample();
+}
+
+/**
+ * Timer handler that reads the power draw periodically
+ */
+static void energy_sample_timer(void *data) {
+  energy_account(bb_event_now());
+  energy_sample();
+  bb_timer_start(&energy.sample, ENERGY_SAMPLE_INTERVAL, energy_sample_timer,
+          data);
+}
+
+/**
+ * Starts the accounting and opens the energy log
+ * @param path The energy log, not kept if NULL or empty
+ * @return 0 on success, -1 if the log could not be opened
+ */
+int energy_open(const char *path) {
+  struct stat st;
+
+  bb_timer_start(&energy.sample, ENERGY_SAMPLE_INTERVAL, energy_sample_timer,
+          NULL);
+  if (!path || !*path) {
+    return 0;
+  }
+  energy.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (energy.fd == -1) {
+    bb_log(LOG_WARNING, "Could not open energy log %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  energy.path = strdup(path);
+  energy.size = fstat(energy.fd, &st) ? 0 : st.st_size;
+  return 0;
+}
+
+/**
+ * Ends the period in the current state and closes the energy log
+ */
+void energy_close(void) {
+  long long now = bb_event_now();
+
+  bb_timer_stop(&energy.sample);
+  energy_account(now);
+  energy_record(now, ENERGY_STATES);
+  if (energy.fd != -1) {
+    close(energy.fd);
+    energy.fd = -1;
+  }
+  free(energy.path);
+  energy.path = NULL;
+}
+
+/**
+ * Adds a card whose power sensor is read
+ */
+void energy_add_card(struct pci_bus_id *bus_id) {
+  if (energy.card_count < SECONDARY_MAX) {
+    energy.cards[energy.card_count++] = *bus_id;
+  }
+}
+
+/**
+ * Reports a change of the power state of the cards
+ * @param state ENERGY_OFF, ENERGY_ON, ENERGY_DRIVER or ENERGY_X
+ */
+void energy_set_state(enum energy_state state) {
+  energy.base = state;
+  energy_update();
+}
+
+/**
+ * Reports a change of the number of applications using the cards
+ */
+void energy_set_clients(unsigned int clients) {
+  energy.clients = clients;
+  if (energy.stats.state != ENERGY_STATES) {
+    energy_update();
+  }
+}
+
+/**
+ * Returns the residency, transitions and energy per state, including the
+ * period in the current state up to now
+ */
+void energy_stats(struct energy_stats *stats) {
+  energy_account(bb_event_now());
+  *stats = energy.stats;
+}
+
+/**
+ * Describes the residency, transitions and estimated energy per state
+ * @param buffer Receives a text like "off 10.0s 1x 0.0J, on 0.3s 1x 1.2J, ...
+ * (hwmon 12.5W)"
+ * @param len The size of buffer
+ */
+void energy_format(char *buffer, size_t len) {
+  struct energy_stats stats;
+  size_t pos = 0;
+  int i;
+
+  energy_stats(&stats);
+  buffer[0] = 0;
+  for (i = 0; i < ENERGY_STATES && pos < len; i++) {
+    pos += snprintf(buffer + pos, len - pos, "%s%s %.1fs %ux %.1fJ",
+            i ? ", " : "", energy_state_name(i), stats.residency[i] / 1000.0,
+            stats.transitions[i], stats.energy[i] / 1000.0);
+  }
+  if (pos < len) {
+    snprintf(buffer + pos, len - pos, " (%s %.1fW)",
+            energy_source_name(stats.source), stats.power / 1000.0);
+  }
+}
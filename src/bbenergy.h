@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Energy and residency accounting of the discrete cards
+ */
+#pragma once
+#include <stddef.h>
+#include "pci.h"
+
+/* X with this many clients or more is accounted as a single state */
+#define ENERGY_CLIENTS_MAX 4
+
+/* Interval in ms at which the power draw is read */
+#define ENERGY_SAMPLE_INTERVAL 10000
+
+/* Size in bytes at which the energy log is moved to PATH.old */
+#define ENERGY_FILE_MAX (1024 * 1024)
+
+/* State of the discrete cards as a whole, the card in the highest state
+ * counts. ENERGY_X + n is X running with n clients. */
+enum energy_state {
+  ENERGY_OFF, /* powered off */
+  ENERGY_ON, /* powered on without driver */
+  ENERGY_DRIVER, /* driver loaded, no X server */
+  ENERGY_X, /* X running */
+  ENERGY_STATES = ENERGY_X + ENERGY_CLIENTS_MAX + 1 /* marker for the end */
+};
+
+/* Where the power draw is read from */
+enum energy_source {
+  ENERGY_SOURCE_NONE, /* no reading available, energy is not estimated */
+  ENERGY_SOURCE_HWMON, /* power sensor of the cards */
+  ENERGY_SOURCE_BATTERY, /* discharge rate of the battery, whole system */
+};
+
+/* Residency, transitions and energy per state since the daemon started */
+struct energy_stats {
+  long long residency[ENERGY_STATES]; /* ms, including the current period */
+  unsigned int transitions[ENERGY_STATES]; /* number of times entered */
+  long long energy[ENERGY_STATES]; /* estimated mJ */
+  enum energy_state state; /* current state, ENERGY_STATES if not known yet */
+  enum energy_source source; /* source of the last power reading */
+  long long power; /* last power reading in mW */
+};
+
+int energy_open(const char *path);
+void energy_close(void);
+void energy_add_card(struct pci_bus_id *bus_id);
+void energy_set_state(enum energy_state state);
+void energy_set_clients(unsigned int clients);
+void energy_stats(struct energy_stats *stats);
+void energy_format(char *buffer, size_t len);
+const char *energy_state_name(enum energy_state state);
+const char *energy_source_name(enum energy_source source);
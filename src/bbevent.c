@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event loop for the Bumblebee daemon. Watchers are kept in a table that is
+ * indexed by file descriptor and allocated once, so registering, removing and
+ * dispatching a watcher never walks a list nor allocates memory. Timers are
+ * kept in a short list sorted by expiry time which also bounds the time spent
+ * waiting for events.
+ */
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "bbevent.h"
+#include "bblogger.h"
+
+struct bb_watcher {
+  bb_event_handler handler; /* NULL if the slot is unused */
+  void *data;
+  uint32_t generation; /* detects events for a closed and reused fd */
+};
+
+static int epoll_fd = -1;
+static struct bb_watcher *watchers;
+static int watchers_size;
+static struct bb_timer *timers; /* armed timers, the first one expires first */
+
+/**
+ * Packs a file descriptor and the generation of its watcher in epoll data
+ */
+static uint64_t event_key(int fd) {
+  return (uint64_t)watchers[fd].generation << 32 | (uint32_t)fd;
+}
+
+/**
+ * Creates the epoll instance and the watcher table. The table is sized after
+ * the file descriptor limit which is raised to the hard limit (capped at
+ * BB_EVENT_MAX_FDS) such that many clients can be connected concurrently
+ * @return 0 on success, -1 on failure
+ */
+int bb_event_init(void) {
+  struct rlimit rl;
+
+  watchers_size = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    rlim_t wanted = rl.rlim_max;
+    if (wanted == RLIM_INFINITY || wanted > BB_EVENT_MAX_FDS) {
+      wanted = BB_EVENT_MAX_FDS;
+    }
+    if (rl.rlim_cur < wanted) {
+      rl.rlim_cur = wanted;
+      if (setrlimit(RLIMIT_NOFILE, &rl)) {
+        bb_log(LOG_DEBUG, "Could not raise file descriptor limit: %s\n",
+                strerror(errno));
+        getrlimit(RLIMIT_NOFILE, &rl);
+      }
+    }
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < BB_EVENT_MAX_FDS) {
+      watchers_size = rl.rlim_cur;
+    } else {
+      watchers_size = BB_EVENT_MAX_FDS;
+    }
+  }
+
+  watchers = calloc(watchers_size, sizeof *watchers);
+  if (!watchers) {
+    bb_log(LOG_ERR, "Could not allocate event table for %i descriptors\n",
+            watchers_size);
+    return -1;
+  }
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    bb_log(LOG_ERR, "Could not create epoll instance: %s\n", strerror(errno));
+    free(watchers);
+    watchers = NULL;
+    return -1;
+  }
+  bb_log(LOG_DEBUG, "Event loop can handle %i descriptors\n", watchers_size);
+  return 0;
+}
+
+/**
+ * Releases the epoll instance and the watcher table
+ */
+void bb_event_close(void) {
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+  free(watchers);
+  watchers = NULL;
+  watchers_size = 0;
+}
+
+/**
+ * Returns the number of file descriptors that can be watched, any descriptor
+ * must be lower than this value
+ */
+int bb_event_max_fds(void) {
+  return watchers_size;
+}
+
+/**
+ * Starts watching a file descriptor. If the descriptor was already watched,
+ * the handler and events are replaced
+ * @param fd The file descriptor to be watched
+ * @param events EPOLL* flags to be watched for
+ * @param handler The function to be called when the descriptor is ready
+ * @param data A pointer that is passed to the handler
+ * @return 0 on success, -1 on failure
+ */
+int bb_event_add(int fd, unsigned int events, bb_event_handler handler,
+        void *data) {
+  struct epoll_event ev;
+  int op = EPOLL_CTL_ADD;
+
+  if (fd < 0 || fd >= watchers_size || epoll_fd == -1) {
+    bb_log(LOG_WARNING, "Cannot watch descriptor %i (limit %i)\n", fd,
+            watchers_size);
+    return -1;
+  }
+  if (watchers[fd].handler) {
+    op = EPOLL_CTL_MOD;
+  }
+  watchers[fd].generation++;
+  memset(&ev, 0, sizeof ev);
+  ev.events = events;
+  ev.data.u64 = event_key(fd);
+  if (epoll_ctl(epoll_fd, op, fd, &ev)) {
+    /* a watched descriptor was closed without bb_event_remove (or a new one
+     * reuses the number of such descriptor), retry with the other operation */
+    op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(epoll_fd, op, fd, &ev)) {
+      bb_log(LOG_WARNING, "Could not watch descriptor %i: %s\n", fd,
+              strerror(errno));
+      watchers[fd].handler = NULL;
+      return -1;
+    }
+  }
+  watchers[fd].handler = handler;
+  watchers[fd].data = data;
+  return 0;
+}
+
+/**
+ * Changes the events that are watched for a descriptor
+ * @param fd A file descriptor that was added before with bb_event_add
+ * @param events EPOLL* flags to be watched for
+ * @return 0 on success, -1 on failure
+ */
+int bb_event_mod(int fd, unsigned int events) {
+  struct epoll_event ev;
+
+  if (fd < 0 || fd >= watchers_size || !watchers[fd].handler) {
+    return -1;
+  }
+  memset(&ev, 0, sizeof ev);
+  ev.events = events;
+  ev.data.u64 = event_key(fd);
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev)) {
+    bb_log(LOG_WARNING, "Could not modify watch on descriptor %i: %s\n", fd,
+            strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stops watching a descriptor. This may be called after the descriptor has
+ * been closed, pending events for it are discarded.
+ * @param fd The file descriptor
+ */
+void bb_event_remove(int fd) {
+  if (fd < 0 || fd >= watchers_size || !watchers[fd].handler) {
+    return;
+  }
+  /* fails with EBADF if fd was closed already, which removed it from epoll */
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  watchers[fd].handler = NULL;
+  watchers[fd].data = NULL;
+  watchers[fd].generation++;
+}
+
+/**
+ * Returns a monotonic timestamp in milliseconds
+ */
+long long bb_event_now(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (long long)tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+}
+
+/**
+ * Arms a timer, disarming it first if it was already armed
+ * @param timer The timer to be armed
+ * @param msecs Time in milliseconds after which the handler must be called
+ * @param handler The function to be called on expiry
+ * @param data A pointer that is passed to the handler
+ */
+void bb_timer_start(struct bb_timer *timer, int msecs,
+        bb_timer_handler handler, void *data) {
+  struct bb_timer **pos;
+
+  bb_timer_stop(timer);
+  timer->expires = bb_event_now() + (msecs > 0 ? msecs : 0);
+  /* expires must be non-zero for an armed timer */
+  if (timer->expires == 0) {
+    timer->expires = 1;
+  }
+  timer->handler = handler;
+  timer->data = data;
+  for (pos = &timers; *pos && (*pos)->expires <= timer->expires;
+          pos = &(*pos)->next) {
+  }
+  timer->next = *pos;
+  *pos = timer;
+}
+
+/**
+ * Disarms a timer if it is armed
+ * @param timer The timer to be disarmed
+ */
+void bb_timer_stop(struct bb_timer *timer) {
+  struct bb_timer **pos;
+
+  if (!timer->expires) {
+    return;
+  }
+  for (pos = &timers; *pos; pos = &(*pos)->next) {
+    if (*pos == timer) {
+      *pos = timer->next;
+      break;
+    }
+  }
+  timer->expires = 0;
+  timer->next = NULL;
+}
+
+/**
+ * Returns non-zero if the timer is armed, 0 otherwise
+ */
+int bb_timer_pending(struct bb_timer *timer) {
+  return timer->expires != 0;
+}
+
+/**
+ * Calls the handlers of all expired timers
+ */
+static void run_timers(void) {
+  long long now = bb_event_now();
+
+  while (timers && timers->expires <= now) {
+    struct bb_timer *timer = timers;
+    timers = timer->next;
+    timer->expires = 0;
+    timer->next = NULL;
+    timer->handler(timer->data);
+  }
+}
+
+/**
+ * Waits for events and calls the handlers of ready descriptors and expired
+ * timers. The cost of a call is proportional to the number of ready
+ * descriptors only.
+ * @param timeout Maximum time to wait in milliseconds, -1 to wait forever or
+ * until the next timer expires
+ * @return The number of handled events, 0 on timeout or interruption by a
+ * signal and -1 on failure
+ */
+int bb_event_dispatch(int timeout) {
+  struct epoll_event events[BB_EVENT_BATCH];
+  int i, n;
+
+  if (timers) {
+    long long wait = timers->expires - bb_event_now();
+    if (wait < 0) {
+      wait = 0;
+    }
+    if (timeout < 0 || wait < timeout) {
+      timeout = wait;
+    }
+  }
+  n = epoll_wait(epoll_fd, events, BB_EVENT_BATCH, timeout);
+  if (n < 0) {
+    if (errno == EINTR) {
+      run_timers();
+      return 0;
+    }
+    bb_log(LOG_ERR, "epoll_wait() failed: %s\n", strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    int fd = (int)(uint32_t)events[i].data.u64;
+    uint32_t generation = events[i].data.u64 >> 32;
+    /* a previous handler in this batch may have removed this watcher */
+    if (fd < watchers_size && watchers[fd].handler &&
+            watchers[fd].generation == generation) {
+      watchers[fd].handler(fd, events[i].events, watchers[fd].data);
+    }
+  }
+  run_timers();
+  return n;
+}
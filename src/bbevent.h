@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Event loop for the Bumblebee daemon
+ */
+#pragma once
+#include <sys/epoll.h>
+
+/* Maximum number of events handled per wakeup of the event loop */
+#define BB_EVENT_BATCH 64
+
+/* Upper bound for the number of file descriptors the loop can watch */
+#define BB_EVENT_MAX_FDS 65536
+
+/**
+ * Called when a watched file descriptor becomes ready
+ * @param fd The file descriptor
+ * @param events The EPOLL* flags that were reported
+ * @param data The pointer that was passed to bb_event_add
+ */
+typedef void (*bb_event_handler)(int fd, unsigned int events, void *data);
+
+/**
+ * Called when a timer expires. The timer is disarmed before the call and may
+ * be armed again by the handler.
+ * @param data The pointer that was passed to bb_timer_start
+ */
+typedef void (*bb_timer_handler)(void *data);
+
+/* A one-shot timer, the storage is owned by the caller */
+struct bb_timer {
+  long long expires; /* monotonic time in milliseconds, 0 if not armed */
+  bb_timer_handler handler;
+  void *data;
+  struct bb_timer *next;
+};
+
+int bb_event_init(void);
+void bb_event_close(void);
+int bb_event_max_fds(void);
+int bb_event_add(int fd, unsigned int events, bb_event_handler handler,
+        void *data);
+int bb_event_mod(int fd, unsigned int events);
+void bb_event_remove(int fd);
+int bb_event_dispatch(int timeout);
+
+long long bb_event_now(void);
+void bb_timer_start(struct bb_timer *timer, int msecs,
+        bb_timer_handler handler, void *data);
+void bb_timer_stop(struct bb_timer *timer);
+int bb_timer_pending(struct bb_timer *timer);
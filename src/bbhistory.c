@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage history of the discrete card. Every Connect and disconnect is kept in
+ * a ring buffer and appended to a file as a fixed size record, such that the
+ * history survives restarts of the daemon. The history is used to predict
+ * when the card will be needed:
+ *  - daily: an application connected around the same time on most of the
+ *    previous days (a job that runs every morning);
+ *  - follow-up: when an application disconnects, another one usually
+ *    connects shortly after (a game launched after a given application).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bbhistory.h"
+#include "bblogger.h"
+
+/* Number of previous days that are considered for daily predictions */
+#define HISTORY_DAYS 14
+/* Minimum number of days or samples a prediction must be based on */
+#define HISTORY_MIN_SAMPLES 3
+/* Maximum number of previous disconnects considered for follow-ups */
+#define HISTORY_FOLLOWUP_SAMPLES 20
+
+/* On-disk and in-memory format of an event, 24 bytes */
+struct history_record {
+  uint32_t time; /* seconds since the epoch */
+  uint32_t uid;
+  uint8_t event; /* enum history_event */
+  char comm[HISTORY_COMM_LEN - 1]; /* null-terminated, cut to 14 chars */
+};
+
+static struct history_record *records; /* ring buffer of HISTORY_MAX events */
+static unsigned int first; /* index of the oldest event */
+static unsigned int count; /* number of events in the buffer */
+static unsigned int file_count; /* number of events in the history file */
+static int history_fd = -1;
+
+/**
+ * Returns the i-th oldest event
+ */
+static struct history_record *record(unsigned int i) {
+  return &records[(first + i) % HISTORY_MAX];
+}
+
+/**
+ * Adds an event to the ring buffer, dropping the oldest one if it is full
+ */
+static void history_push(const struct history_record *rec) {
+  if (count < HISTORY_MAX) {
+    *record(count++) = *rec;
+  } else {
+    records[first] = *rec;
+    first = (first + 1) % HISTORY_MAX;
+  }
+}
+
+/**
+ * Replaces the contents of the history file by the events in the buffer
+ */
+static void history_compact(void) {
+  unsigned int i;
+
+  if (ftruncate(history_fd, 0)) {
+    bb_log(LOG_WARNING, "Could not truncate history: %s\n", strerror(errno));
+    return;
+  }
+  file_count = 0;
+  for (i = 0; i < count; i++) {
+    if (write(history_fd, record(i), sizeof *records) != sizeof *records) {
+      bb_log(LOG_WARNING, "Could not write history: %s\n", strerror(errno));
+      return;
+    }
+    file_count++;
+  }
+}
+
+/**
+ * Loads the history from a file and keeps it open for recording new events
+ * @param path The history file, history is not kept on disk if NULL or empty
+ * @return 0 on success, -1 on failure
+ */
+int history_open(const char *path) {
+  struct history_record rec;
+  ssize_t r;
+
+  records = calloc(HISTORY_MAX, sizeof *records);
+  if (!records) {
+    bb_log(LOG_WARNING, "Could not allocate history buffer\n");
+    return -1;
+  }
+  if (!path || !*path) {
+    return 0;
+  }
+  history_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history_fd == -1) {
+    bb_log(LOG_WARNING, "Could not open history file %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  while ((r = read(history_fd, &rec, sizeof rec)) == sizeof rec) {
+    history_push(&rec);
+    file_count++;
+  }
+  if (r != 0 || file_count > count) {
+    /* drop a partially written record and events that do not fit */
+    history_compact();
+  }
+  bb_log(LOG_DEBUG, "Loaded %u events from history file %s\n", count, path);
+  return 0;
+}
+
+/**
+ * Closes the history file and frees the history
+ */
+void history_close(void) {
+  if (history_fd != -1) {
+    close(history_fd);
+    history_fd = -1;
+  }
+  free(records);
+  records = NULL;
+  first = count = file_count = 0;
+}
+
+/**
+ * Records an event in the history
+ * @param event The kind of event
+ * @param uid The user that runs the application
+ * @param comm The command name of the application
+ */
+void history_record(enum history_event event, uid_t uid, const char *comm) {
+  struct history_record rec;
+
+  if (!records) {
+    return;
+  }
+  memset(&rec, 0, sizeof rec);
+  rec.time = time(NULL);
+  rec.uid = uid;
+  rec.event = event;
+  snprintf(rec.comm, sizeof rec.comm, "%s", comm);
+  history_push(&rec);
+
+  if (history_fd == -1) {
+    return;
+  }
+  if (file_count >= 2 * HISTORY_MAX) {
+    /* keep the file from growing without bounds */
+    history_compact();
+  } else if (write(history_fd, &rec, sizeof rec) == sizeof rec) {
+    file_count++;
+  } else {
+    bb_log(LOG_WARNING, "Could not write history: %s\n", strerror(errno));
+  }
+}
+
+/**
+ * Returns the index of the oldest event at or after the given time
+ */
+static unsigned int history_find(time_t t) {
+  unsigned int lo = 0, hi = count;
+
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    if ((time_t)record(mid)->time < t) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/**
+ * Predicts whether the card will be needed soon because an application was
+ * started around the same time on most of the previous days
+ * @param now The current time
+ * @param lead Number of seconds to look ahead
+ * @return true if an application is expected to connect within lead seconds
+ */
+bool history_predict_daily(time_t now, int lead) {
+  int day, days = 0, hits = 0;
+
+  if (!count) {
+    return false;
+  }
+  for (day = 1; day <= HISTORY_DAYS; day++) {
+    time_t from = now - day * 86400;
+    unsigned int i;
+
+    if (from < (time_t)record(0)->time) {
+      /* no history for this day */
+      break;
+    }
+    days++;
+    for (i = history_find(from); i < count &&
+            (time_t)record(i)->time < from + lead; i++) {
+      if (record(i)->event == HISTORY_CONNECT) {
+        hits++;
+        break;
+      }
+    }
+  }
+  return hits >= HISTORY_MIN_SAMPLES && 2 * hits >= days;
+}
+
+/**
+ * Predicts whether another application will connect shortly after the given
+ * application has disconnected, based on earlier disconnects of it
+ * @param uid The user that ran the application
+ * @param comm The command name of the application
+ * @param window Number of seconds to look ahead
+ * @return true if an application is expected to connect within window seconds
+ */
+bool history_predict_followup(uid_t uid, const char *comm, int window) {
+  time_t now = time(NULL);
+  int samples = 0, hits = 0;
+  unsigned int i;
+
+  for (i = count; i-- > 0 && samples < HISTORY_FOLLOWUP_SAMPLES;) {
+    struct history_record *rec = record(i);
+    unsigned int j;
+
+    if (rec->event != HISTORY_DISCONNECT || rec->uid != uid ||
+            strncmp(rec->comm, comm, sizeof rec->comm - 1)) {
+      continue;
+    }
+    if ((time_t)rec->time + window > now) {
+      /* the outcome of this disconnect is not known yet */
+      continue;
+    }
+    samples++;
+    for (j = i + 1; j < count && record(j)->time < rec->time + window; j++) {
+      if (record(j)->event == HISTORY_CONNECT) {
+        hits++;
+        break;
+      }
+    }
+  }
+  return samples >= HISTORY_MIN_SAMPLES && 2 * hits >= samples;
+}
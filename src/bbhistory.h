@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage history of the discrete card, used to predict demand
+ */
+#pragma once
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Length of a command name including the null byte, as in /proc/PID/comm */
+#define HISTORY_COMM_LEN 16
+
+/* Maximum number of events that are kept, older events are dropped */
+#define HISTORY_MAX 8192
+
+enum history_event {
+  HISTORY_CONNECT = 1, /* an application started using the card */
+  HISTORY_DISCONNECT = 2, /* an application stopped using the card */
+};
+
+int history_open(const char *path);
+void history_close(void);
+void history_record(enum history_event event, uid_t uid, const char *comm);
+bool history_predict_daily(time_t now, int lead);
+bool history_predict_followup(uid_t uid, const char *comm, int window);
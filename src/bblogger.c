@@ -32,10 +32,6 @@
 #include "bblogger.h"
 #include "bbconfig.h"
 
-char x_output_buffer[512]; /* Xorg output buffer */
-int x_buffer_pos = 0;/* Xorg output buffer position */
-
-
 /**
  * Initialize log capabilities. Return 0 on success
  */
@@ -134,7 +130,7 @@ static void parse_xorg_output(char * string){
   char * valid = 0; /* Helper for finding correct ConnectedMonitor setting */
   char * valid_end = 0; /* Helper for finding correct ConnectedMonitor setting */
   /* message to be logged with set_bb_error */
-  char error_buffer[strlen("[XORG] ") + sizeof (x_output_buffer)];
+  char error_buffer[strlen("[XORG] ") + XORG_OUTPUT_SIZE];
 
   /* don't log an empty line or a line with a single whitespace */
   if (string[0] == 0 || (string[1] == 0 && isspace(string[0]))) {
@@ -206,52 +202,52 @@ static void parse_xorg_output(char * string){
 }
 
 /** Will check the xorg output pipe and parse any waiting messages.
- * Doesn't take any parameters and doesn't return anything.
+ * @param x The output of an X server
  */
-void check_xorg_pipe(void){
-  if (bb_status.x_pipe[0] == -1){return;}
+void check_xorg_pipe(struct xorg_output *x){
+  if (x->pipe[0] == -1){return;}
   int repeat;
 
   do{
     repeat = 0;
     /* attempt to read at most the entire buffer full. */
-    int r = read(bb_status.x_pipe[0], x_output_buffer + x_buffer_pos,
-            sizeof (x_output_buffer) - x_buffer_pos - 1);
+    int r = read(x->pipe[0], x->buffer + x->pos,
+            sizeof (x->buffer) - x->pos - 1);
     if (r > 0){
-      x_buffer_pos += r;
+      x->pos += r;
       /* append a null byte to close the string */
-      x_output_buffer[x_buffer_pos] = 0;
-      if (x_buffer_pos == sizeof (x_output_buffer) - 1) {
+      x->buffer[x->pos] = 0;
+      if (x->pos == sizeof (x->buffer) - 1) {
         /* line / buffer is full, process the remaining buffer the next round */
         repeat = 1;
       }
     }else{
       if (r == 0 || (errno != EAGAIN && r == -1)){
         /* the pipe is closed/invalid. Clean up. */
-        if (bb_status.x_pipe[0] != -1){close(bb_status.x_pipe[0]); bb_status.x_pipe[0] = -1;}
-        if (bb_status.x_pipe[1] != -1){close(bb_status.x_pipe[1]); bb_status.x_pipe[1] = -1;}
+        if (x->pipe[0] != -1){close(x->pipe[0]); x->pipe[0] = -1;}
+        if (x->pipe[1] != -1){close(x->pipe[1]); x->pipe[1] = -1;}
       }
     }
-    /* while x_buffer_pos>0 and a \n is in the buffer, parse.
+    /* while x->pos>0 and a \n is in the buffer, parse.
      * if buffer is full, parse also. */
-    while (x_buffer_pos > 0){
-      char * foundnewline = strchr(x_output_buffer, '\n');
-      if (!foundnewline || foundnewline-x_output_buffer > x_buffer_pos){
+    while (x->pos > 0){
+      char * foundnewline = strchr(x->buffer, '\n');
+      if (!foundnewline || foundnewline-x->buffer > x->pos){
         /* cancel search if no newline, try again later
          * except if buffer is full, then parse */
-        if (x_buffer_pos == sizeof (x_output_buffer) - 1) {
-          parse_xorg_output(x_output_buffer);
-          x_buffer_pos = 0;
+        if (x->pos == sizeof (x->buffer) - 1) {
+          parse_xorg_output(x->buffer);
+          x->pos = 0;
         }
         break;
       }
       foundnewline[0] = 0;/* convert newline to null byte */
-      parse_xorg_output(x_output_buffer);/* parse the line */
+      parse_xorg_output(x->buffer);/* parse the line */
       char *next_part = foundnewline + 1; /* begin of next line */
-      int size = next_part - x_output_buffer;
-      x_buffer_pos -= size;/* cut the parsed part from the buffer size */
-      if (x_buffer_pos > 0){/* move the unparsed part left, if any */
-        memmove(x_output_buffer, next_part, x_buffer_pos);
+      int size = next_part - x->buffer;
+      x->pos -= size;/* cut the parsed part from the buffer size */
+      if (x->pos > 0){/* move the unparsed part left, if any */
+        memmove(x->buffer, next_part, x->pos);
       }
     }
   }while(repeat);
@@ -43,9 +43,19 @@ void bb_log(int priority, char* msg_format, ...);
  */
 void bb_closelog(void);
 
+/* Size of the buffer for a line of X output */
+#define XORG_OUTPUT_SIZE 512
+
+/* Output of an X server that is parsed line by line */
+struct xorg_output {
+  int pipe[2]; /* pipes for reading/writing output from X's stdout/stderr */
+  char buffer[XORG_OUTPUT_SIZE];
+  int pos; /* length of the unparsed output in buffer */
+};
+
 /** Will check the xorg output pipe and parse any waiting messages.
- * Doesn't take any parameters and doesn't return anything.
+ * The pipe is closed and set to -1 when X has closed it.
  */
-void check_xorg_pipe(void);
+void check_xorg_pipe(struct xorg_output *x);
 
 #endif
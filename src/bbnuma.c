@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NUMA placement of the secondary X server and the applications. The kernel
+ * exposes the CPUs close to a PCI device in local_cpulist and its memory node
+ * in numa_node. A process is placed next to the card by restricting it to
+ * these CPUs and by preferring memory from that node. Memory is preferred
+ * rather than bound, so that allocations fall back to other nodes instead of
+ * failing when the node of the card runs out of memory. The memory policy is
+ * set with the system call directly, which avoids a dependency on libnuma.
+ */
+
+/* for sched_setaffinity and the CPU_* macros */
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "bbnuma.h"
+#include "bblogger.h"
+
+/* Number of NUMA nodes the node mask passed to the kernel can hold */
+#define NUMA_NODES_MAX 1024
+#define NUMA_MASK_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/**
+ * Reads the first line of a sysfs attribute
+ * @param path The path of the attribute
+ * @param buf The buffer receiving the line without newline
+ * @param size The size of buf
+ * @return The length of the line, -1 on failure
+ */
+static int read_line(const char *path, char *buf, size_t size) {
+  ssize_t len;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return -1;
+  }
+  len = read(fd, buf, size - 1);
+  close(fd);
+  if (len < 0) {
+    return -1;
+  }
+  buf[len] = 0;
+  buf[strcspn(buf, "\n")] = 0;
+  return strlen(buf);
+}
+
+/**
+ * Parses a CPU list such as "0-3,8,10-11" as found in sysfs
+ * @param cpulist The list to be parsed
+ * @param set The set receiving the CPUs
+ * @return The number of CPUs in the list, -1 if it is invalid
+ */
+static int cpulist_parse(const char *cpulist, cpu_set_t *set) {
+  const char *p = cpulist;
+  int count = 0;
+
+  CPU_ZERO(set);
+  while (*p) {
+    char *end;
+    unsigned long first, last;
+
+    if (*p < '0' || *p > '9') {
+      return -1;
+    }
+    first = last = strtoul(p, &end, 10);
+    if (*end == '-') {
+      p = end + 1;
+      if (*p < '0' || *p > '9') {
+        return -1;
+      }
+      last = strtoul(p, &end, 10);
+    }
+    if (last < first || last >= CPU_SETSIZE) {
+      return -1;
+    }
+    for (; first <= last; first++) {
+      CPU_SET(first, set);
+      count++;
+    }
+    if (*end == ',') {
+      end++;
+    } else if (*end) {
+      return -1;
+    }
+    p = end;
+  }
+  return count;
+}
+
+/**
+ * Fills a placement from a CPU list and a node, as read from sysfs or
+ * received from the daemon
+ * @param cpulist The local CPUs in list format, may be empty
+ * @param node The NUMA node, -1 if unknown
+ * @param placement The placement to be filled
+ * @return true if the placement restricts the CPUs or the memory node, false
+ * if there is nothing to place
+ */
+bool numa_placement_parse(const char *cpulist, int node,
+        struct numa_placement *placement) {
+  cpu_set_t set;
+
+  placement->node = node >= 0 && node < NUMA_NODES_MAX ? node : -1;
+  placement->cpulist[0] = 0;
+  if (strlen(cpulist) < sizeof placement->cpulist &&
+          cpulist_parse(cpulist, &set) > 0) {
+    strcpy(placement->cpulist, cpulist);
+  } else if (*cpulist) {
+    bb_log(LOG_WARNING, "Ignoring invalid CPU list: %s\n", cpulist);
+  }
+  return placement->node != -1 || placement->cpulist[0];
+}
+
+/**
+ * Reads the CPUs and the memory node local to a card from sysfs. A card
+ * without a node that is local to all online CPUs, as on systems with a
+ * single node, gets no placement.
+ * @param bus_id The card
+ * @param placement The placement to be filled
+ * @return true if the card has a placement, false otherwise
+ */
+bool numa_placement_read(struct pci_bus_id *bus_id,
+        struct numa_placement *placement) {
+  char path[256], buf[16], cpulist[NUMA_CPULIST_MAX], online[NUMA_CPULIST_MAX];
+  int node = -1;
+
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME
+          "/numa_node", bus_id->domain, bus_id->bus, bus_id->slot,
+          bus_id->func);
+  if (read_line(path, buf, sizeof buf) > 0) {
+    node = atoi(buf);
+  }
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME
+          "/local_cpulist", bus_id->domain, bus_id->bus, bus_id->slot,
+          bus_id->func);
+  if (read_line(path, cpulist, sizeof cpulist) <= 0) {
+    cpulist[0] = 0;
+  }
+  if (read_line(PCI_ROOT "/sys/devices/system/cpu/online", online,
+          sizeof online) > 0 && !strcmp(cpulist, online)) {
+    cpulist[0] = 0;
+  }
+  return numa_placement_parse(cpulist, node, placement);
+}
+
+/**
+ * Places the calling process next to a card. Children inherit the placement,
+ * so this is done right before exec or before starting an application.
+ * @param placement The placement of the card
+ * @return 0 on success, -1 if the CPUs or the memory node could not be set
+ */
+int numa_placement_apply(const struct numa_placement *placement) {
+  int ret = 0;
+
+  if (placement->cpulist[0]) {
+    cpu_set_t set;
+    cpulist_parse(placement->cpulist, &set);
+    if (sched_setaffinity(0, sizeof set, &set)) {
+      bb_log(LOG_WARNING, "Could not run on CPUs %s: %s\n",
+              placement->cpulist, strerror(errno));
+      ret = -1;
+    }
+  }
+  if (placement->node != -1) {
+    unsigned long nodemask[NUMA_NODES_MAX / NUMA_MASK_BITS] = {0};
+    nodemask[placement->node / NUMA_MASK_BITS] =
+            1UL << (placement->node % NUMA_MASK_BITS);
+    /* the kernel ignores the last bit of maxnode */
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+            NUMA_NODES_MAX + 1)) {
+      bb_log(LOG_WARNING, "Could not prefer memory of NUMA node %i: %s\n",
+              placement->node, strerror(errno));
+      ret = -1;
+    }
+  }
+  return ret;
+}
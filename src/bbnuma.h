@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NUMA placement: the CPUs and the memory node close to a discrete card are
+ * read from sysfs, so the secondary X server and, if configured, the
+ * applications started by optirun run next to the card.
+ */
+#pragma once
+#include <stdbool.h>
+#include "pci.h"
+
+/* Maximum length of a CPU list such as "0-7,16-23" */
+#define NUMA_CPULIST_MAX 256
+
+/* CPUs and memory node local to a card */
+struct numa_placement {
+  int node; /* NUMA node of the card, -1 if unknown */
+  char cpulist[NUMA_CPULIST_MAX]; /* local CPUs in list format, "" if unknown */
+};
+
+bool numa_placement_read(struct pci_bus_id *bus_id,
+        struct numa_placement *placement);
+bool numa_placement_parse(const char *cpulist, int node,
+        struct numa_placement *placement);
+int numa_placement_apply(const struct numa_placement *placement);
@@ -38,10 +38,13 @@
 #include <unistd.h>
 #include <stdio.h>
 #include "bbrun.h"
+#include "bbnuma.h"
 #include "bblogger.h"
 
 int handler_set = 0;
 int dowait = 1;
+/* self-pipe written to when a child exits, see bb_run_child_fd */
+static int child_pipe[2] = {-1, -1};
 
 /// Socket list structure for use in main_loop.
 
@@ -62,6 +65,9 @@ static void pidlist_add(pid_t newpid) {
   curr->prev = 0;
   // the PID is inserted BEFORE the first PID, this should not matter
   curr->next = pidlist_start ? pidlist_start : 0;
+  if (pidlist_start) {
+    pidlist_start->prev = curr;
+  }
   pidlist_start = curr;
 }
 
@@ -103,21 +109,29 @@ static void childsig_handler(int signum) {
   if (signum != SIGCHLD) {
     return;
   }
+  int saved_errno = errno;
   int chld_stat = 0;
-  /* Wait for the child to exit */
-  pid_t ret = wait(&chld_stat);
-  /* Log the child termination and return value */
-  if (ret == -1) {
-    bb_log(LOG_DEBUG, "SIGCHILD received, but wait failed with %s\n",
-            strerror(errno));
-  } else if (WIFEXITED(chld_stat)) {
-    bb_log(LOG_DEBUG, "Process with PID %i returned code %i\n", ret,
-            WEXITSTATUS (chld_stat));
-  } else if (WIFSIGNALED(chld_stat)) {
-    bb_log(LOG_DEBUG, "Process with PID %i terminated with %i\n", ret,
-            WTERMSIG(chld_stat));
+  pid_t ret;
+  /* Wait for all exited children, several exits may share one signal */
+  while ((ret = waitpid(-1, &chld_stat, WNOHANG)) > 0) {
+    /* Log the child termination and return value */
+    if (WIFEXITED(chld_stat)) {
+      bb_log(LOG_DEBUG, "Process with PID %i returned code %i\n", ret,
+              WEXITSTATUS (chld_stat));
+    } else if (WIFSIGNALED(chld_stat)) {
+      bb_log(LOG_DEBUG, "Process with PID %i terminated with %i\n", ret,
+              WTERMSIG(chld_stat));
+    }
+    pidlist_remove(ret);
+  }
+  /* wake up the event loop, if any */
+  if (child_pipe[1] != -1) {
+    char c = 0;
+    if (write(child_pipe[1], &c, 1) < 0) {
+      /* pipe is full, a wakeup is pending already */
+    }
   }
-  pidlist_remove(ret);
+  errno = saved_errno;
 }//childsig_handler
 
 static void check_handler(void) {
@@ -134,6 +148,24 @@ static void check_handler(void) {
 
 static void bb_run_exec_detached(char **argv);
 
+/**
+ * Returns a file descriptor that becomes readable when a child process has
+ * exited. Any data must be drained by the reader, the descriptor is not
+ * inherited by child processes.
+ * @return A file descriptor or -1 on failure
+ */
+int bb_run_child_fd(void) {
+  if (child_pipe[0] == -1) {
+    if (pipe2(child_pipe, O_NONBLOCK | O_CLOEXEC)) {
+      bb_log(LOG_ERR, "Could not create child notification pipe: %s\n",
+              strerror(errno));
+      return -1;
+    }
+  }
+  check_handler();
+  return child_pipe[0];
+}
+
 /**
  * Forks and runs the given application and waits for the process to finish
  *
@@ -187,17 +219,41 @@ int bb_run_fork(char **argv, int detached) {
  * function then returns immediately.
  * stderr and stdout of the ran application is redirected to the parameter redirect.
  * stdin is redirected to /dev/null always.
+ * The application starts with SIGUSR1 ignored and unblocked, which makes an X
+ * server send SIGUSR1 to its parent when it is ready to accept connections.
  *
  * @param argv The arguments values, the first one is the program
  * @param ldpath The library path to be used if any (may be NULL)
  * @param redirect The file descriptor to redirect stdout/stderr to. Must be valid and open.
+ * @param notify_fd A file descriptor that must stay open in the application
+ * (like the one passed to Xorg -displayfd) or -1 if none
+ * @param placement The CPUs and memory node to run the application on, NULL to
+ * keep those of the caller
  * @return The childs process ID
  */
-pid_t bb_run_fork_ld_redirect(char **argv, char *ldpath, int redirect) {
+pid_t bb_run_fork_ld_redirect(char **argv, char *ldpath, int redirect,
+        int notify_fd, const struct numa_placement *placement) {
+  sigset_t chld_mask, old_mask;
   check_handler();
+  /* a child failing early must not exit before it is in the list of PIDs */
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
   // Fork and attempt to run given application
   pid_t ret = fork();
   if (ret == 0) {
+    /* X notifies its parent of readiness only if SIGUSR1 is ignored */
+    signal(SIGUSR1, SIG_IGN);
+    sigdelset(&old_mask, SIGUSR1);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (notify_fd != -1) {
+      /* inherit this descriptor through exec */
+      fcntl(notify_fd, F_SETFD, 0);
+    }
+    if (placement) {
+      /* failing to place the application is not fatal */
+      numa_placement_apply(placement);
+    }
     if (ldpath && *ldpath) {
       char *current_path = getenv("LD_LIBRARY_PATH");
       /* Fork went ok, set environment if necessary */
@@ -231,8 +287,10 @@ pid_t bb_run_fork_ld_redirect(char **argv, char *ldpath, int redirect) {
       // Fork went ok, parent process continues
       bb_log(LOG_DEBUG, "Process %s started, PID %i.\n", argv[0], ret);
       pidlist_add(ret);
+      sigprocmask(SIG_SETMASK, &old_mask, NULL);
     } else {
       // Fork failed
+      sigprocmask(SIG_SETMASK, &old_mask, NULL);
       bb_log(LOG_ERR, "Process %s could not be started. fork() failed.\n", argv[0]);
       return 0;
     }
@@ -240,6 +298,36 @@ pid_t bb_run_fork_ld_redirect(char **argv, char *ldpath, int redirect) {
   return ret;
 }
 
+/**
+ * Forks and runs the given application. The function returns immediately,
+ * bb_is_running tells whether the process has finished.
+ *
+ * @param argv The arguments values, the first one is the application path or name
+ * @return The childs process ID or 0 on failure
+ */
+pid_t bb_run_fork_nowait(char **argv) {
+  sigset_t chld_mask, old_mask;
+  check_handler();
+  /* a short-lived child must not exit before it is in the list of PIDs */
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+  pid_t ret = fork();
+  if (ret == 0) {
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    bb_run_exec(argv);
+  } else if (ret > 0) {
+    bb_log(LOG_DEBUG, "Process %s started, PID %i.\n", argv[0], ret);
+    pidlist_add(ret);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  } else {
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    bb_log(LOG_ERR, "Process %s could not be started. fork() failed.\n", argv[0]);
+    return 0;
+  }
+  return ret;
+}
+
 /**
  * Forks and runs the given application, waits for a maximum of timeout seconds for process to finish.
  *
@@ -24,11 +24,18 @@
 #pragma once
 #include <sys/types.h>
 
+struct numa_placement;
+
 /* Forks and runs the given application. */
 int bb_run_fork(char** argv, int detached);
 
-/// Forks and runs the given application, using an LD_LIBRARY_PATH.
-pid_t bb_run_fork_ld_redirect(char** argv, char * ldpath, int redirect);
+/// Forks and runs the given application, using an LD_LIBRARY_PATH and an
+/// optional NUMA placement.
+pid_t bb_run_fork_ld_redirect(char** argv, char * ldpath, int redirect,
+        int notify_fd, const struct numa_placement *placement);
+
+/// Forks and runs the given application, returning immediately.
+pid_t bb_run_fork_nowait(char** argv);
 
 /// Forks and runs the given application, waits for a maximum of timeout seconds for process to finish.
 void bb_run_fork_wait(char** argv, int timeout);
@@ -48,6 +55,9 @@ void bb_stop_all(void);
 /// Attempts to run the given application, replacing the current process
 void bb_run_exec(char ** argv);
 
+/// Returns a file descriptor that becomes readable when a child has exited.
+int bb_run_child_fd(void);
+
 /// Cancels waiting for processes to finish - use when doing a fast shutdown.
 void bb_run_stopwaiting(void);
 
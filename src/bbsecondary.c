@@ -29,9 +29,15 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/signalfd.h>
 #include "bbsecondary.h"
+#include "bbenergy.h"
 #include "switch/switching.h"
 #include "bbrun.h"
+#include "bbevent.h"
+#include "bbuevent.h"
+#include "bbnuma.h"
 #include "bblogger.h"
 #include "bbconfig.h"
 #include "pci.h"
@@ -82,141 +88,1351 @@ static char *xorg_path_w_driver(char *x_conf_file, char *driver) {
   return path;
 }
 
+/* Progress of an asynchronous start of a card */
+enum start_state {
+  START_IDLE, /* no start in progress */
+  START_WAIT, /* waiting for another card to finish unloading the driver */
+  START_POWER, /* waiting for the card to be powered on */
+  START_LOADING, /* waiting for rmmod of a mismatched driver or modprobe */
+};
+
+/* Interval for connecting to X if it did not notify readiness (yet) */
+#define X_POLL_INTERVAL 1000
+
+/* Progress of an asynchronous teardown of a card */
+enum teardown_state {
+  TEARDOWN_IDLE, /* no teardown in progress */
+  TEARDOWN_X, /* waiting for the X servers to exit */
+  TEARDOWN_HOLD, /* keeping the card on for the minimum on time */
+  TEARDOWN_UNLOAD, /* waiting for the driver to be unloaded */
+  TEARDOWN_POWER, /* waiting for the card to be powered off */
+};
+
+/* An X server on a card. The servers of a card share its driver, each one
+ * runs on its own display. */
+struct xserver {
+  struct secondary *card;
+  int index;
+  char *display;
+  pid_t pid;
+  struct xorg_output output;
+  /* whether the running X server has signalled that it accepts connections */
+  bool is_ready;
+  bool pending; /* a start has been requested and not been answered yet */
+  bool starting; /* launched, waiting for X to accept connections */
+  bool stopping; /* terminated, waiting for X to exit */
+  bool displayfd; /* X has been launched with -displayfd */
+  bool retried; /* X has been restarted without -displayfd */
+  /* read end of the pipe passed to X as -displayfd, -1 if none */
+  int displayfd_pipe;
+  int kills; /* number of signals sent to X */
+  long long requested; /* time at which the start was requested */
+  long long launched; /* time at which the X server was launched */
+  struct bb_timer deadline; /* timeout for X to accept connections */
+  struct bb_timer poll; /* next attempt to connect to X */
+  struct bb_timer stop; /* escalation for X to exit */
+};
+
+/* A discrete card. The power switch and the kernel module are shared by all
+ * cards, only the X servers and the tier are tracked per card. */
+struct secondary {
+  int index;
+  struct pci_bus_id *bus_id;
+  struct xserver servers[SECONDARY_POOL_MAX];
+  int server_count;
+  /* lowest tier the daemon wants the card in, the driver and power are only
+   * released if no card wants them */
+  enum secondary_tier wanted;
+  /* CPUs and memory node close to the card, see secondary_placement */
+  struct numa_placement placement;
+  bool placed;
+
+  struct {
+    enum start_state state;
+    bool result; /* outcome of the last start, see start_secondary */
+    /* the waiters have been told that the start failed, modprobe is left to
+     * finish and the card follows the wanted tier once it has exited */
+    bool aborted;
+    pid_t pid; /* modprobe, or rmmod while unload is set */
+    char unload[BUFFER_SIZE]; /* mismatched driver being unloaded, or empty */
+    int polls; /* number of checks whether that driver is still loaded */
+    long long begin; /* time at which the start was requested */
+    long long powered; /* time at which the card was powered on */
+    long long driver; /* time at which the driver was loaded */
+    struct bb_timer deadline; /* timeout for modprobe and rmmod */
+    struct bb_timer poll; /* polling for the mismatched driver to go */
+  } start;
+
+  struct {
+    enum teardown_state state;
+    enum secondary_tier target; /* tier at which the teardown stops */
+    bool cancelled; /* a start is waiting for the current stage to finish */
+    int polls; /* number of checks whether the driver is still loaded */
+    pid_t rmmod_pid;
+    long long begin; /* time at which the teardown was started */
+    long long stage_begin; /* time at which the current stage was started */
+    long long saved; /* estimated time saved by the cancellation */
+    char driver[BUFFER_SIZE]; /* driver that is being unloaded */
+    struct bb_timer timer; /* timeout for rmmod, polling for the driver */
+  } teardown;
+
+  /* Duration of the stages of the last full start and teardown in ms, used to
+   * estimate the time saved by cancelling a teardown */
+  struct {
+    long long power_on;
+    long long driver_load;
+    long long driver_unload;
+    long long power_off;
+    long long x_start;
+  } stage_cost;
+
+  /* Current power tier and time spent in each tier */
+  struct {
+    enum secondary_tier current;
+    long long since; /* time at which the current tier was entered */
+    long long residency[TIER_COUNT]; /* ms spent in completed periods */
+  } tier;
+};
+
+static struct secondary *secondaries[SECONDARY_MAX];
+static int secondaries_count;
+
+/* Counters for cancelled teardowns */
+static struct secondary_teardowns teardown_stats;
+
+static const char *tier_names[TIER_COUNT] = {
+  [TIER_OFF] = "off",
+  [TIER_DRIVER] = "driver",
+  [TIER_X] = "X",
+};
+
+/* whether X supports -displayfd, cleared if X failed to start with it */
+static bool use_displayfd = true;
+
+static secondary_callback start_callback;
+static secondary_change_callback change_callback;
+
+/**
+ * Adds a discrete card. Must be called before secondary_init.
+ * @param bus_id The PCI Bus ID of the card, owned by the card afterwards
+ * @return The card, or NULL if no more cards can be added
+ */
+struct secondary *secondary_add(struct pci_bus_id *bus_id) {
+  struct secondary *s;
+
+  if (secondaries_count >= SECONDARY_MAX) {
+    bb_log(LOG_WARNING, "Ignoring discrete card, at most %i are supported\n",
+            SECONDARY_MAX);
+    return NULL;
+  }
+  s = calloc(1, sizeof *s);
+  if (!s) {
+    bb_log(LOG_ERR, "Could not allocate memory for discrete card\n");
+    return NULL;
+  }
+  s->index = secondaries_count;
+  s->bus_id = bus_id;
+  s->wanted = TIER_OFF;
+  s->tier.current = TIER_OFF;
+  s->tier.since = bb_event_now();
+  secondaries[secondaries_count++] = s;
+  return s;
+}
+
+/**
+ * Adds an X server to a card. Must be called before secondary_init.
+ * @param s The card
+ * @param display The X display on which the server is started
+ * @return The index of the X server, or -1 if no more servers can be added
+ */
+int secondary_add_server(struct secondary *s, const char *display) {
+  struct xserver *x;
+
+  if (s->server_count >= SECONDARY_POOL_MAX) {
+    bb_log(LOG_WARNING, "Ignoring X server on %s, at most %i are supported\n",
+            display, SECONDARY_POOL_MAX);
+    return -1;
+  }
+  x = &s->servers[s->server_count];
+  x->display = strdup(display);
+  if (!x->display) {
+    bb_log(LOG_ERR, "Could not allocate memory for X server\n");
+    return -1;
+  }
+  x->card = s;
+  x->index = s->server_count;
+  x->output.pipe[0] = -1;
+  x->output.pipe[1] = -1;
+  x->displayfd_pipe = -1;
+  return s->server_count++;
+}
+
+/**
+ * Returns the number of discrete cards
+ */
+int secondary_count(void) {
+  return secondaries_count;
+}
+
+/**
+ * Returns a discrete card
+ * @param index A number between 0 and secondary_count() - 1
+ * @return The card or NULL if there is no such card
+ */
+struct secondary *secondary_get(int index) {
+  if (index < 0 || index >= secondaries_count) {
+    return NULL;
+  }
+  return secondaries[index];
+}
+
+/**
+ * Returns the index of a card
+ */
+int secondary_index(struct secondary *s) {
+  return s->index;
+}
+
+/**
+ * Returns the CPUs and memory node close to a card, NULL if the card has no
+ * placement or the NUMA policy disables it
+ */
+const struct numa_placement *secondary_placement(struct secondary *s) {
+  return s->placed ? &s->placement : NULL;
+}
+
+/**
+ * Returns the number of X servers of a card
+ */
+int secondary_server_count(struct secondary *s) {
+  return s->server_count;
+}
+
+/**
+ * Returns the X display of an X server of a card
+ */
+const char *secondary_server_display(struct secondary *s, int server) {
+  return s->servers[server].display;
+}
+
+/**
+ * Returns the PID of an X server of a card, 0 if it has not been started
+ */
+pid_t secondary_server_pid(struct secondary *s, int server) {
+  return s->servers[server].pid;
+}
+
+/**
+ * Returns the state of an X server of a card
+ */
+enum secondary_server_state secondary_server_state(struct secondary *s,
+        int server) {
+  struct xserver *x = &s->servers[server];
+
+  if (x->stopping) {
+    return SERVER_STOPPING;
+  }
+  if (x->pending || x->starting) {
+    return SERVER_STARTING;
+  }
+  if (x->is_ready && bb_is_running(x->pid)) {
+    return SERVER_READY;
+  }
+  return SERVER_OFF;
+}
+
+/**
+ * Event handler for the X output pipe
+ */
+static void xorg_pipe_event(int fd, unsigned int events, void *data) {
+  struct xserver *x = data;
+  (void) events; /* unused parameter */
+  check_xorg_pipe(&x->output);
+  //the pipe is closed when X has gone
+  if (x->output.pipe[0] == -1) {
+    bb_event_remove(fd);
+  }
+}
+
+/**
+ * Whether any X server of a card is running
+ */
+static bool servers_running(struct secondary *s) {
+  int i;
+  for (i = 0; i < s->server_count; i++) {
+    if (bb_is_running(s->servers[i].pid)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Whether an X server of a card is up, which implies that the driver is loaded
+ */
+static bool servers_up(struct secondary *s) {
+  int i;
+  for (i = 0; i < s->server_count; i++) {
+    struct xserver *x = &s->servers[i];
+    if (!x->stopping && bb_is_running(x->pid)) {
+      return true;
+    }
+  }
+  return false;
+}
+/**
+ * Whether another card than s uses the driver or power of the cards, or is
+ * about to use or release them
+ */
+static bool others_need_driver(struct secondary *s) {
+  int i;
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *other = secondaries[i];
+    if (other != s && (other->wanted >= TIER_DRIVER ||
+            other->start.state != START_IDLE ||
+            other->teardown.state != TEARDOWN_IDLE)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Whether any card has its driver bound, the card cannot be powered off then
+ */
+static bool drivers_bound(void) {
+  int i;
+  for (i = 0; i < secondaries_count; i++) {
+    if (pci_get_driver(NULL, secondaries[i]->bus_id, 0)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Whether another card is unloading the driver or powering off at the moment
+ */
+static bool driver_unloading(void) {
+  int i;
+  for (i = 0; i < secondaries_count; i++) {
+    if (secondaries[i]->teardown.state == TEARDOWN_UNLOAD ||
+            secondaries[i]->teardown.state == TEARDOWN_POWER) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Returns the name of a power tier
+ */
+const char *secondary_tier_name(enum secondary_tier t) {
+  return t < TIER_COUNT ? tier_names[t] : "unknown";
+}
+
+/**
+ * Determines the current power tier of a card from the state of X, the card
+ * and the driver
+ */
+static enum secondary_tier tier_detect(struct secondary *s) {
+  if (servers_running(s)) {
+    return TIER_X;
+  }
+  if (switch_status() == SWITCH_OFF) {
+    return TIER_OFF;
+  }
+  if (module_is_loaded(bb_config.driver) == 1) {
+    return TIER_DRIVER;
+  }
+  return TIER_OFF;
+}
+
+/**
+ * Tells the daemon that the state of a card has changed, see secondary_init
+ */
+static void state_notify(void) {
+  if (change_callback) {
+    change_callback();
+  }
+}
+
+/**
+ * Accounts the time spent in the previous tier if the tier of any card has
+ * changed, and reports the state of the cards for the energy accounting and
+ * to the daemon. Must be called whenever X, the driver or the card power
+ * changes
+ */
+static void tier_update(void) {
+  enum secondary_tier highest = TIER_OFF;
+  long long now = bb_event_now();
+  int i;
+
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+    enum secondary_tier t = tier_detect(s);
+
+    if (t > highest) {
+      highest = t;
+    }
+    if (t == s->tier.current) {
+      continue;
+    }
+    s->tier.residency[s->tier.current] += now - s->tier.since;
+    bb_log(LOG_INFO, "Power tier of card %i changed from %s to %s after %.1f"
+            " seconds\n", s->index, tier_names[s->tier.current], tier_names[t],
+            (now - s->tier.since) / 1000.0);
+    s->tier.current = t;
+    s->tier.since = now;
+  }
+  if (highest == TIER_X) {
+    energy_set_state(ENERGY_X);
+  } else if (highest == TIER_DRIVER) {
+    energy_set_state(ENERGY_DRIVER);
+  } else {
+    /* a card that cannot be switched off is on */
+    energy_set_state(switch_status() == SWITCH_OFF ? ENERGY_OFF : ENERGY_ON);
+  }
+  state_notify();
+}
+
+/**
+ * Accounts a change of the card power that no card has requested, such as a
+ * card suspended by the kernel
+ */
+void secondary_power_changed(void) {
+  tier_update();
+}
+
+/**
+ * Returns the current power tier of a card
+ */
+enum secondary_tier secondary_current_tier(struct secondary *s) {
+  return s->tier.current;
+}
+
+/**
+ * Returns the time at which a card entered its current power tier
+ * @param residency Receives the time in ms spent in each tier before that
+ */
+long long secondary_tier_since(struct secondary *s,
+        long long residency[TIER_COUNT]) {
+  int t;
+  for (t = 0; t < TIER_COUNT; t++) {
+    residency[t] = s->tier.residency[t];
+  }
+  return s->tier.since;
+}
+
+/**
+ * Returns the time in ms a start of a card from the off tier took the last
+ * time
+ */
+long long secondary_cold_start_cost(struct secondary *s) {
+  return s->stage_cost.power_on + s->stage_cost.driver_load +
+          s->stage_cost.x_start;
+}
+
+/**
+ * Returns the time a card spent in each tier in ms
+ * @param s The card
+ * @param residency Array that receives the time for each tier
+ */
+void secondary_tier_residency(struct secondary *s,
+        long long residency[TIER_COUNT]) {
+  int t;
+  for (t = 0; t < TIER_COUNT; t++) {
+    residency[t] = s->tier.residency[t];
+  }
+  residency[s->tier.current] += bb_event_now() - s->tier.since;
+}
+
+/**
+ * Notifies the daemon about the (partial) result of a start
+ * @param s The card that is being started
+ * @param server -1 if the card is ready for use without X, otherwise the
+ * X server whose start has finished
+ * @param success true if the card (and X) can be used, false otherwise
+ */
+static void start_notify(struct secondary *s, int server, bool success) {
+  state_notify();
+  if (start_callback) {
+    start_callback(s, server, success);
+  }
+}
+
+static void start_x(struct xserver *x);
+static void teardown_cancel(struct secondary *s, bool need_x);
+static void teardown_x_exited(struct secondary *s);
+static void teardown_rmmod_exited(struct secondary *s);
+static void teardown_unload_poll(void *data);
+
+/**
+ * Ends the start of an X server, notifying all waiters
+ * @param x The X server that is being started
+ * @param success true if X is ready, false if the start failed
+ */
+static void server_finish(struct xserver *x, bool success) {
+  bb_timer_stop(&x->deadline);
+  bb_timer_stop(&x->poll);
+  if (x->displayfd_pipe != -1) {
+    bb_event_remove(x->displayfd_pipe);
+    close(x->displayfd_pipe);
+    x->displayfd_pipe = -1;
+  }
+  x->starting = false;
+  x->pending = false;
+  start_notify(x->card, x->index, success);
+}
+
+/**
+ * Launches the X servers that have been requested while the card was
+ * starting, or fails them if the card could not be started
+ */
+static void start_servers(struct secondary *s) {
+  int i;
+  for (i = 0; i < s->server_count; i++) {
+    struct xserver *x = &s->servers[i];
+    if (!x->pending || x->starting || x->stopping) {
+      continue;
+    }
+    if (s->start.result) {
+      start_x(x);
+    } else {
+      server_finish(x, false);
+    }
+  }
+}
+
+/**
+ * Ends the start of the card in progress, notifying all waiters and
+ * continuing with the requested X servers
+ * @param s The card that is being started
+ * @param success true if the driver is ready, false if the start failed
+ */
+static void start_finish(struct secondary *s, bool success) {
+  bb_timer_stop(&s->start.deadline);
+  s->start.state = START_IDLE;
+  s->start.aborted = false;
+  s->start.pid = 0;
+  s->start.result = success;
+  start_notify(s, -1, success);
+  start_servers(s);
+}
+
+/**
+ * Starts unloading a driver that does not match the configured one from a
+ * powered card. card_child_exited continues the start once rmmod has exited
+ * @return The PID of rmmod, 0 if no driver has to be unloaded or -1 if the
+ * start cannot continue
+ */
+static pid_t prepare_driver(struct secondary *s)
+{
+  pid_t pid;
+
+  //if runmode is BB_RUN_EXIT, do not start X, we are shutting down.
+  if (bb_status.runmode == BB_RUN_EXIT) {
+    return -1;
+  }
+
+  if (!pci_get_driver(s->start.unload, s->bus_id, sizeof s->start.unload) ||
+          !strcasecmp(bb_config.driver, s->start.unload)) {
+    s->start.unload[0] = 0;
+    return 0;
+  }
+  /* if the loaded driver does not equal the driver from config, unload it */
+  pid = module_unload_start(s->start.unload);
+  if (pid <= 0) {
+    if (pid < 0) {
+      bb_log(LOG_ERR, "Could not unload %s driver\n", s->start.unload);
+    }
+    s->start.unload[0] = 0;
+  }
+  return pid;
+}
+
+/**
+ * Called when the driver is loaded, continue with the requested X servers
+ */
+static void start_driver_ready(struct secondary *s) {
+  long long now = bb_event_now();
+
+  if (s->start.pid) {
+    /* the card went through a full cold start, remember what it cost */
+    s->stage_cost.power_on = s->start.powered - s->start.begin;
+    s->stage_cost.driver_load = now - s->start.powered;
+    switch_cycle_extra(s->stage_cost.driver_load + s->stage_cost.driver_unload);
+  }
+  s->start.driver = now;
+  tier_update();
+  bb_log(LOG_DEBUG, "Driver of card %i ready in %lli ms (power on %lli ms,"
+          " driver %lli ms)\n", s->index, now - s->start.begin,
+          s->start.powered - s->start.begin, now - s->start.powered);
+  start_finish(s, true);
+}
+
+/**
+ * Tells the waiters of a start that is loading the driver that it failed.
+ * modprobe and rmmod are not interrupted: killing them while the module
+ * initializes or exits is not safe. card_child_exited continues once they
+ * have exited.
+ */
+static void start_load_abort(struct secondary *s) {
+  int i;
+
+  bb_timer_stop(&s->start.deadline);
+  s->start.aborted = true;
+  s->start.result = false;
+  start_notify(s, -1, false);
+  for (i = 0; i < s->server_count; i++) {
+    if (s->servers[i].pending) {
+      server_finish(&s->servers[i], false);
+    }
+  }
+}
+
+/**
+ * Called when modprobe has exited after the start was aborted. Nobody waits
+ * for the driver anymore, the teardown requested meanwhile is carried out.
+ */
+static void start_load_aborted(struct secondary *s) {
+  bb_log(LOG_DEBUG, "Loading the driver for the aborted start of card %i"
+          " has finished\n", s->index);
+  s->start.state = START_IDLE;
+  s->start.aborted = false;
+  s->start.pid = 0;
+  s->start.unload[0] = 0;
+  if (s->wanted < TIER_DRIVER) {
+    secondary_stop(s, s->wanted);
+  }
+}
+
+/**
+ * Timer handler for loading the driver
+ */
+static void start_load_timeout(void *data) {
+  struct secondary *s = data;
+  if (s->start.unload[0]) {
+    bb_log(LOG_ERR, "Driver %s could not be unloaded (timeout?)\n",
+            s->start.unload);
+    set_bb_error("Could not unload GPU driver");
+  } else {
+    bb_log(LOG_ERR, "Module %s could not be loaded (timeout?)\n",
+            bb_config.module_name);
+    set_bb_error("Could not load GPU driver");
+  }
+  start_load_abort(s);
+}
+
+/**
+ * Finishes the start of an X server after it has become ready to accept
+ * connections
+ * @param x The X server that is being started
+ * @param how The mechanism that reported readiness, for logging
+ */
+static void start_x_ready(struct xserver *x, const char *how) {
+  struct secondary *s = x->card;
+  long long now = bb_event_now();
+
+  x->is_ready = true;
+  s->stage_cost.x_start = now - x->launched;
+  tier_update();
+  bb_log(LOG_INFO, "X successfully started in %.2f seconds\n",
+          (now - x->launched) / 1000.0);
+  bb_log(LOG_INFO, "Card %i display %s ready in %lli ms (X %lli ms, readiness"
+          " by %s)\n", s->index, x->display, now - x->requested,
+          now - x->launched, how);
+  //reset errors, if any
+  set_bb_error(0);
+  server_finish(x, true);
+}
+
+/**
+ * Attempts to connect to the X server, finishing the start if X accepts
+ * connections. This is a fallback for X servers that notify readiness neither
+ * through -displayfd nor through SIGUSR1.
+ */
+static void start_x_poll(void *data) {
+  struct xserver *x = data;
+  Display * xdisp;
+
+  if (!bb_is_running(x->pid)) {
+    //X terminated itself
+    set_bb_error("X did not start properly");
+    server_finish(x, false);
+    return;
+  }
+  xdisp = XOpenDisplay(x->display);
+  if (xdisp == 0) {
+    //not ready yet, X should tell us before the next attempt
+    bb_timer_start(&x->poll, X_POLL_INTERVAL, start_x_poll, x);
+    return;
+  }
+  //X accepted the connetion - we assume it works
+  XCloseDisplay(xdisp); //close connection to X again
+  start_x_ready(x, "polling");
+}
+
+/**
+ * Event handler for the -displayfd pipe. X writes the display number followed
+ * by a newline once it accepts connections.
+ */
+static void displayfd_event(int fd, unsigned int events, void *data) {
+  struct xserver *x = data;
+  char buf[32];
+  ssize_t r;
+  (void) events; /* unused parameter */
+
+  r = read(fd, buf, sizeof buf);
+  if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  bb_event_remove(fd);
+  close(fd);
+  x->displayfd_pipe = -1;
+  if (r > 0 && x->starting) {
+    start_x_ready(x, "displayfd");
+  }
+}
+
+/**
+ * Event handler for signals that are delivered through a signalfd. X sends
+ * SIGUSR1 to its parent once it accepts connections.
+ */
+static void signal_event(int fd, unsigned int events, void *data) {
+  struct signalfd_siginfo info;
+  int i, j;
+  (void) events; /* unused parameter */
+  (void) data; /* unused parameter */
+
+  while (read(fd, &info, sizeof info) == sizeof info) {
+    if (info.ssi_signo != SIGUSR1) {
+      continue;
+    }
+    for (i = 0; i < secondaries_count; i++) {
+      for (j = 0; j < secondaries[i]->server_count; j++) {
+        struct xserver *x = &secondaries[i]->servers[j];
+        if (x->starting && (pid_t)info.ssi_pid == x->pid) {
+          start_x_ready(x, "SIGUSR1");
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Timer handler for X being unresponsive
+ */
+static void start_x_timeout(void *data) {
+  struct xserver *x = data;
+  check_xorg_pipe(&x->output);//make sure Xorg errors come in smoothly
+  if (bb_is_running(x->pid)) {
+    //X active, but not accepting connections
+    set_bb_error("X unresponsive after 10 seconds - aborting");
+    bb_stop(x->pid);
+  } else {
+    //X terminated itself
+    set_bb_error("X did not start properly");
+  }
+  server_finish(x, false);
+}
+
+/**
+ * Start the X server by fork-exec if not started yet and wait for it to accept
+ * connections from the event loop
+ */
+static void start_x(struct xserver *x) {
+  struct secondary *s = x->card;
+  int *x_pipe = x->output.pipe;
+
+  x->launched = bb_event_now();
+  if (!bb_is_running(x->pid)) {
+    char pci_id[24];
+    char displayfd[12];
+    int displayfd_pipes[2] = {-1, -1};
+    static char *x_conf_file;
+    if (s->bus_id->domain) {
+      /* Xorg takes the domain after the bus */
+      snprintf(pci_id, sizeof pci_id, "PCI:%02x@%x:%02x:%o", s->bus_id->bus,
+              s->bus_id->domain, s->bus_id->slot, s->bus_id->func);
+    } else {
+      snprintf(pci_id, sizeof pci_id, "PCI:%02x:%02x:%o", s->bus_id->bus,
+              s->bus_id->slot, s->bus_id->func);
+    }
+    if (!x_conf_file) {
+      x_conf_file = xorg_path_w_driver(bb_config.x_conf_file, bb_config.driver);
+    }
+
+    bb_log(LOG_INFO, "Starting X server on display %s.\n", x->display);
+    char *x_argv[] = {
+      XORG_BINARY,
+      x->display,
+      "-config", x_conf_file,
+      "-configdir", bb_config.x_conf_dir,
+      "-sharevts",
+      "-nolisten", "tcp",
+      "-noreset",
+      "-verbose", "3",
+      "-isolateDevice", pci_id,
+      "-displayfd", displayfd, // keep before -modulepath
+      "-modulepath", bb_config.mod_path, // keep last
+      NULL
+    };
+    enum {n_x_args = sizeof(x_argv) / sizeof(x_argv[0])};
+    if (!*bb_config.mod_path) {
+      x_argv[n_x_args - 3] = 0; //remove -modulepath if not set
+    }
+    x->displayfd = use_displayfd &&
+            pipe2(displayfd_pipes, O_NONBLOCK | O_CLOEXEC) == 0;
+    if (x->displayfd) {
+      snprintf(displayfd, sizeof displayfd, "%i", displayfd_pipes[1]);
+    } else {
+      //move -modulepath over -displayfd
+      x_argv[n_x_args - 5] = x_argv[n_x_args - 3];
+      x_argv[n_x_args - 4] = x_argv[n_x_args - 2];
+      x_argv[n_x_args - 3] = 0;
+    }
+    //close any previous pipe, if it (still) exists
+    bb_event_remove(x_pipe[0]);
+    if (x_pipe[0] != -1){close(x_pipe[0]); x_pipe[0] = -1;}
+    if (x_pipe[1] != -1){close(x_pipe[1]); x_pipe[1] = -1;}
+    x->output.pos = 0;
+    //create a new pipe
+    if (pipe2(x_pipe, O_NONBLOCK | O_CLOEXEC)){
+      if (displayfd_pipes[0] != -1) {
+        close(displayfd_pipes[0]);
+        close(displayfd_pipes[1]);
+      }
+      set_bb_error("Could not create output pipe for X");
+      server_finish(x, false);
+      return;
+    }
+    x->is_ready = false;
+    x->pid = bb_run_fork_ld_redirect(x_argv, bb_config.ld_path,
+            x_pipe[1], displayfd_pipes[1], secondary_placement(s));
+    //close the end of the pipe that is not ours
+    if (x_pipe[1] != -1){close(x_pipe[1]); x_pipe[1] = -1;}
+    //let the main loop parse the X output as soon as it arrives
+    bb_event_add(x_pipe[0], EPOLLIN, xorg_pipe_event, x);
+    if (displayfd_pipes[0] != -1) {
+      close(displayfd_pipes[1]);
+      x->displayfd_pipe = displayfd_pipes[0];
+      bb_event_add(x->displayfd_pipe, EPOLLIN, displayfd_event, x);
+    }
+  } else if (x->is_ready) {
+    //X has been started before and notified readiness already
+    server_finish(x, true);
+    return;
+  }
+
+  x->starting = true;
+  state_notify();
+  //check if X is available, for maximum 10 seconds.
+  bb_timer_start(&x->deadline, 10000, start_x_timeout, x);
+  //X notifies readiness, only connect if that does not happen
+  bb_timer_start(&x->poll, X_POLL_INTERVAL, start_x_poll, x);
+}
+
+/**
+ * Called when a terminated X server has exited. A start of it that was
+ * requested in the meantime is continued.
+ */
+static void server_exited(struct xserver *x) {
+  struct secondary *s = x->card;
+
+  bb_timer_stop(&x->stop);
+  x->stopping = false;
+  tier_update();
+  if (s->teardown.state == TEARDOWN_X) {
+    if (!servers_running(s)) {
+      teardown_x_exited(s);
+    }
+    return;
+  }
+  if (x->pending && s->start.state == START_IDLE &&
+          s->teardown.state == TEARDOWN_IDLE) {
+    start_x(x);
+  }
+}
+
+/**
+ * Timer handler that repeats the request for X to terminate, using SIGKILL
+ * after ten seconds
+ */
+static void server_stop_timeout(void *data) {
+  struct xserver *x = data;
+  if (!bb_is_running(x->pid)) {
+    server_exited(x);
+    return;
+  }
+  kill(x->pid, ++x->kills < 10 ? SIGTERM : SIGKILL);
+  bb_timer_start(&x->stop, 1000, server_stop_timeout, x);
+}
+
+/**
+ * Terminates an X server without waiting for it to exit. A start of it in
+ * progress fails.
+ */
+static void server_stop(struct xserver *x) {
+  x->is_ready = false;
+  if (!x->stopping && bb_is_running(x->pid)) {
+    bb_log(LOG_INFO, "Stopping X server on display %s\n", x->display);
+    x->stopping = true;
+    x->kills = 0;
+    bb_stop(x->pid);
+    bb_timer_start(&x->stop, 1000, server_stop_timeout, x);
+    state_notify();
+  }
+  if (x->pending) {
+    server_finish(x, false);
+  }
+}
+
+/**
+ * Advances the start or stop of an X server after a child process has exited
+ */
+static void server_child_exited(struct xserver *x) {
+  if (x->starting && !bb_is_running(x->pid)) {
+    check_xorg_pipe(&x->output);//make sure Xorg errors come in smoothly
+    if (x->displayfd && !x->retried) {
+      /* X versions before 1.13 do not know -displayfd and exit immediately */
+      bb_log(LOG_WARNING, "X exited early, retrying without -displayfd\n");
+      if (x->displayfd_pipe != -1) {
+        bb_event_remove(x->displayfd_pipe);
+        close(x->displayfd_pipe);
+        x->displayfd_pipe = -1;
+      }
+      use_displayfd = false;
+      x->retried = true;
+      start_x(x);
+      return;
+    }
+    if (x->retried) {
+      /* -displayfd was not the culprit, try it again for the next start */
+      use_displayfd = true;
+    }
+    set_bb_error("X did not start properly");
+    server_finish(x, false);
+  }
+  if (x->stopping && !bb_is_running(x->pid)) {
+    server_exited(x);
+  }
+}
+
+/**
+ * Loads the configured driver on a powered card
+ */
+static void start_load(struct secondary *s) {
+  pid_t pid;
+
+  s->start.powered = bb_event_now();
+
+  /* load the driver if none was loaded or if the loaded driver did not match
+   * the configured one */
+  pid = module_load_start(bb_config.module_name, bb_config.driver);
+  if (pid < 0) {
+    set_bb_error("Could not load GPU driver");
+    start_finish(s, false);
+  } else if (pid == 0) {
+    start_driver_ready(s);
+  } else {
+    s->start.state = START_LOADING;
+    s->start.pid = pid;
+    bb_timer_start(&s->start.deadline, 10000, start_load_timeout, s);
+  }
+}
+
+/**
+ * Timer handler that checks whether the mismatched driver has gone after rmmod
+ * exited, loads the configured driver once it has
+ */
+static void start_unload_poll(void *data) {
+  struct secondary *s = data;
+
+  if (module_is_loaded(s->start.unload) == 1) {
+    if (++s->start.polls < 30) {
+      bb_timer_start(&s->start.poll, 100, start_unload_poll, s);
+      return;
+    }
+    bb_log(LOG_ERR, "Unloading %s driver timed out.\n", s->start.unload);
+    s->start.unload[0] = 0;
+    if (s->start.aborted) {
+      start_load_aborted(s);
+    } else {
+      start_finish(s, false);
+    }
+    return;
+  }
+  s->start.unload[0] = 0;
+  if (s->start.aborted) {
+    start_load_aborted(s);
+  } else {
+    start_load(s);
+  }
+}
+
+/**
+ * Called when rmmod of a mismatched driver has exited during a start
+ */
+static void start_unloaded(struct secondary *s) {
+  bb_timer_stop(&s->start.deadline);
+  s->start.pid = 0;
+  s->start.polls = 0;
+  module_probe(s->start.unload);
+  start_unload_poll(s);
+}
+
 /**
- * Load the kernel module, powering on the card beforehand
+ * Advances a start or teardown of a card after a child process has exited
  */
-static bool switch_and_load(void)
-{
-  char driver[BUFFER_SIZE] = {0};
+static void card_child_exited(struct secondary *s) {
+  int i;
+
+  if (s->start.state == START_LOADING &&
+          !bb_is_running(s->start.pid)) {
+    if (s->start.unload[0]) {
+      if (s->start.pid) {
+        start_unloaded(s);
+      }
+    } else if (s->start.aborted) {
+      module_probe(bb_config.driver);
+      start_load_aborted(s);
+    } else if (module_probe(bb_config.driver) == 1) {
+      start_driver_ready(s);
+    } else {
+      bb_log(LOG_ERR, "Module %s could not be loaded\n",
+              bb_config.module_name);
+      set_bb_error("Could not load GPU driver");
+      start_finish(s, false);
+    }
+  }
+  for (i = 0; i < s->server_count; i++) {
+    server_child_exited(&s->servers[i]);
+  }
+  if (s->teardown.state == TEARDOWN_UNLOAD && s->teardown.rmmod_pid &&
+          !bb_is_running(s->teardown.rmmod_pid)) {
+    teardown_rmmod_exited(s);
+  }
+}
+
+/**
+ * Event handler for exited child processes, advances the starts and teardowns
+ * in progress
+ */
+static void child_event(int fd, unsigned int events, void *data) {
+  char buf[64];
+  int i;
+  (void) events; /* unused parameter */
+  (void) data; /* unused parameter */
+
+  while (read(fd, buf, sizeof buf) > 0) {
+    /* drain the pipe, the exited PIDs are already removed from the list */
+  }
+  /* a modprobe or rmmod has changed the driver bindings, read them once
+   * instead of relying on uevents that may not be delivered (containers) */
+  pci_driver_invalidate(NULL);
+  for (i = 0; i < secondaries_count; i++) {
+    card_child_exited(secondaries[i]);
+  }
+  tier_update();
+}
+
+/**
+ * Called for every uevent once the PCI inventory and the module states are
+ * updated. Continues the starts and teardowns waiting for a driver to go
+ * without waiting for the next poll and reports driver changes in the tiers
+ */
+static void secondary_uevent(const struct uevent *event) {
+  int i;
+
+  if (event && strcmp(event->subsystem, "pci") &&
+          strcmp(event->subsystem, "module")) {
+    return;
+  }
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+
+    if (s->teardown.state == TEARDOWN_UNLOAD && !s->teardown.rmmod_pid &&
+            module_is_loaded(s->teardown.driver) != 1) {
+      bb_timer_stop(&s->teardown.timer);
+      teardown_unload_poll(s);
+    }
+    if (s->start.state == START_LOADING && s->start.unload[0] &&
+            !s->start.pid && module_is_loaded(s->start.unload) != 1) {
+      bb_timer_stop(&s->start.poll);
+      start_unload_poll(s);
+    }
+  }
+  tier_update();
+}
+
+/**
+ * Called when the card has been powered on for a start (or failed to), loads
+ * the driver right away
+ */
+static void start_powered(enum switch_state state, void *data) {
+  struct secondary *s = data;
+  pid_t pid;
+
+  s->start.state = START_IDLE;
   /* enable card if the switcher is available */
-  if (switcher) {
-    if (switch_on() != SWITCH_ON) {
-      set_bb_error("Could not enable discrete graphics card");
-      return false;
+  if (switcher && state != SWITCH_ON) {
+    set_bb_error("Could not enable discrete graphics card");
+    start_finish(s, false);
+    return;
+  }
+  tier_update();
+  pid = prepare_driver(s);
+  if (pid < 0) {
+    start_finish(s, false);
+  } else if (pid == 0) {
+    start_load(s);
+  } else {
+    s->start.state = START_LOADING;
+    s->start.pid = pid;
+    bb_timer_start(&s->start.deadline, 10000, start_load_timeout, s);
+  }
+}
+
+/**
+ * Powers on the card for a start, the driver is loaded once it is on
+ */
+static void start_power_on(struct secondary *s) {
+  s->start.state = START_POWER;
+  switch_request(SWITCH_ON, start_powered, s);
+}
+
+/**
+ * Continues the starts that waited for another card to unload the driver
+ */
+static void start_waiting(void) {
+  int i;
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+    if (s->start.state == START_WAIT && !driver_unloading()) {
+      s->start.state = START_IDLE;
+      start_power_on(s);
     }
   }
+}
 
-  //if runmode is BB_RUN_EXIT, do not start X, we are shutting down.
-  if (bb_status.runmode == BB_RUN_EXIT) {
-    return false;
+/**
+ * Start a card without blocking: turn card on, load the driver and start an
+ * X server if needed. The callback passed to secondary_init is called when
+ * the card can be used and when the X server is ready or has failed. If a
+ * start is already in progress, the request joins it.
+ * @param s The card to be started
+ * @param server The X server to be started, -1 if the driver suffices
+ */
+void secondary_start(struct secondary *s, int server) {
+  struct xserver *x = NULL;
+
+  if (server >= 0 && server < s->server_count) {
+    x = &s->servers[server];
+    s->wanted = TIER_X;
+    if (!x->pending) {
+      x->pending = true;
+      x->retried = false;
+      x->requested = bb_event_now();
+    }
+  } else if (s->wanted < TIER_DRIVER) {
+    s->wanted = TIER_DRIVER;
+  }
+  /* the card or the X server is starting from now on */
+  state_notify();
+  if (s->teardown.state != TEARDOWN_IDLE) {
+    /* continue from the state the teardown has reached */
+    teardown_cancel(s, x != NULL);
+    return;
+  }
+  if (s->start.state == START_LOADING && s->start.aborted) {
+    /* modprobe is still running, the new start joins it */
+    s->start.aborted = false;
+    bb_timer_start(&s->start.deadline, 10000, start_load_timeout, s);
+    return;
+  }
+  if (s->start.state != START_IDLE) {
+    /* the X server is launched once the driver is ready */
+    return;
+  }
+  if (x && servers_up(s)) {
+    /* the driver is loaded already, only X has to be started */
+    if (!x->starting && !x->stopping) {
+      start_x(x);
+    }
+    return;
   }
 
-  if (pci_get_driver(driver, pci_bus_id_discrete, sizeof driver)) {
-    /* if the loaded driver does not equal the driver from config, unload it */
-    if (strcasecmp(bb_config.driver, driver)) {
-      if (!module_unload(driver)) {
-        /* driver failed to unload, aborting */
-        return false;
-      }
+  s->start.begin = bb_event_now();
+  if (driver_unloading()) {
+    /* the driver is shared, wait until the other card has unloaded it */
+    bb_log(LOG_DEBUG, "Card %i waits for the driver to be unloaded\n",
+            s->index);
+    s->start.state = START_WAIT;
+    return;
+  }
+  start_power_on(s);
+}
+
+/**
+ * Aborts a start in progress, if any, including the starts of X servers.
+ * Waiters are told that it failed. A start that is loading the driver stays
+ * in START_LOADING until modprobe has exited, see start_load_abort.
+ */
+static void secondary_start_abort(struct secondary *s) {
+  int i;
+
+  if (s->start.state == START_LOADING) {
+    if (!s->start.aborted) {
+      bb_log(LOG_INFO, "Aborting start of card %i, waiting for modprobe\n",
+              s->index);
+      start_load_abort(s);
+    }
+  } else if (s->start.state != START_IDLE) {
+    bb_log(LOG_INFO, "Aborting start of card %i\n", s->index);
+    if (s->start.state == START_POWER) {
+      switch_cancel(start_powered, s);
     }
+    s->start.state = START_IDLE;
+    s->start.pid = 0;
+    s->start.result = false;
+    bb_timer_stop(&s->start.deadline);
+    start_notify(s, -1, false);
   }
+  for (i = 0; i < s->server_count; i++) {
+    if (s->servers[i].pending) {
+      server_finish(&s->servers[i], false);
+    }
+  }
+}
 
-  /* load the driver if none was loaded or if the loaded driver did not match
-   * the configured one */
-  if (strcasecmp(bb_config.driver, driver)) {
-    char *module_name = bb_config.module_name;
-    char *driver_name = bb_config.driver;
-    if (!module_load(module_name, driver_name)) {
-      set_bb_error("Could not load GPU driver");
-      return false;
+/**
+ * Counters of the teardowns of all cards and of those cancelled by a start
+ * @param stats Receives the counters
+ */
+void secondary_teardown_stats(struct secondary_teardowns *stats) {
+  *stats = teardown_stats;
+}
+
+/**
+ * Whether a start of a card or one of its X servers is in progress
+ */
+bool secondary_is_starting(struct secondary *s) {
+  int i;
+
+  if ((s->start.state != START_IDLE && !s->start.aborted) ||
+          s->teardown.cancelled) {
+    return true;
+  }
+  for (i = 0; i < s->server_count; i++) {
+    if (s->servers[i].pending) {
+      return true;
     }
   }
-  return true;
+  return false;
 }
 
 /**
- * Start the X server by fork-exec, turn card on and load driver if needed.
+ * Start the X servers by fork-exec, turn cards on and load driver if needed.
+ * Unlike secondary_start, this blocks until the starts have finished.
  * If after this method finishes X is running, it was successfull.
  * If it somehow fails, X should not be running after this method finishes.
  */
 bool start_secondary(bool need_secondary) {
-  if (!switch_and_load())
-    return false;
-  if (!need_secondary)
-    return true;
-  //no problems, start X if not started yet
-  if (!bb_is_running(bb_status.x_pid)) {
-    char pci_id[12];
-    static char *x_conf_file;
-    snprintf(pci_id, 12, "PCI:%02x:%02x:%o", pci_bus_id_discrete->bus,
-            pci_bus_id_discrete->slot, pci_bus_id_discrete->func);
-    if (!x_conf_file) {
-      x_conf_file = xorg_path_w_driver(bb_config.x_conf_file, bb_config.driver);
-    }
+  bool result = true, starting;
+  int i;
 
-    bb_log(LOG_INFO, "Starting X server on display %s.\n", bb_config.x_display);
-    char *x_argv[] = {
-      XORG_BINARY,
-      bb_config.x_display,
-      "-config", x_conf_file,
-      "-configdir", bb_config.x_conf_dir,
-      "-sharevts",
-      "-nolisten", "tcp",
-      "-noreset",
-      "-verbose", "3",
-      "-isolateDevice", pci_id,
-      "-modulepath", bb_config.mod_path, // keep last
-      NULL
-    };
-    enum {n_x_args = sizeof(x_argv) / sizeof(x_argv[0])};
-    if (!*bb_config.mod_path) {
-      x_argv[n_x_args - 3] = 0; //remove -modulepath if not set
+  for (i = 0; i < secondaries_count; i++) {
+    secondary_start(secondaries[i], need_secondary ? 0 : -1);
+  }
+  do {
+    starting = false;
+    for (i = 0; i < secondaries_count; i++) {
+      starting = starting || secondary_is_starting(secondaries[i]);
     }
-    //close any previous pipe, if it (still) exists
-    if (bb_status.x_pipe[0] != -1){close(bb_status.x_pipe[0]); bb_status.x_pipe[0] = -1;}
-    if (bb_status.x_pipe[1] != -1){close(bb_status.x_pipe[1]); bb_status.x_pipe[1] = -1;}
-    //create a new pipe
-    if (pipe2(bb_status.x_pipe, O_NONBLOCK | O_CLOEXEC)){
-      set_bb_error("Could not create output pipe for X");
-      return false;
+    if (starting && bb_event_dispatch(-1) < 0) {
+      for (i = 0; i < secondaries_count; i++) {
+        secondary_start_abort(secondaries[i]);
+      }
     }
-    bb_status.x_pid = bb_run_fork_ld_redirect(x_argv, bb_config.ld_path, bb_status.x_pipe[1]);
-    //close the end of the pipe that is not ours
-    if (bb_status.x_pipe[1] != -1){close(bb_status.x_pipe[1]); bb_status.x_pipe[1] = -1;}
+  } while (starting);
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+    result = result && s->start.result && (!need_secondary ||
+            secondary_server_state(s, 0) == SERVER_READY);
   }
+  return result;
+}//start_secondary
 
-  //check if X is available, for maximum 10 seconds.
-  time_t xtimer = time(0);
-  Display * xdisp = 0;
-  while ((time(0) - xtimer <= 10) && bb_is_running(bb_status.x_pid)) {
-    xdisp = XOpenDisplay(bb_config.x_display);
-    if (xdisp != 0) {
-      break;
-    }
-    check_xorg_pipe();//make sure Xorg errors come in smoothly
-    usleep(100000); //don't retry too fast
+/**
+ * Prepares asynchronous starts of the cards
+ * @param callback Function that is called when (part of) a start completes
+ * @param changed Function that is called when the state of a card changes
+ */
+void secondary_init(secondary_callback callback,
+        secondary_change_callback changed) {
+  sigset_t usr1_mask;
+  int i, fd = bb_run_child_fd();
+  start_callback = callback;
+  change_callback = changed;
+  if (fd != -1) {
+    bb_event_add(fd, EPOLLIN, child_event, NULL);
   }
-  check_xorg_pipe();//make sure Xorg errors come in smoothly
 
-  //check if X is available
-  if (xdisp == 0) {
-    //X not available
-    /// \todo Maybe check X exit status and/or messages?
-    if (bb_is_running(bb_status.x_pid)) {
-      //X active, but not accepting connections
-      set_bb_error("X unresponsive after 10 seconds - aborting");
-      bb_stop(bb_status.x_pid);
-    } else {
-      //X terminated itself
-      set_bb_error("X did not start properly");
+  /* the X servers run next to their card, the topology does not change */
+  for (i = 0; bb_config.numa_policy != NUMA_NONE && i < secondaries_count;
+          i++) {
+    struct secondary *s = secondaries[i];
+    s->placed = numa_placement_read(s->bus_id, &s->placement);
+    if (s->placed) {
+      bb_log(LOG_INFO, "Card %i is local to NUMA node %i, CPUs %s\n", i,
+              s->placement.node, s->placement.cpulist[0] ?
+              s->placement.cpulist : "all");
     }
+  }
+
+  /* receive the readiness signal of X in the event loop */
+  sigemptyset(&usr1_mask);
+  sigaddset(&usr1_mask, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &usr1_mask, NULL);
+  fd = signalfd(-1, &usr1_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd == -1) {
+    bb_log(LOG_WARNING, "Could not create signalfd: %s\n", strerror(errno));
   } else {
-    //X accepted the connetion - we assume it works
-    XCloseDisplay(xdisp); //close connection to X again
-    bb_log(LOG_INFO, "X successfully started in %i seconds\n", time(0) - xtimer);
-    //reset errors, if any
-    set_bb_error(0);
-    return true;
+    bb_event_add(fd, EPOLLIN, signal_event, NULL);
   }
-  return false;
-}//start_secondary
+  uevent_open(secondary_uevent);
+}
+
+/**
+ * Closes the X output pipes and frees all cards
+ */
+void secondary_close(void) {
+  int i, j;
+  uevent_close();
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+    for (j = 0; j < s->server_count; j++) {
+      int *x_pipe = s->servers[j].output.pipe;
+      bb_event_remove(x_pipe[0]);
+      if (x_pipe[0] != -1){close(x_pipe[0]); x_pipe[0] = -1;}
+      if (x_pipe[1] != -1){close(x_pipe[1]); x_pipe[1] = -1;}
+      free(s->servers[j].display);
+    }
+    free(s->bus_id);
+    free(s);
+    secondaries[i] = NULL;
+  }
+  secondaries_count = 0;
+}
 
 /**
- * Unload the kernel module and power down the card
+ * Unload the kernel module and power down the cards
  */
 static void switch_and_unload(void)
 {
   char driver[BUFFER_SIZE];
+  int i;
 
   if (bb_config.pm_method == PM_DISABLED && bb_status.runmode != BB_RUN_EXIT) {
     /* do not disable the card if PM is disabled unless exiting */
@@ -227,16 +1443,19 @@ static void switch_and_unload(void)
   if (switcher) {
     if (switcher->need_driver_unloaded) {
       /* do not unload the drivers nor disable the card if the card is not on */
-      if (switcher->status() != SWITCH_ON) {
+      if (switch_status() != SWITCH_ON) {
         return;
       }
-      /* unload the driver loaded by the graphica card */
-      if (pci_get_driver(driver, pci_bus_id_discrete, sizeof driver)) {
-        module_unload(driver);
+      /* unload the driver loaded by the graphica cards */
+      for (i = 0; i < secondaries_count; i++) {
+        if (pci_get_driver(driver, secondaries[i]->bus_id, sizeof driver)) {
+          module_unload(driver);
+        }
       }
+      pci_driver_invalidate(NULL);
 
       //only turn card off if no drivers are loaded
-      if (pci_get_driver(NULL, pci_bus_id_discrete, 0)) {
+      if (drivers_bound()) {
         bb_log(LOG_DEBUG, "Drivers are still loaded, unable to disable card\n");
         return;
       }
@@ -248,21 +1467,362 @@ static void switch_and_unload(void)
 }
 
 /**
- * Kill the second X server if any, turn card off if requested.
+ * Ends the teardown in progress. If it was cancelled, the waiting start is
+ * continued from the current state of the card.
+ */
+static void teardown_finish(struct secondary *s) {
+  bool cancelled = s->teardown.cancelled;
+  long long now = bb_event_now();
+
+  bb_timer_stop(&s->teardown.timer);
+  s->teardown.state = TEARDOWN_IDLE;
+  s->teardown.cancelled = false;
+  s->teardown.rmmod_pid = 0;
+  tier_update();
+  if (!cancelled) {
+    bb_log(LOG_DEBUG, "Card %i stopped in %lli ms\n", s->index,
+            now - s->teardown.begin);
+  } else {
+    teardown_stats.cancelled++;
+    teardown_stats.saved += s->teardown.saved;
+    bb_log(LOG_INFO, "Teardown cancelled after %lli ms, saved about %lli ms"
+            " (%u of %u teardowns cancelled, %lli ms saved in total)\n",
+            now - s->teardown.begin, s->teardown.saved,
+            teardown_stats.cancelled, teardown_stats.teardowns,
+            teardown_stats.saved);
+    /* the requested X servers are launched once the driver is ready */
+    secondary_start(s, -1);
+  }
+  start_waiting();
+}
+
+/**
+ * Called when the card has been powered off (or failed to) at the end of a
+ * teardown
+ */
+static void teardown_powered_off(enum switch_state state, void *data) {
+  struct secondary *s = data;
+
+  if (state != SWITCH_OFF) {
+    bb_log(LOG_WARNING, "Unable to disable discrete card.");
+  } else {
+    s->stage_cost.power_off = bb_event_now() - s->teardown.stage_begin;
+  }
+  teardown_finish(s);
+}
+
+/**
+ * Last stage of a teardown: power off the card
+ */
+static void teardown_power_off(struct secondary *s) {
+  //only turn card off if no drivers are loaded, unless the method keeps them
+  if (switcher->need_driver_unloaded && drivers_bound()) {
+    bb_log(LOG_DEBUG, "Drivers are still loaded, unable to disable card\n");
+    teardown_finish(s);
+    return;
+  }
+  s->teardown.state = TEARDOWN_POWER;
+  s->teardown.stage_begin = bb_event_now();
+  switch_request(SWITCH_OFF, teardown_powered_off, s);
+}
+
+/**
+ * Timer handler that checks whether the driver has gone after rmmod exited
+ */
+static void teardown_unload_poll(void *data) {
+  struct secondary *s = data;
+
+  if (module_is_loaded(s->teardown.driver) == 1) {
+    if (++s->teardown.polls < 30) {
+      bb_timer_start(&s->teardown.timer, 100, teardown_unload_poll, s);
+      return;
+    }
+    bb_log(LOG_ERR, "Unloading %s driver timed out.\n", s->teardown.driver);
+    teardown_finish(s);
+    return;
+  }
+  s->stage_cost.driver_unload = bb_event_now() - s->teardown.stage_begin;
+  if (s->teardown.cancelled) {
+    /* keep the card powered for the waiting start */
+    teardown_finish(s);
+    return;
+  }
+  teardown_power_off(s);
+}
+
+/**
+ * Called when rmmod has exited
+ */
+static void teardown_rmmod_exited(struct secondary *s) {
+  s->teardown.rmmod_pid = 0;
+  s->teardown.polls = 0;
+  module_probe(s->teardown.driver);
+  teardown_unload_poll(s);
+}
+
+/**
+ * Timer handler for rmmod taking too long
+ */
+static void teardown_rmmod_timeout(void *data) {
+  struct secondary *s = data;
+  bb_log(LOG_WARNING, "rmmod %s did not finish in time\n", s->teardown.driver);
+  bb_stop(s->teardown.rmmod_pid);
+  bb_timer_start(&s->teardown.timer, 1000, teardown_rmmod_timeout, s);
+}
+
+static void teardown_unload(struct secondary *s);
+
+/**
+ * Timer handler for the end of the minimum on time, continues the teardown
+ */
+static void teardown_hold_expired(void *data) {
+  teardown_unload(data);
+}
+
+/**
+ * Second stage of a teardown: unload the driver if the switching method needs
+ * it, then power off the card. Both are delayed while the card has not been on
+ * for the minimum time that makes a power cycle worth it.
+ */
+static void teardown_unload(struct secondary *s) {
+  long long hold;
+  pid_t pid;
+
+  s->teardown.stage_begin = bb_event_now();
+  if (s->teardown.cancelled) {
+    /* the driver is still loaded, it can be used right away */
+    teardown_finish(s);
+    return;
+  }
+  if (bb_config.pm_method == PM_DISABLED && bb_status.runmode != BB_RUN_EXIT) {
+    /* do not disable the card if PM is disabled unless exiting */
+    teardown_finish(s);
+    return;
+  }
+  if (others_need_driver(s)) {
+    /* the last card that goes off releases the driver and power */
+    bb_log(LOG_DEBUG, "Driver is still used by another card\n");
+    teardown_finish(s);
+    return;
+  }
+  if (!switcher) {
+    teardown_finish(s);
+    return;
+  }
+  hold = switch_hold_on();
+  if (hold > 0 && s->teardown.state != TEARDOWN_HOLD) {
+    bb_log(LOG_DEBUG, "Keeping card %i on for %lli ms against power cycling\n",
+            s->index, hold);
+    s->teardown.state = TEARDOWN_HOLD;
+    bb_timer_start(&s->teardown.timer, hold, teardown_hold_expired, s);
+    return;
+  }
+  if (!switcher->need_driver_unloaded) {
+    teardown_power_off(s);
+    return;
+  }
+  /* do not unload the drivers nor disable the card if the card is not on */
+  if (switch_status() != SWITCH_ON) {
+    teardown_finish(s);
+    return;
+  }
+  if (!pci_get_driver(s->teardown.driver, s->bus_id,
+          sizeof s->teardown.driver)) {
+    teardown_power_off(s);
+    return;
+  }
+  pid = module_unload_start(s->teardown.driver);
+  if (pid < 0) {
+    bb_log(LOG_ERR, "Could not unload %s driver\n", s->teardown.driver);
+    teardown_finish(s);
+    return;
+  }
+  s->teardown.state = TEARDOWN_UNLOAD;
+  if (pid == 0) {
+    teardown_rmmod_exited(s);
+    return;
+  }
+  s->teardown.rmmod_pid = pid;
+  bb_timer_start(&s->teardown.timer, 10000, teardown_rmmod_timeout, s);
+}
+
+/**
+ * Called when X has exited during a teardown
+ */
+static void teardown_x_exited(struct secondary *s) {
+  bb_timer_stop(&s->teardown.timer);
+  if (s->teardown.target >= TIER_DRIVER) {
+    /* keep the driver loaded for a quick start of X */
+    teardown_finish(s);
+    return;
+  }
+  teardown_unload(s);
+}
+
+/**
+ * Rolls back a teardown in progress for a new start. The current stage is
+ * completed, after which the start continues from the state of the card.
+ * @param s The card that is being torn down
+ * @param need_x Whether the start needs an X server
+ */
+static void teardown_cancel(struct secondary *s, bool need_x) {
+  if (!s->teardown.cancelled) {
+    s->teardown.cancelled = true;
+    /* estimate the stages that are skipped when going back up */
+    s->teardown.saved = s->stage_cost.power_off + s->stage_cost.power_on;
+    if (s->teardown.state == TEARDOWN_X) {
+      s->teardown.saved += s->stage_cost.driver_unload +
+              s->stage_cost.driver_load;
+    }
+    bb_log(LOG_INFO, "Card %i requested during teardown, aborting it\n",
+            s->index);
+  }
+  if (s->teardown.state == TEARDOWN_HOLD) {
+    /* nothing has been released yet, the card can be used right away */
+    s->teardown.saved += s->stage_cost.driver_unload +
+            s->stage_cost.driver_load;
+    switch_cycle_suppressed();
+    teardown_finish(s);
+    return;
+  }
+  if (!need_x && s->teardown.state == TEARDOWN_X) {
+    /* X is going away, but the driver is still usable */
+    start_notify(s, -1, true);
+  }
+}
+
+/**
+ * Aborts a teardown in progress, if any. A waiting start is told that it
+ * failed.
+ */
+static void teardown_abort(struct secondary *s) {
+  bool cancelled = s->teardown.cancelled;
+  int i;
+
+  if (s->teardown.state == TEARDOWN_IDLE) {
+    return;
+  }
+  bb_timer_stop(&s->teardown.timer);
+  if (s->teardown.rmmod_pid) {
+    bb_stop_wait(s->teardown.rmmod_pid);
+  }
+  if (s->teardown.state == TEARDOWN_POWER) {
+    switch_cancel(teardown_powered_off, s);
+  }
+  s->teardown.state = TEARDOWN_IDLE;
+  s->teardown.cancelled = false;
+  s->teardown.rmmod_pid = 0;
+  if (cancelled) {
+    start_notify(s, -1, false);
+    for (i = 0; i < s->server_count; i++) {
+      if (s->servers[i].pending) {
+        server_finish(&s->servers[i], false);
+      }
+    }
+  }
+}
+
+/**
+ * Stop a card without blocking: terminate the X servers, unload the driver
+ * and power off
+ * the card, stopping at the requested tier. The driver and power are kept as
+ * long as another card needs them. A secondary_start before the teardown has
+ * finished cancels the remaining stages.
+ * @param s The card to be stopped
+ * @param target TIER_DRIVER to stop X only, TIER_OFF to stop everything
+ */
+void secondary_stop(struct secondary *s, enum secondary_tier target) {
+  int i;
+
+  secondary_start_abort(s);
+  if (target < s->wanted) {
+    s->wanted = target;
+  }
+  if (s->start.state == START_LOADING) {
+    /* the teardown follows once modprobe has exited */
+    return;
+  }
+  if (s->teardown.state != TEARDOWN_IDLE) {
+    /* a start that cancelled the running teardown is not needed anymore */
+    s->teardown.cancelled = false;
+    if (target < s->teardown.target) {
+      s->teardown.target = target;
+    }
+    state_notify();
+    return;
+  }
+  if (target >= TIER_X ||
+          (target == TIER_DRIVER && !servers_running(s))) {
+    return;
+  }
+  teardown_stats.teardowns++;
+  s->teardown.target = target;
+  s->teardown.begin = bb_event_now();
+  if (servers_running(s)) {
+    s->teardown.state = TEARDOWN_X;
+    for (i = 0; i < s->server_count; i++) {
+      server_stop(&s->servers[i]);
+    }
+  } else {
+    teardown_unload(s);
+  }
+}
+
+/**
+ * Stop an X server of a card without blocking. The card keeps its tier as
+ * long as other X servers run, otherwise it stays at the driver tier.
+ * @param s The card
+ * @param server The X server to be stopped
+ */
+void secondary_stop_server(struct secondary *s, int server) {
+  if (server < 0 || server >= s->server_count) {
+    return;
+  }
+  server_stop(&s->servers[server]);
+}
+
+/**
+ * Kill the X servers if any, turn cards off if requested.
+ * Unlike secondary_stop, this blocks until the cards are off.
  */
 void stop_secondary() {
-  // kill X if it is running
-  if (bb_is_running(bb_status.x_pid)) {
-    bb_log(LOG_INFO, "Stopping X server\n");
-    bb_stop_wait(bb_status.x_pid);
+  int i, j;
+  for (i = 0; i < secondaries_count; i++) {
+    struct secondary *s = secondaries[i];
+    secondary_start_abort(s);
+    if (s->start.state == START_LOADING) {
+      /* let modprobe or rmmod finish, the driver is unloaded below */
+      while (bb_is_running(s->start.pid)) {
+        usleep(10000);
+      }
+      s->start.state = START_IDLE;
+      s->start.aborted = false;
+      s->start.pid = 0;
+      s->start.unload[0] = 0;
+      bb_timer_stop(&s->start.poll);
+    }
+    teardown_abort(s);
+    for (j = 0; j < s->server_count; j++) {
+      struct xserver *x = &s->servers[j];
+      // kill X if it is running
+      if (bb_is_running(x->pid)) {
+        bb_log(LOG_INFO, "Stopping X server on display %s\n", x->display);
+        bb_stop_wait(x->pid);
+      }
+      bb_timer_stop(&x->stop);
+      x->stopping = false;
+      x->is_ready = false;
+    }
+    s->wanted = TIER_OFF;
   }
   switch_and_unload();
+  tier_update();
 }//stop_secondary
 
 /**
  * Check for the availability of a PM method, warn if no method is available
  */
-void check_pm_method(void) {
+void check_pm_method(struct pci_bus_id **cards, int card_count) {
   if (bb_config.pm_method == PM_DISABLED) {
     bb_log(LOG_INFO, "PM is disabled, not performing detection.\n");
   } else {
@@ -270,6 +1830,8 @@ void check_pm_method(void) {
     memset(&info, 0, sizeof info);
     info.driver = bb_config.driver;
     info.configured_pm = bb_pm_method_string[bb_config.pm_method];
+    info.cards = cards;
+    info.card_count = card_count;
 
     const char *pm_method = NULL;
     if (bb_config.pm_method != PM_AUTO) {
@@ -19,6 +19,8 @@
  * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
  */
 #pragma once
+#include <stdbool.h>
+#include <sys/types.h>
 
 /**
  * OpenSUSE: /usr/bin/X -> /var/lib/X11/X -> /usr/bin/Xorg
@@ -28,14 +30,139 @@
  */
 #define XORG_BINARY "Xorg"
 
-/* PCI Bus ID of the discrete video card */
-struct pci_bus_id *pci_bus_id_discrete;
+/* Maximum number of discrete cards that are managed */
+#define SECONDARY_MAX 8
 
-/// Start the X server by fork-exec, turn card on if needed.
+/* Maximum number of X servers on a single card */
+#define SECONDARY_POOL_MAX 8
+
+/* A discrete card with its X servers, see secondary_add */
+struct secondary;
+struct pci_bus_id;
+struct numa_placement;
+
+/* Power tiers of the secondary, from the cheapest to keep to the fastest to
+ * use. Each tier includes the ones below it. */
+enum secondary_tier {
+  TIER_OFF, /* card powered off (or on without driver) */
+  TIER_DRIVER, /* card on and driver loaded */
+  TIER_X, /* X server running */
+  TIER_COUNT /* not a tier but a marker for the end */
+};
+
+/* State of an X server of a card */
+enum secondary_server_state {
+  SERVER_OFF, /* not running */
+  SERVER_STARTING, /* start requested, not accepting connections yet */
+  SERVER_READY, /* accepting connections */
+  SERVER_STOPPING, /* terminated, waiting for it to exit */
+};
+
+/* Counters of teardowns cancelled by a start, see secondary_stop */
+struct secondary_teardowns {
+  unsigned int teardowns; /* number of teardowns begun */
+  unsigned int cancelled; /* teardowns cancelled by a start */
+  long long saved; /* estimated ms of start latency saved by cancelling */
+};
+
+/**
+ * Called when an asynchronous start of a card has progressed. server is -1
+ * when the card and driver are ready (or failed) and the index of the X
+ * server when the outcome of starting that X server is known
+ */
+typedef void (*secondary_callback)(struct secondary *s, int server,
+        bool success);
+
+/**
+ * Called when the power tier of a card, the state of one of its X servers or
+ * whether it is starting has changed. The callback must not start or stop
+ * cards.
+ */
+typedef void (*secondary_change_callback)(void);
+
+/// Add a discrete card, before secondary_init.
+struct secondary *secondary_add(struct pci_bus_id *bus_id);
+
+/// Add an X server on display to a card, returns its index or -1.
+int secondary_add_server(struct secondary *s, const char *display);
+
+/// Number of discrete cards.
+int secondary_count(void);
+
+/// The discrete card with the given index.
+struct secondary *secondary_get(int index);
+
+/// Index of a card, as used for pinning applications to it.
+int secondary_index(struct secondary *s);
+
+/// CPUs and memory node close to a card, NULL if it is not placed.
+const struct numa_placement *secondary_placement(struct secondary *s);
+
+/// Number of X servers of a card.
+int secondary_server_count(struct secondary *s);
+
+/// X display of an X server of a card.
+const char *secondary_server_display(struct secondary *s, int server);
+
+/// PID of an X server of a card, 0 if it has not been started.
+pid_t secondary_server_pid(struct secondary *s, int server);
+
+/// State of an X server of a card.
+enum secondary_server_state secondary_server_state(struct secondary *s,
+        int server);
+
+/// Prepare asynchronous starts, callback is called when a start progresses
+/// and changed when the state of a card changes.
+void secondary_init(secondary_callback callback,
+        secondary_change_callback changed);
+
+/// Release all cards at exit.
+void secondary_close(void);
+
+/// Start a card and one of its X servers (or none if server is -1) without
+/// blocking, see secondary_callback.
+void secondary_start(struct secondary *s, int server);
+
+/// Stop a single X server of a card without blocking, the driver and the
+/// other X servers are kept.
+void secondary_stop_server(struct secondary *s, int server);
+
+/// Stop a card down to a tier without blocking, a later start cancels the
+/// teardown.
+void secondary_stop(struct secondary *s, enum secondary_tier tier);
+
+/// Name of a power tier for reporting.
+const char *secondary_tier_name(enum secondary_tier tier);
+
+/// Account a change of the card power that was not requested by a card.
+void secondary_power_changed(void);
+
+/// Current power tier of a card.
+enum secondary_tier secondary_current_tier(struct secondary *s);
+
+/// Time in ms needed to start X on a card from the off tier, as last measured.
+long long secondary_cold_start_cost(struct secondary *s);
+
+/// Time a card spent in each power tier in ms, including the current one.
+void secondary_tier_residency(struct secondary *s,
+        long long residency[TIER_COUNT]);
+
+/// Time at which a card entered its current power tier (see bb_event_now),
+/// residency receives the time in ms spent in each tier before.
+long long secondary_tier_since(struct secondary *s,
+        long long residency[TIER_COUNT]);
+
+/// Counters of cancelled teardowns of all cards.
+void secondary_teardown_stats(struct secondary_teardowns *stats);
+
+/// Whether a start of a card or one of its X servers is in progress.
+bool secondary_is_starting(struct secondary *s);
+
+/// Start all cards (and their first X server), blocking until done.
 bool start_secondary(bool);
 
-/// Kill the second X server if any, turn card off if requested.
+/// Kill the X servers if any, turn cards off if requested.
 void stop_secondary(void);
 
-/* check for the availability of PM methods */
-void check_pm_method(void);
+/* check for the availability of PM methods for the discrete cards */
+void check_pm_method(struct pci_bus_id **cards, int card_count);
@@ -22,6 +22,9 @@
  * Common networking functions for Bumblebee
  */
 
+/* for accept4 */
+#define _GNU_SOURCE
+
 #include <sys/stat.h>
 #include <poll.h>
 #include <sys/types.h>
@@ -32,6 +35,7 @@
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include "bbsocket.h"
 #include "bblogger.h"
 #include "bbconfig.h"
@@ -210,6 +214,7 @@ int socketServer(char * address, int nonblock) {
 
 /// Accept any waiting connections. If the Socket::Server is blocking, this function will block until there is an incoming connection.
 /// If the Socket::Server is nonblocking, it might return a Socket::Connection that is not connected, so check for this.
+/// The returned socket is never inherited by child processes.
 /// \param nonblock Whether the newly connected socket should be nonblocking. Default is false (blocking).
 /// \returns A valid socket or -1.
 
@@ -217,24 +222,104 @@ int socketAccept(int * sock, int nonblock) {
   if (*sock < 0) {
     return -1;
   }
-  int r = accept(*sock, 0, 0);
-  //set the socket to be nonblocking, if requested.
-  //we could do this through accept4 with a flag, but that call is non-standard...
-  if ((r >= 0) && (nonblock == 1)) {
-    int flags = fcntl(r, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(r, F_SETFL, flags);
+  //set the flags on the new socket atomically instead of an extra fcntl
+  int flags = SOCK_CLOEXEC;
+  if (nonblock == 1) {
+    flags |= SOCK_NONBLOCK;
   }
+  int r = accept4(*sock, 0, 0, flags);
 
   if (r < 0) {
-    if ((errno != EWOULDBLOCK) && (errno != EAGAIN) && (errno != EINTR)) {
-      bb_log(LOG_ERR, "Error during accept - closing server socket: %s\n", strerror(errno));
-      socketClose(sock);
+    switch (errno) {
+      case EWOULDBLOCK:
+#if EAGAIN != EWOULDBLOCK
+      case EAGAIN:
+#endif
+      case EINTR:
+      case ECONNABORTED:
+        break;
+      case EMFILE:
+      case ENFILE:
+      case ENOBUFS:
+      case ENOMEM:
+        //out of resources, the connection stays queued for a later attempt
+        bb_log(LOG_WARNING, "Could not accept connection: %s\n", strerror(errno));
+        break;
+      default:
+        bb_log(LOG_ERR, "Error during accept - closing server socket: %s\n", strerror(errno));
+        socketClose(sock);
+        break;
     }
   }
   return r;
 }
 
+/// Build a protocol v2 frame.
+/// \param dest Receives the frame.
+/// \param size Number of bytes that dest can hold.
+/// \param id The request ID of the frame.
+/// \param payload The message, not null-terminated.
+/// \param len The length of payload, at most BB_FRAME_MAX.
+/// \returns The length of the frame, or 0 if it does not fit in dest.
+
+size_t frameBuild(char *dest, size_t size, uint32_t id, const char *payload,
+        size_t len) {
+  uint32_t header[2];
+  if (len > BB_FRAME_MAX || size < BB_FRAME_HEADER + len) {
+    return 0;
+  }
+  header[0] = htonl(len);
+  header[1] = htonl(id);
+  memcpy(dest, header, BB_FRAME_HEADER);
+  memcpy(dest + BB_FRAME_HEADER, payload, len);
+  return BB_FRAME_HEADER + len;
+}//frameBuild
+
+/// Find the first protocol v2 frame in received data. The data may end in the
+/// middle of a frame, the rest is expected to arrive with a later read.
+/// \param buff The received data.
+/// \param size The number of bytes in buff.
+/// \param id Receives the request ID of the frame.
+/// \param payload Receives the start of the payload in buff.
+/// \param len Receives the length of the payload.
+/// \returns The length of the frame, 0 if the frame is incomplete or
+/// (size_t) -1 if its payload is longer than BB_FRAME_MAX.
+
+size_t frameParse(const char *buff, size_t size, uint32_t *id,
+        const char **payload, size_t *len) {
+  uint32_t header[2];
+  if (size < BB_FRAME_HEADER) {
+    return 0;
+  }
+  memcpy(header, buff, BB_FRAME_HEADER);
+  *len = ntohl(header[0]);
+  if (*len > BB_FRAME_MAX) {
+    return (size_t) -1;
+  }
+  if (size < BB_FRAME_HEADER + *len) {
+    return 0;
+  }
+  *id = ntohl(header[1]);
+  *payload = buff + BB_FRAME_HEADER;
+  return BB_FRAME_HEADER + *len;
+}//frameParse
+
+/// Write a message as a single protocol v2 frame.
+/// \param sock The socket to write to. Set to -1 if any error occurs.
+/// \param id The request ID of the frame.
+/// \param payload The message, not null-terminated.
+/// \param len The length of payload, longer messages are truncated.
+/// \returns The amount of bytes actually written.
+
+int socketWriteFrame(int * sock, uint32_t id, const char *payload, size_t len) {
+  char frame[BB_FRAME_HEADER + BB_FRAME_MAX];
+  if (len > BB_FRAME_MAX) {
+    len = BB_FRAME_MAX;
+  }
+  return socketWrite(sock, frame,
+          frameBuild(frame, sizeof frame, id, payload, len));
+}//socketWriteFrame
+
 // Ensures that the given buffer is properly NUL terminated.
 // \param buff Writable uffer containing data to be NUL terminated.
 // \param size The expected size of data in the buffer, including NUL (if any).
@@ -22,6 +22,8 @@
  * Common networking functions for Bumblebee
  */
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 
 #define SOCK_BLOCK 0
 #define SOCK_NOBLOCK 1
@@ -32,3 +34,23 @@ int socketWrite(int * sock, void * buffer, int len);
 int socketRead(int * sock, void * buffer, int len);
 int socketServer(char * address, int nonblock);
 int socketAccept(int * sock, int nonblock);
+
+/*
+ * Protocol version 2. A client switches to it by sending the legacy message
+ * "Query Protocol 2", which an older daemon answers with an error. After the
+ * reply "Value: 2", every message in both directions is a frame: an 8 byte
+ * header holding the payload length and a request ID, both as big-endian
+ * 32-bit integers, followed by the payload without null byte. Payloads are
+ * the messages of the legacy protocol. A reply carries the ID of its request
+ * such that several requests can be sent at once.
+ */
+#define BB_PROTOCOL_VERSION 2
+#define BB_FRAME_HEADER 8
+/* Maximum length of a frame payload, messages fit in BUFFER_SIZE */
+#define BB_FRAME_MAX (BUFFER_SIZE - 1)
+
+size_t frameBuild(char *dest, size_t size, uint32_t id, const char *payload,
+        size_t len);
+size_t frameParse(const char *buff, size_t size, uint32_t *id,
+        const char **payload, size_t *len);
+int socketWriteFrame(int * sock, uint32_t id, const char *payload, size_t len);
@@ -22,7 +22,9 @@
  * Functions for communicating with the daemon through a socket
  */
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/syslog.h>
 #include "bbsocket.h"
@@ -30,6 +32,150 @@
 #include "bbconfig.h"
 #include "bblogger.h"
 
+/* Maximum number of queries that are sent at once */
+#define BB_QUERY_MAX 8
+
+/* Whether the daemon speaks protocol v2 on this connection */
+static bool protocol_v2;
+/* Request ID of the last request sent in protocol v2 */
+static uint32_t last_id;
+/* Received data that does not form a complete frame yet */
+static struct {
+  size_t len;
+  char data[2 * (BB_FRAME_HEADER + BB_FRAME_MAX)];
+} input;
+
+/**
+ * Switches the connection to protocol v2 if the daemon supports it, older
+ * daemons keep using the legacy protocol. A first request can be sent in the
+ * same write to save a round-trip, older daemons drop it since they only
+ * handle a single message per read.
+ * @param first A request in protocol v2 or NULL
+ * @param id Receives the request ID of first
+ * @return The protocol version in use, first has only been sent if it is
+ * BB_PROTOCOL_VERSION
+ */
+int bbsocket_negotiate(const char *first, uint32_t *id) {
+  char buff[BUFFER_SIZE + BB_FRAME_HEADER + BB_FRAME_MAX];
+  char *nul;
+  size_t len;
+
+  len = snprintf(buff, BUFFER_SIZE, "Query Protocol %i", BB_PROTOCOL_VERSION) + 1;
+  if (first) {
+    *id = ++last_id;
+    len += frameBuild(buff + len, sizeof buff - len, *id, first, strlen(first));
+  }
+  if (!socketWrite(&bb_status.bb_socket, buff, len)) {
+    return 1;
+  }
+  /* the reply to first may arrive in the same read, keep it for later */
+  input.len = 0;
+  while (!(nul = memchr(input.data, 0, input.len))) {
+    int r;
+    if (bb_status.bb_socket == -1 || input.len == sizeof input.data) {
+      return 1;
+    }
+    r = socketRead(&bb_status.bb_socket, input.data + input.len,
+            sizeof input.data - input.len);
+    if (r > 0) {
+      input.len += r;
+    }
+  }
+  /* older daemons answer "Unknown key requested." */
+  if (!strncmp(input.data, "Value: ", strlen("Value: ")) &&
+          atoi(input.data + strlen("Value: ")) == BB_PROTOCOL_VERSION) {
+    protocol_v2 = true;
+  }
+  input.len -= nul + 1 - input.data;
+  memmove(input.data, nul + 1, input.len);
+  bb_log(LOG_DEBUG, "Using protocol v%i\n", protocol_v2 ? BB_PROTOCOL_VERSION : 1);
+  return protocol_v2 ? BB_PROTOCOL_VERSION : 1;
+}
+
+/**
+ * Sends a request over the socket
+ * @param msg The request
+ * @param id Receives the request ID of the request, 0 in the legacy protocol
+ * @return 0 on success, non-zero on failure
+ */
+int bbsocket_send(const char *msg, uint32_t *id) {
+  if (!protocol_v2) {
+    *id = 0;
+    return !socketWrite(&bb_status.bb_socket, (void *) msg, strlen(msg) + 1);
+  }
+  *id = ++last_id;
+  return !socketWriteFrame(&bb_status.bb_socket, *id, msg, strlen(msg));
+}
+
+/**
+ * Receives the next reply over the socket, blocking until it has arrived
+ * @param id Receives the request ID the reply belongs to, 0 in the legacy
+ * protocol
+ * @param target A pointer to a char to store the null-terminated reply in
+ * @param max_len The maximum number of bytes to be written in target, must be
+ * greater than 0
+ * @return 0 on success, non-zero on failure
+ */
+int bbsocket_recv(uint32_t *id, char *target, size_t max_len) {
+  while (bb_status.bb_socket != -1) {
+    const char *payload;
+    size_t n, len;
+    int r;
+
+    if (!protocol_v2) {
+      /* legacy replies are assumed to arrive whole */
+      r = socketRead(&bb_status.bb_socket, target, max_len);
+      if (r > 0) {
+        ensureZeroTerminated(target, r, max_len);
+        *id = 0;
+        return 0;
+      }
+      continue;
+    }
+    n = frameParse(input.data, input.len, id, &payload, &len);
+    if (n == (size_t) -1) {
+      bb_log(LOG_ERR, "Invalid reply from the daemon\n");
+      socketClose(&bb_status.bb_socket);
+      break;
+    }
+    if (n > 0) {
+      if (len >= max_len) {
+        len = max_len - 1;
+      }
+      memcpy(target, payload, len);
+      target[len] = 0;
+      input.len -= n;
+      memmove(input.data, input.data + n, input.len);
+      return 0;
+    }
+    r = socketRead(&bb_status.bb_socket, input.data + input.len,
+            sizeof input.data - input.len);
+    if (r > 0) {
+      input.len += r;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Stores the value from a reply to a query
+ * @return 0 on success, non-zero if the reply is not a value
+ */
+static int query_value(const char *key, const char *reply, char *target,
+        size_t max_len) {
+  if (strncmp("Value: ", reply, strlen("Value: "))) {
+    bb_log(LOG_DEBUG, "Failed to query for %s: %s\n", key, reply);
+    return 1;
+  }
+  strncpy(target, reply + strlen("Value: "), max_len);
+  target[max_len - 1] = 0;
+  /* remove trailing newline */
+  if (strlen(target)) {
+    target[strlen(target) - 1] = 0;
+  }
+  return 0;
+}
+
 /**
  * Requests a key over the socket
  * @param key The key to be retrieved
@@ -39,29 +185,62 @@
  * @return 0 on success, non-zero on failure
  */
 int bbsocket_query(const char *key, char *target, size_t max_len) {
+  return bbsocket_query_many(&key, &target, max_len, 1);
+}
+
+/**
+ * Requests several keys over the socket. In protocol v2 all queries are sent
+ * at once and the replies are matched by request ID, otherwise one query is
+ * sent after the other
+ * @param keys The keys to be retrieved
+ * @param targets For each key a pointer to a char to store the value in
+ * @param max_len The maximum number of bytes to be written in each target,
+ * must be greater than 0
+ * @param count The number of keys
+ * @return 0 on success, non-zero on failure
+ */
+int bbsocket_query_many(const char *const keys[], char *const targets[],
+        size_t max_len, int count) {
   char buff[BUFFER_SIZE];
-  snprintf(buff, sizeof buff, "Query %s", key);
-  if (!socketWrite(&bb_status.bb_socket, buff, strlen(buff) + 1)) {
-    bb_log(LOG_DEBUG, "Write failed for query of %s\n", key);
-    return 1;
-  }
-  while (bb_status.bb_socket != -1) {
-    int r = socketRead(&bb_status.bb_socket, buff, sizeof (buff));
-    if (r > 0) {
-      ensureZeroTerminated(buff, r, sizeof (buff));
-      if (strncmp("Value: ", buff, strlen("Value: "))) {
-        bb_log(LOG_DEBUG, "Failed to query for %s: %s\n", key, buff);
+  char frames[BB_QUERY_MAX * (BB_FRAME_HEADER + BUFFER_SIZE)];
+  size_t len = 0;
+  uint32_t id, first_id = last_id + 1;
+  int i, received;
+
+  if (!protocol_v2 || count > BB_QUERY_MAX) {
+    for (i = 0; i < count; i++) {
+      snprintf(buff, sizeof buff, "Query %s", keys[i]);
+      if (bbsocket_send(buff, &id) || bbsocket_recv(&id, buff, sizeof buff)) {
+        bb_log(LOG_DEBUG, "Read failed for query of %s\n", keys[i]);
         return 1;
       }
-      strncpy(target, buff + strlen("Value: "), max_len);
-      target[max_len - 1] = 0;
-      /* remove trailing newline */
-      if (strlen(target)) {
-        target[strlen(target) - 1] = 0;
+      if (query_value(keys[i], buff, targets[i], max_len)) {
+        return 1;
       }
-      return 0;
     }
+    return 0;
   }
-  bb_log(LOG_DEBUG, "Read failed for query of %s\n", key);
-  return 1;
+  for (i = 0; i < count; i++) {
+    int r = snprintf(buff, sizeof buff, "Query %s", keys[i]);
+    len += frameBuild(frames + len, sizeof frames - len, ++last_id, buff, r);
+  }
+  if (!socketWrite(&bb_status.bb_socket, frames, len)) {
+    bb_log(LOG_DEBUG, "Write failed for queries\n");
+    return 1;
+  }
+  for (received = 0; received < count; received++) {
+    if (bbsocket_recv(&id, buff, sizeof buff)) {
+      bb_log(LOG_DEBUG, "Read failed for queries\n");
+      return 1;
+    }
+    /* replies arrive in the order the daemon completes them */
+    if (id < first_id || id - first_id >= (uint32_t) count) {
+      return 1;
+    }
+    i = id - first_id;
+    if (query_value(keys[i], buff, targets[i], max_len)) {
+      return 1;
+    }
+  }
+  return 0;
 }
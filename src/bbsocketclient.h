@@ -20,5 +20,12 @@
 
 
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
 
+int bbsocket_negotiate(const char *first, uint32_t *id);
+int bbsocket_send(const char *msg, uint32_t *id);
+int bbsocket_recv(uint32_t *id, char *target, size_t max_len);
 int bbsocket_query(const char *key, char *target, size_t max_len);
+int bbsocket_query_many(const char *const keys[], char *const targets[],
+        size_t max_len, int count);
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Status page of the daemon. The page is a file, normally on a tmpfs, that
+ * the daemon maps and updates in place. Readers map it as well and copy the
+ * state out of it without any system call:
+ *  - the daemon makes seq odd, writes the new state and makes seq even again;
+ *  - a reader reads seq, copies the state and reads seq again. The copy is
+ *    consistent if seq was even and did not change in the meantime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bbstatus.h"
+#include "bblogger.h"
+#include "switch/switching.h"
+
+/* Number of attempts to get a consistent copy while the page is updated */
+#define STATUS_READ_ATTEMPTS 1000
+
+static struct status_page *page;
+static char *page_path;
+
+/**
+ * Creates the status page and maps it for updates
+ * @param path The file of the page, no page is published if NULL or empty
+ * @return 0 on success, -1 on failure
+ */
+int status_page_open(const char *path) {
+  void *map;
+  int fd;
+
+  if (!path || !*path) {
+    return 0;
+  }
+  /* never write through a page that a stale reader may hold */
+  unlink(path);
+  fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+  if (fd == -1) {
+    bb_log(LOG_WARNING, "Could not create status file %s: %s\n", path,
+            strerror(errno));
+    return -1;
+  }
+  /* readable by the group of the daemon, as the socket */
+  fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP);
+  if (ftruncate(fd, sizeof *page)) {
+    bb_log(LOG_WARNING, "Could not resize status file %s: %s\n", path,
+            strerror(errno));
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  map = mmap(NULL, sizeof *page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    bb_log(LOG_WARNING, "Could not map status file %s: %s\n", path,
+            strerror(errno));
+    unlink(path);
+    return -1;
+  }
+  page = map;
+  page_path = strdup(path);
+  page->version = STATUS_PAGE_VERSION;
+  page->size = sizeof *page;
+  /* readers check the magic last, see status_page_map */
+  __atomic_store_n(&page->magic, STATUS_PAGE_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Publishes the state of the daemon if it has changed
+ * @param state The new state, unused bytes must be zeroed
+ */
+void status_page_publish(const struct status_state *state) {
+  uint32_t seq;
+
+  if (!page || !memcmp(&page->state, state, sizeof *state)) {
+    return;
+  }
+  seq = page->seq;
+  __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+  /* the odd seq must be visible before any change of the state */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&page->state, state, sizeof *state);
+  page->generation++;
+  __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Marks the daemon as stopped and removes the status page
+ */
+void status_page_close(void) {
+  struct status_state state;
+
+  if (!page) {
+    return;
+  }
+  /* readers that keep the page mapped see that the daemon is gone */
+  memcpy(&state, &page->state, sizeof state);
+  state.pid = 0;
+  status_page_publish(&state);
+  unlink(page_path);
+  munmap(page, sizeof *page);
+  free(page_path);
+  page = NULL;
+  page_path = NULL;
+}
+
+/**
+ * Maps the status page of the daemon for reading. Monitoring tools should
+ * keep it mapped and call status_page_snapshot whenever they need the state.
+ * @param path The file of the page
+ * @return The page, or NULL if it is not available or has another layout
+ */
+const struct status_page *status_page_map(const char *path) {
+  struct status_page *map;
+  struct stat st;
+  int fd;
+
+  if (!path || !*path) {
+    return NULL;
+  }
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) || st.st_size != sizeof *map) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, sizeof *map, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  if (__atomic_load_n(&map->magic, __ATOMIC_ACQUIRE) != STATUS_PAGE_MAGIC ||
+          map->version != STATUS_PAGE_VERSION || map->size != sizeof *map) {
+    munmap(map, sizeof *map);
+    return NULL;
+  }
+  return map;
+}
+
+/**
+ * Copies a consistent state out of a mapped status page
+ * @param map The page, see status_page_map
+ * @param copy Receives the page
+ * @return 0 on success, -1 if the page was updated on every attempt
+ */
+int status_page_snapshot(const struct status_page *map,
+        struct status_page *copy) {
+  int attempt;
+
+  for (attempt = 0; attempt < STATUS_READ_ATTEMPTS; attempt++) {
+    uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      continue;
+    }
+    memcpy(copy, map, sizeof *copy);
+    /* the copy must be complete before seq is checked again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&map->seq, __ATOMIC_RELAXED) == seq) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Unmaps a status page mapped by status_page_map
+ */
+void status_page_unmap(const struct status_page *map) {
+  if (map) {
+    munmap((void *) map, sizeof *map);
+  }
+}
+
+/**
+ * Describes the state of the daemon as in the reply to a Status request
+ * @param state The state of the daemon
+ * @param buffer Receives the description
+ * @param len The size of buffer
+ */
+void status_page_format(const struct status_state *state, char *buffer,
+        size_t len) {
+  const struct status_card *card = &state->cards[0];
+  const char *card_status;
+  size_t pos;
+  int i, j;
+
+  if (state->error[0]) {
+    snprintf(buffer, len, "Error (%s): %s\n", state->version, state->error);
+    return;
+  }
+  switch (state->power) {
+    case SWITCH_OFF:
+      card_status = "off";
+      break;
+    case SWITCH_ON:
+      card_status = "on";
+      break;
+    default:
+      /* no PM available, assume it's on */
+      card_status = "likely on";
+      break;
+  }
+  if (state->card_count == 1 && card->server_count == 1) {
+    if (card->starting) {
+      snprintf(buffer, len, "Ready (%s). X is starting, %u applications"
+              " waiting.\n", state->version, state->waiting);
+    } else if (card->servers[0].state == SERVER_READY ||
+            card->servers[0].state == SERVER_STOPPING) {
+      snprintf(buffer, len, "Ready (%s). X is PID %i, %u applications using"
+              " bumblebeed.\n", state->version, card->servers[0].pid,
+              state->appcount);
+    } else {
+      snprintf(buffer, len, "Ready (%s). X inactive. Discrete video card is"
+              " %s.\n", state->version, card_status);
+    }
+    return;
+  }
+  pos = snprintf(buffer, len, "Ready (%s). %i discrete video cards, %u"
+          " applications using bumblebeed. Power is %s.\n", state->version,
+          state->card_count, state->appcount, card_status);
+  for (i = 0, card = state->cards; i < state->card_count; i++, card++) {
+    for (j = 0; j < card->server_count && pos < len; j++) {
+      const struct status_server *x = &card->servers[j];
+      pos += snprintf(buffer + pos, len - pos, "Card %i (display %s): ", i,
+              x->display);
+      if (pos >= len) {
+        break;
+      }
+      switch (x->state) {
+        case SERVER_STARTING:
+          pos += snprintf(buffer + pos, len - pos, "X is starting, %u"
+                  " applications.\n", x->appcount);
+          break;
+        case SERVER_READY:
+          pos += snprintf(buffer + pos, len - pos, "X is PID %i, %u"
+                  " applications.\n", x->pid, x->appcount);
+          break;
+        case SERVER_STOPPING:
+          pos += snprintf(buffer + pos, len - pos, "X is stopping.\n");
+          break;
+        default:
+          pos += snprintf(buffer + pos, len - pos, "X inactive.\n");
+          break;
+      }
+    }
+  }
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Status page: the daemon publishes its state in a small file that readers
+ * map into memory, such that the state can be read without contacting the
+ * daemon. Updates are guarded by a sequence counter.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "bbsecondary.h"
+
+/* "BBST" */
+#define STATUS_PAGE_MAGIC 0x42425354
+/* Changes whenever the layout of the page changes */
+#define STATUS_PAGE_VERSION 1
+
+/* Lengths of the strings in the page including the null byte */
+#define STATUS_DISPLAY_LEN 16
+#define STATUS_VERSION_LEN 32
+#define STATUS_ERROR_LEN 256
+
+struct status_server {
+  int32_t state; /* enum secondary_server_state */
+  int32_t pid; /* PID of X, 0 if it has not been started */
+  uint32_t appcount; /* applications using this X server */
+  char display[STATUS_DISPLAY_LEN];
+};
+
+struct status_card {
+  int32_t tier; /* enum secondary_tier */
+  int32_t server_count;
+  uint32_t appcount; /* applications using this card */
+  uint32_t starting; /* 1 if a start of the card or an X server is running */
+  /* time at which the current tier was entered, in ms of CLOCK_MONOTONIC */
+  int64_t tier_since;
+  /* ms spent in each tier before the current one was entered */
+  int64_t residency[TIER_COUNT];
+  struct status_server servers[SECONDARY_POOL_MAX];
+};
+
+/* State of the daemon, all strings are null-terminated */
+struct status_state {
+  int32_t pid; /* PID of the daemon, 0 once it has stopped */
+  int32_t power; /* enum switch_state */
+  uint32_t appcount; /* applications using bumblebeed */
+  uint32_t waiting; /* applications waiting for a card to start */
+  int32_t card_count;
+  char version[STATUS_VERSION_LEN]; /* version of the daemon */
+  char error[STATUS_ERROR_LEN]; /* empty if there is no error */
+  struct status_card cards[SECONDARY_MAX];
+};
+
+struct status_page {
+  uint32_t magic; /* STATUS_PAGE_MAGIC */
+  uint32_t version; /* STATUS_PAGE_VERSION */
+  uint32_t seq; /* odd while the daemon updates the page */
+  uint32_t size; /* size of the page in bytes */
+  uint64_t generation; /* incremented on every change of the state */
+  struct status_state state;
+};
+
+int status_page_open(const char *path);
+void status_page_publish(const struct status_state *state);
+void status_page_close(void);
+
+const struct status_page *status_page_map(const char *path);
+int status_page_snapshot(const struct status_page *page,
+        struct status_page *copy);
+void status_page_unmap(const struct status_page *page);
+void status_page_format(const struct status_state *state, char *buffer,
+        size_t len);
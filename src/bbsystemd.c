@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Integration with the service manager. The protocols are simple enough to
+ * be implemented here instead of depending on libsystemd:
+ *  - socket activation: the listening socket is passed as file descriptor 3,
+ *    announced by LISTEN_PID and LISTEN_FDS;
+ *  - notifications: datagrams like "READY=1" are sent to the socket named in
+ *    NOTIFY_SOCKET, a leading @ denotes the abstract namespace;
+ *  - watchdog: "WATCHDOG=1" must be sent every WATCHDOG_USEC microseconds if
+ *    WATCHDOG_PID is unset or names this process.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "bbsystemd.h"
+#include "bbevent.h"
+#include "bblogger.h"
+
+static struct bb_timer watchdog_timer;
+static int watchdog_interval; /* ms between pings, 0 if disabled */
+
+/**
+ * Whether an environment variable holding a PID names this process
+ */
+static int env_is_own_pid(const char *name) {
+  const char *value = getenv(name);
+  char *end;
+  long pid;
+
+  if (!value) {
+    return 0;
+  }
+  errno = 0;
+  pid = strtol(value, &end, 10);
+  return !errno && end != value && !*end && pid == (long) getpid();
+}
+
+/**
+ * Returns the listening socket passed by socket activation. The environment
+ * variables are cleared such that child processes do not pick up the socket.
+ * @return The file descriptor of a listening stream socket, or -1 if the
+ * daemon was not socket activated
+ */
+int systemd_listen_fd(void) {
+  const char *fds = getenv("LISTEN_FDS");
+  int fd = SYSTEMD_LISTEN_FDS_START, type, listening;
+  socklen_t len;
+
+  if (!fds || !env_is_own_pid("LISTEN_PID")) {
+    return -1;
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if (atoi(fds) != 1) {
+    bb_log(LOG_WARNING, "Expected one socket from socket activation, got %s\n",
+            fds);
+    if (atoi(fds) < 1) {
+      return -1;
+    }
+  }
+  len = sizeof type;
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) || type != SOCK_STREAM) {
+    bb_log(LOG_ERR, "Socket passed by socket activation is not a stream"
+            " socket\n");
+    return -1;
+  }
+  len = sizeof listening;
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) ||
+          !listening) {
+    bb_log(LOG_ERR, "Socket passed by socket activation is not listening\n");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  return fd;
+}
+
+/**
+ * Sends a state change to the service manager, if the daemon runs under one
+ * that asked for notifications
+ * @param state Newline-separated assignments, for example "READY=1"
+ */
+void systemd_notify(const char *state) {
+  const char *path = getenv("NOTIFY_SOCKET");
+  struct sockaddr_un addr;
+  socklen_t len;
+  int sock;
+
+  if (!path || (path[0] != '/' && path[0] != '@') ||
+          strlen(path) >= sizeof addr.sun_path) {
+    return;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+  if (path[0] == '@') {
+    addr.sun_path[0] = 0;
+  } else {
+    len++;
+  }
+  sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    bb_log(LOG_WARNING, "Could not create notification socket: %s\n",
+            strerror(errno));
+    return;
+  }
+  if (sendto(sock, state, strlen(state), MSG_NOSIGNAL,
+          (struct sockaddr *) &addr, len) < 0) {
+    bb_log(LOG_WARNING, "Could not notify service manager: %s\n",
+            strerror(errno));
+  }
+  close(sock);
+}
+
+/**
+ * Timer handler that tells the service manager that the event loop is alive
+ */
+static void watchdog_ping(void *data) {
+  (void) data; /* unused parameter */
+  systemd_notify("WATCHDOG=1");
+  bb_timer_start(&watchdog_timer, watchdog_interval, watchdog_ping, NULL);
+}
+
+/**
+ * Starts pinging the watchdog from the event loop if the service manager
+ * enabled it. Pings are sent at half the watchdog timeout such that a single
+ * late wakeup does not get the daemon killed.
+ */
+void systemd_watchdog_start(void) {
+  const char *usec = getenv("WATCHDOG_USEC");
+  long long timeout;
+
+  if (!usec || (getenv("WATCHDOG_PID") && !env_is_own_pid("WATCHDOG_PID"))) {
+    return;
+  }
+  timeout = atoll(usec) / 1000;
+  if (timeout <= 0) {
+    return;
+  }
+  watchdog_interval = timeout / 2 > 0 ? (int) (timeout / 2) : 1;
+  bb_log(LOG_DEBUG, "Watchdog enabled, pinging every %i ms\n",
+          watchdog_interval);
+  watchdog_ping(NULL);
+}
+
+/**
+ * Stops pinging the watchdog
+ */
+void systemd_watchdog_stop(void) {
+  bb_timer_stop(&watchdog_timer);
+  watchdog_interval = 0;
+}
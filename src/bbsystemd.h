@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Integration with the service manager: socket activation, readiness and
+ * watchdog notifications
+ */
+#pragma once
+
+/* First file descriptor passed by socket activation */
+#define SYSTEMD_LISTEN_FDS_START 3
+
+int systemd_listen_fd(void);
+void systemd_notify(const char *state);
+void systemd_watchdog_start(void);
+void systemd_watchdog_stop(void);
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "bbuevent.h"
+#include "bbevent.h"
+#include "bblogger.h"
+#include "module.h"
+#include "pci.h"
+
+static int uevent_fd = -1;
+static uevent_callback uevent_notify;
+
+/**
+ * Splits a uevent message into its fields. A kernel message starts with
+ * "ACTION@DEVPATH" followed by null-terminated KEY=VALUE pairs
+ * @param buf The message, it is null-terminated by this function
+ * @param len The length of the message, buf must hold one more byte
+ * @param event Receives the fields
+ * @return 0 on success, -1 if the message is not a kernel uevent
+ */
+int uevent_parse(char *buf, size_t len, struct uevent *event) {
+  char *field;
+
+  memset(event, 0, sizeof *event);
+  buf[len] = 0;
+  /* messages of udev start with "libudev" and have a binary header */
+  if (!strchr(buf, '@')) {
+    return -1;
+  }
+  for (field = buf + strlen(buf) + 1; field < buf + len;
+          field += strlen(field) + 1) {
+    if (!strncmp(field, "ACTION=", strlen("ACTION="))) {
+      event->action = field + strlen("ACTION=");
+    } else if (!strncmp(field, "DEVPATH=", strlen("DEVPATH="))) {
+      event->devpath = field + strlen("DEVPATH=");
+    } else if (!strncmp(field, "SUBSYSTEM=", strlen("SUBSYSTEM="))) {
+      event->subsystem = field + strlen("SUBSYSTEM=");
+    } else if (!strncmp(field, "DRIVER=", strlen("DRIVER="))) {
+      event->driver = field + strlen("DRIVER=");
+    } else if (!strncmp(field, "PCI_SLOT_NAME=", strlen("PCI_SLOT_NAME="))) {
+      event->slot = field + strlen("PCI_SLOT_NAME=");
+    }
+  }
+  return event->action && event->devpath && event->subsystem ? 0 : -1;
+}
+
+/**
+ * Updates the PCI inventory and the module states from a uevent
+ */
+static void uevent_apply(const struct uevent *event) {
+  if (!strcmp(event->subsystem, "pci")) {
+    struct pci_bus_id bus_id;
+    unsigned int domain, bus, slot, func;
+
+    if (!event->slot || sscanf(event->slot, "%x:%x:%x.%o", &domain, &bus,
+            &slot, &func) != 4) {
+      return;
+    }
+    bus_id.domain = domain;
+    bus_id.bus = bus;
+    bus_id.slot = slot;
+    bus_id.func = func;
+    if (!strcmp(event->action, "bind")) {
+      pci_driver_set(&bus_id, event->driver ? event->driver : "");
+    } else if (!strcmp(event->action, "unbind")) {
+      pci_driver_set(&bus_id, "");
+    } else if (!strcmp(event->action, "add") ||
+            !strcmp(event->action, "remove")) {
+      pci_inventory_scan();
+    } else {
+      pci_driver_invalidate(&bus_id);
+    }
+  } else if (!strcmp(event->subsystem, "module") &&
+          !strncmp(event->devpath, "/module/", strlen("/module/"))) {
+    const char *name = event->devpath + strlen("/module/");
+
+    if (!strcmp(event->action, "add")) {
+      module_changed(name, 1);
+    } else if (!strcmp(event->action, "remove")) {
+      module_changed(name, 0);
+    }
+  }
+}
+
+/**
+ * Event handler for the uevent socket
+ */
+static void uevent_ready(int fd, unsigned int events, void *data) {
+  char buf[UEVENT_BUFFER];
+  struct uevent event;
+  ssize_t r;
+  (void) events; /* unused parameter */
+  (void) data; /* unused parameter */
+
+  /* only the kernel and privileged processes can send to this socket */
+  while ((r = recv(fd, buf, sizeof buf - 1, 0)) != 0) {
+    if (r < 0) {
+      if (errno == ENOBUFS) {
+        /* events were lost, read everything again when it is needed */
+        bb_log(LOG_DEBUG, "uevents were lost, dropping the cached state\n");
+        pci_inventory_scan();
+        module_track(1);
+        if (uevent_notify) {
+          uevent_notify(NULL);
+        }
+        continue;
+      }
+      if (errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    if (uevent_parse(buf, r, &event)) {
+      continue;
+    }
+    bb_log(LOG_DEBUG, "uevent: %s %s\n", event.action, event.devpath);
+    uevent_apply(&event);
+    if (uevent_notify) {
+      uevent_notify(&event);
+    }
+  }
+}
+
+/**
+ * Starts listening for kernel uevents in the event loop. The module states
+ * are kept from then on
+ * @param callback Called after every uevent, may be NULL
+ * @return 0 on success, -1 on failure (the states are probed then)
+ */
+int uevent_open(uevent_callback callback) {
+  struct sockaddr_nl addr;
+  int fd, size = UEVENT_RCVBUF;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+          NETLINK_KOBJECT_UEVENT);
+  if (fd == -1) {
+    bb_log(LOG_WARNING, "Could not create uevent socket: %s\n",
+            strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof addr);
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1; /* kernel events, not the ones from udev */
+  /* a larger buffer needs privileges, the default one is fine otherwise */
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof size)) {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+  }
+  if (bind(fd, (struct sockaddr *) &addr, sizeof addr)) {
+    bb_log(LOG_WARNING, "Could not listen for uevents: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return uevent_listen(fd, callback);
+}
+
+/**
+ * Starts listening for uevents on an opened socket, which is closed by
+ * uevent_close. uevent_open uses the kernel socket, the tests a local one
+ * @param fd A non-blocking datagram socket receiving uevent messages
+ * @param callback Called after every uevent, may be NULL
+ * @return 0 on success, -1 on failure (the socket is closed then)
+ */
+int uevent_listen(int fd, uevent_callback callback) {
+  if (bb_event_add(fd, EPOLLIN, uevent_ready, NULL)) {
+    bb_log(LOG_WARNING, "Could not listen for uevents: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  uevent_fd = fd;
+  uevent_notify = callback;
+  module_track(1);
+  bb_log(LOG_DEBUG, "Listening for uevents\n");
+  return 0;
+}
+
+/**
+ * Stops listening for uevents, the states are probed again from then on
+ */
+void uevent_close(void) {
+  if (uevent_fd == -1) {
+    return;
+  }
+  module_track(0);
+  bb_event_remove(uevent_fd);
+  close(uevent_fd);
+  uevent_fd = -1;
+  uevent_notify = NULL;
+}
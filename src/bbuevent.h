@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Kernel uevents: the daemon listens on a NETLINK_KOBJECT_UEVENT socket and
+ * keeps the PCI inventory and the state of the kernel modules up to date from
+ * the add, remove, bind, unbind and change events, instead of probing sysfs
+ * and /proc/modules.
+ */
+#pragma once
+
+/* Size of the buffer for a single uevent message */
+#define UEVENT_BUFFER 8192
+
+/* Receive buffer of the socket, large enough for the burst of events caused
+ * by loading a driver */
+#define UEVENT_RCVBUF (1024 * 1024)
+
+/* A parsed uevent, the strings point into the received message */
+struct uevent {
+  const char *action; /* add, remove, bind, unbind, change, ... */
+  const char *devpath; /* e.g. /devices/pci0000:00/0000:00:01.0/0000:01:00.0 */
+  const char *subsystem; /* pci, module, ... */
+  const char *driver; /* DRIVER, NULL if absent */
+  const char *slot; /* PCI_SLOT_NAME, NULL if absent */
+};
+
+/**
+ * Called after a uevent was applied to the PCI inventory and module states.
+ * event is NULL if events were lost and the states were dropped.
+ */
+typedef void (*uevent_callback)(const struct uevent *event);
+
+int uevent_open(uevent_callback callback);
+int uevent_listen(int fd, uevent_callback callback);
+void uevent_close(void);
+int uevent_parse(char *buf, size_t len, struct uevent *event);
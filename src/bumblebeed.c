@@ -23,7 +23,9 @@
  * C-coded version of the Bumblebee daemon and optirun.
  */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -43,8 +45,14 @@
 #endif
 #include "bbconfig.h"
 #include "bbsocket.h"
+#include "bbevent.h"
 #include "bblogger.h"
 #include "bbsecondary.h"
+#include "bbhistory.h"
+#include "bbenergy.h"
+#include "bbnuma.h"
+#include "bbsystemd.h"
+#include "bbstatus.h"
 #include "bbrun.h"
 #include "pci.h"
 #include "driver.h"
@@ -152,213 +160,1312 @@ static void handle_signal(int sig) {
   }
 }
 
-/// Socket list structure for use in main_loop.
+/// Daemon state of a discrete card.
+
+struct card {
+  struct secondary *s;
+  unsigned int appcount; /// Applications using this card
+  unsigned int waiting; /// Parked Connect requests for this card
+  unsigned int server_load[SECONDARY_POOL_MAX]; /// Applications per X server
+  struct bb_timer linger_timer; /// Delayed stop of an unused X server
+  struct bb_timer standby_timer; /// Delayed power off of an unused card
+};
+
+/// Size of the input buffer of a client, holds several pipelined requests.
+#define CLIENT_INPUT_SIZE (4 * BUFFER_SIZE)
+
+/// Received data that does not form a complete message yet.
+
+struct client_input {
+  size_t len;
+  char data[CLIENT_INPUT_SIZE];
+};
+
+/// Size of the queue of messages that a slow client has not read yet.
+#define CLIENT_QUEUE_SIZE 4096
+
+/// Replies and events waiting for a client whose socket is full.
+
+struct client_queue {
+  size_t len;
+  unsigned int lost; /// Events dropped because the queue was full
+  char data[CLIENT_QUEUE_SIZE];
+};
+
+/// Client connection state for use in main_loop.
+/// The clients table is indexed by the socket file descriptor.
 
 struct clientsocket {
   int sock;
   int inuse;
-  struct clientsocket * prev;
-  struct clientsocket * next;
+  bool v2; /// Whether the client switched to protocol v2
+  bool plan; /// Whether the pending Connect asked for a launch plan
+  uint32_t connect_id; /// Request ID of the pending Connect in protocol v2
+  struct client_input *input; /// Allocated once a message is split over reads
+  bool subscribed; /// Whether the client receives events
+  uint32_t subscribe_id; /// Request ID of the Subscribe in protocol v2
+  struct client_queue *queue; /// Allocated once the socket is full
+  struct clientsocket * sub_prev;
+  struct clientsocket * sub_next;
+  struct card *card; /// Card the application runs on, valid after Connect
+  int server; /// X server of the card the application uses, -1 if none
+  bool waiting; /// Whether a Connect request is parked until the secondary has started
+  struct clientsocket * wait_prev;
+  struct clientsocket * wait_next;
+  uid_t uid; /// User running the application, valid after Connect
+  char comm[HISTORY_COMM_LEN]; /// Command name of the application
 };
 
-/// Receive and/or sent data to/from this socket.
-/// \param sock Pointer to socket. Assumed to be valid.
+static struct clientsocket *clients;
+static struct clientsocket *waiting_clients; /// List of parked Connect requests
+static struct clientsocket *subscribers; /// List of clients that receive events
+static struct status_state published; /// State as last sent to subscribers
+static bool unpublished = true; /// The state changed since it was published
+static unsigned int waiting_count;
+static struct card cards[SECONDARY_MAX];
+static int card_count;
 
-static void handle_socket(struct clientsocket * C) {
-  static char buffer[BUFFER_SIZE], *conf_key;
-  bool need_secondary;
-  //since these are local sockets, we can safely assume we get whole messages at a time
-  int r = socketRead(&C->sock, buffer, BUFFER_SIZE);
+/* Speculative starts of the secondary based on the usage history */
+static struct {
+  bool active; /// The secondary is kept warm for a predicted application
+  struct card *card; /// Card that is kept warm
+  long long since; /// Time at which the warm period started
+  time_t day; /// Day for which wasted_today is counted
+  long long wasted_today; /// Warm time that was not used on that day (ms)
+  unsigned int prewarms;
+  unsigned int hits; /// Warm periods that ended with a Connect
+  unsigned int misses; /// Warm periods that expired
+  long long wasted; /// Total warm time that was not used (ms)
+  long long saved; /// Total estimated start latency avoided (ms)
+  struct bb_timer hold; /// End of the warm period
+  struct bb_timer check; /// Next check for predicted demand
+} prewarm;
+
+static void client_remove(int fd);
+static void prewarm_hit(struct card *card);
+
+/// Note a change of the state of the daemon. It is published once the event
+/// that caused it has been handled, such that subscribers do not see the
+/// steps in between.
+
+static void state_changed(void) {
+  unpublished = true;
+}
+
+/// Called when the power state of the card has changed, also when the kernel
+/// changed it by itself.
+
+static void power_changed(enum switch_state state, void *data) {
+  (void) state;
+  (void) data;
+  /* the card may have left its tier, which publishes the state */
+  secondary_power_changed();
+}
+
+/// Park a Connect request until the secondary has started.
+
+static void client_wait(struct clientsocket * C) {
+  if (C->waiting) {
+    return;
+  }
+  C->waiting = true;
+  C->wait_prev = 0;
+  C->wait_next = waiting_clients;
+  if (waiting_clients) {
+    waiting_clients->wait_prev = C;
+  }
+  waiting_clients = C;
+  waiting_count++;
+  C->card->waiting++;
+  state_changed();
+}
+
+/// Remove a client from the list of parked Connect requests, if it is in it.
+
+static void client_unwait(struct clientsocket * C) {
+  if (!C->waiting) {
+    return;
+  }
+  if (C->wait_next) {
+    C->wait_next->wait_prev = C->wait_prev;
+  }
+  if (C->wait_prev) {
+    C->wait_prev->wait_next = C->wait_next;
+  } else {
+    waiting_clients = C->wait_next;
+  }
+  C->waiting = false;
+  C->wait_prev = C->wait_next = 0;
+  waiting_count--;
+  C->card->waiting--;
+  state_changed();
+}
+
+/// Queue a message for a client, dropping it if too many are queued.
+/// \param msg The message as it is sent over the socket.
+/// \param len The length of msg.
+/// \returns false if the message was dropped.
+
+static bool client_queue(struct clientsocket * C, const char *msg,
+        size_t len) {
+  if (!C->queue) {
+    C->queue = malloc(sizeof *C->queue);
+    if (!C->queue) {
+      bb_log(LOG_WARNING, "Could not allocate message queue\n");
+      socketClose(&C->sock);
+      return false;
+    }
+    C->queue->len = 0;
+    C->queue->lost = 0;
+  }
+  if (C->queue->len + len > sizeof C->queue->data) {
+    C->queue->lost++;
+    return false;
+  }
+  if (C->queue->len == 0) {
+    bb_event_mod(C->sock, EPOLLIN | EPOLLOUT);
+  }
+  memcpy(C->queue->data + C->queue->len, msg, len);
+  C->queue->len += len;
+  return true;
+}
+
+/// Write a message to a client without blocking. What the socket cannot take
+/// is queued and sent once it can, after the messages queued before.
+/// \param msg The message as it is sent over the socket.
+/// \param len The length of msg.
+/// \returns false if the message was dropped because the queue was full.
+
+static bool client_send(struct clientsocket * C, const char *msg, size_t len) {
+  int r = 0;
+
+  if (!C->queue || (C->queue->len == 0 && C->queue->lost == 0)) {
+    r = socketWrite(&C->sock, (void *) msg, len);
+  }
+  if (C->sock >= 0 && (size_t) r < len) {
+    /* a partially written message always fits into the empty queue */
+    return client_queue(C, msg + r, len - r);
+  }
+  return true;
+}
+
+/// Send a reply to a client, as a frame in protocol v2 or as a null-terminated
+/// string in the legacy protocol. A client whose replies do not fit into the
+/// queue anymore does not read them and is disconnected.
+/// \param id The request ID of the request that is answered.
+/// \param text The reply.
+
+static void client_reply(struct clientsocket * C, uint32_t id, const char *text) {
+  char msg[BB_FRAME_HEADER + BB_FRAME_MAX];
+  size_t len = strlen(text);
+
+  if (C->v2) {
+    len = frameBuild(msg, sizeof msg, id, text,
+            len < BB_FRAME_MAX ? len : BB_FRAME_MAX);
+    if (client_send(C, msg, len)) {
+      return;
+    }
+  } else if (client_send(C, text, len + 1)) {
+    return;
+  }
+  if (C->sock >= 0) {
+    bb_log(LOG_WARNING, "Client does not read its replies, disconnecting\n");
+    socketClose(&C->sock);
+  }
+}
+
+/// The part of a launch plan that is the same for all clients: the settings
+/// that can be queried except the display, which depends on the card, and the
+/// libGL.so.1 files in the library path for primus.
+/// The configuration does not change while the daemon runs, so it is built
+/// once. The LibGL line is left out if it does not fit, optirun then builds it
+/// from the library path itself.
+/// \return Lines of the form "Key: value\n".
+
+static const char *plan_common(void) {
+  static char plan[BUFFER_SIZE];
+  char paths[BUFFER_SIZE], libgl[BUFFER_SIZE], *path, *saveptr;
+  size_t len, libgl_len;
+
+  if (plan[0]) {
+    return plan;
+  }
+  len = snprintf(plan, sizeof plan, "LibraryPath: %s\nDriver: %s\n",
+          bb_config.ld_path, bb_config.driver);
+  if (bb_config.ld_path[0] && len < sizeof plan) {
+    /* from library path A:B build A/libGL.so.1:B/libGL.so.1 */
+    snprintf(paths, sizeof paths, "%s", bb_config.ld_path);
+    libgl_len = snprintf(libgl, sizeof libgl, "LibGL: ");
+    path = strtok_r(paths, ":", &saveptr);
+    for (; path && libgl_len < sizeof libgl;
+            path = strtok_r(NULL, ":", &saveptr)) {
+      libgl_len += snprintf(libgl + libgl_len, sizeof libgl - libgl_len,
+              "%s/libGL.so.1%s", path, saveptr && *saveptr ? ":" : "\n");
+    }
+    if (len + libgl_len < sizeof plan) {
+      memcpy(plan + len, libgl, libgl_len + 1);
+    }
+  }
+  return plan;
+}
+
+/// Answer a Connect request. For a Plan request, the launch plan follows the
+/// first line of the reply, with the display of the chosen card and its
+/// placement if applications are to run next to it.
+/// \param success Whether the secondary can be used.
+
+static void reply_connect(struct clientsocket * C, bool success) {
+  char buffer[BUFFER_SIZE];
+  const struct numa_placement *placement;
+  if (success) {
+    if (C->server >= 0) {
+      snprintf(buffer, BUFFER_SIZE, "Yes. X is active. Display: %s\n",
+              secondary_server_display(C->card->s, C->server));
+    } else {
+      snprintf(buffer, BUFFER_SIZE, "Yes. X is active.\n");
+    }
+    if (C->plan) {
+      size_t len = strlen(buffer);
+      snprintf(buffer + len, BUFFER_SIZE - len, "VirtualDisplay: %s\n",
+              secondary_server_display(C->card->s,
+              C->server >= 0 ? C->server : 0));
+      len = strlen(buffer);
+      snprintf(buffer + len, BUFFER_SIZE - len, "%s", plan_common());
+      placement = secondary_placement(C->card->s);
+      if (bb_config.numa_policy == NUMA_ALL && placement) {
+        len = strlen(buffer);
+        snprintf(buffer + len, BUFFER_SIZE - len, "LocalCPUs: %s\n"
+                "NumaNode: %i\n", placement->cpulist, placement->node);
+      }
+    }
+    if (C->inuse == 0) {
+      C->inuse = 1;
+      bb_status.appcount++;
+      C->card->appcount++;
+      energy_set_clients(bb_status.appcount);
+      state_changed();
+    }
+  } else {
+    if (bb_status.errors[0] != 0) {
+      snprintf(buffer, BUFFER_SIZE, "No - error: %s\n", bb_status.errors);
+    } else {
+      snprintf(buffer, BUFFER_SIZE, "No, secondary X is not active.\n");
+    }
+  }
+  client_reply(C, C->connect_id, buffer);
+}
+
+/// Called by bbsecondary when a start has progressed, answers all parked
+/// Connect requests for the card or X server that can be answered now.
+
+static void secondary_started(struct secondary *s, int server, bool success) {
+  struct clientsocket *C, *next_iter;
+  for (C = waiting_clients; C; C = next_iter) {
+    next_iter = C->wait_next;
+    if (C->waiting && C->card->s == s && C->server == server) {
+      client_unwait(C);
+      reply_connect(C, success);
+      if (C->sock < 0) {
+        //the write failed, the client is gone
+        client_remove(C - clients);
+      }
+    }
+  }
+}
+
+/// Describe the time spent in each power tier.
+/// \param buffer Receives a text like "off 1.0s, driver 0.0s, X 2.5s", for
+/// each card prefixed by "card N: " if there are several.
+/// \param len The size of buffer.
+
+static void format_residency(char *buffer, size_t len) {
+  long long residency[TIER_COUNT];
+  size_t pos = 0;
+  int i;
+
+  buffer[0] = 0;
+  for (i = 0; i < card_count && pos < len; i++) {
+    secondary_tier_residency(cards[i].s, residency);
+    if (card_count > 1) {
+      pos += snprintf(buffer + pos, len - pos, "%scard %i: ", i ? "; " : "", i);
+      if (pos >= len) {
+        break;
+      }
+    }
+    pos += snprintf(buffer + pos, len - pos, "%s %.1fs, %s %.1fs, %s %.1fs",
+            secondary_tier_name(TIER_OFF), residency[TIER_OFF] / 1000.0,
+            secondary_tier_name(TIER_DRIVER), residency[TIER_DRIVER] / 1000.0,
+            secondary_tier_name(TIER_X), residency[TIER_X] / 1000.0);
+  }
+}
+
+/// Take a snapshot of the state of the daemon for the status page, reading
+/// only what the daemon keeps in memory.
+/// \param state Receives the state.
+
+static void status_snapshot(struct status_state *state) {
+  static pid_t pid; /* the daemon does not fork after main_loop started */
+  int i, j;
+
+  if (!pid) {
+    pid = getpid();
+  }
+  memset(state, 0, sizeof *state);
+  state->pid = pid;
+  state->power = switch_status();
+  state->appcount = bb_status.appcount;
+  state->waiting = waiting_count;
+  state->card_count = card_count;
+  snprintf(state->version, sizeof state->version, "%s", GITVERSION);
+  snprintf(state->error, sizeof state->error, "%s", bb_status.errors);
+  for (i = 0; i < card_count; i++) {
+    struct secondary *s = cards[i].s;
+    struct status_card *card = &state->cards[i];
+    long long residency[TIER_COUNT];
+
+    card->tier = secondary_current_tier(s);
+    card->server_count = secondary_server_count(s);
+    card->appcount = cards[i].appcount;
+    card->starting = secondary_is_starting(s);
+    card->tier_since = secondary_tier_since(s, residency);
+    for (j = 0; j < TIER_COUNT; j++) {
+      card->residency[j] = residency[j];
+    }
+    for (j = 0; j < card->server_count; j++) {
+      struct status_server *x = &card->servers[j];
+      x->state = secondary_server_state(s, j);
+      x->pid = secondary_server_pid(s, j);
+      x->appcount = cards[i].server_load[j];
+      snprintf(x->display, sizeof x->display, "%s",
+              secondary_server_display(s, j));
+    }
+  }
+}
+
+/// Describe the state of the daemon for a Status request, as on the status
+/// page.
+/// \param buffer Receives the description.
+/// \param len The size of buffer.
+
+static void format_status(char *buffer, size_t len) {
+  struct status_state state;
+  status_snapshot(&state);
+  status_page_format(&state, buffer, len);
+}
+
+/// Number of applications using or waiting for a card.
+
+static unsigned int card_load(struct card *card) {
+  return card->appcount + card->waiting;
+}
+
+/// Pick the card for a Connect request. The least loaded card is preferred,
+/// and among those a card with X running or starting.
+/// \param spec A card number, or "any" for the least loaded card.
+/// \return The card or NULL if there is no such card.
+
+static struct card *card_pick(const char *spec) {
+  struct card *best = NULL;
+  int i;
+
+  if (strcmp(spec, "any")) {
+    char *end;
+    long idx = strtol(spec, &end, 10);
+    if (!*spec || *end || idx < 0 || idx >= card_count) {
+      return NULL;
+    }
+    return &cards[idx];
+  }
+  for (i = 0; i < card_count; i++) {
+    struct card *card = &cards[i];
+    bool warm = secondary_current_tier(card->s) == TIER_X ||
+            secondary_is_starting(card->s);
+    if (!best || card_load(card) < card_load(best) ||
+            (card_load(card) == card_load(best) && warm &&
+            secondary_current_tier(best->s) != TIER_X &&
+            !secondary_is_starting(best->s))) {
+      best = card;
+    }
+  }
+  return best;
+}
+
+/// Pick the X server of a card for an application. An X server of its own is
+/// preferred: an idle one that is ready, then one that is starting, then one
+/// that is not running. Once all servers are in use, the application shares
+/// the least loaded one.
+/// \return The index of the X server.
+
+static int pool_pick(struct card *card) {
+  static const int state_rank[] = {
+    [SERVER_READY] = 0,
+    [SERVER_STARTING] = 1,
+    [SERVER_OFF] = 2,
+    [SERVER_STOPPING] = 3,
+  };
+  int i, best = 0, best_rank = -1;
+
+  for (i = 0; i < secondary_server_count(card->s); i++) {
+    int rank = card->server_load[i] * 4 +
+            state_rank[secondary_server_state(card->s, i)];
+    if (best_rank < 0 || rank < best_rank) {
+      best = i;
+      best_rank = rank;
+    }
+  }
+  return best;
+}
+
+/// Whether an X server of a card is running or about to.
+
+static bool pool_server_active(struct card *card, int server) {
+  enum secondary_server_state state = secondary_server_state(card->s, server);
+  return state == SERVER_STARTING || state == SERVER_READY;
+}
+
+/// Grow or shrink the pool of X servers of a card that runs applications.
+/// Besides the X servers in use, one idle server is kept ready such that the
+/// next application does not wait for X, within PoolMin and PoolMax servers.
+/// Cards without applications are stopped as a whole by secondary_idle.
+
+static void pool_balance(struct card *card) {
+  int i, count = secondary_server_count(card->s), busy = 0, size = 0, target;
+
+  for (i = 0; i < count; i++) {
+    if (card->server_load[i]) {
+      busy++;
+    }
+    if (pool_server_active(card, i)) {
+      size++;
+    }
+  }
+  if (busy == 0) {
+    return;
+  }
+  target = busy + 1;
+  if (target < bb_config.pool_min) {
+    target = bb_config.pool_min;
+  }
+  if (target > count) {
+    target = count;
+  }
+  for (i = 0; i < count && size < target; i++) {
+    if (!pool_server_active(card, i)) {
+      bb_log(LOG_DEBUG, "Starting spare X server on display %s\n",
+              secondary_server_display(card->s, i));
+      secondary_start(card->s, i);
+      size++;
+    }
+  }
+  for (i = count; i-- > 0 && size > target;) {
+    if (pool_server_active(card, i) && !card->server_load[i]) {
+      secondary_stop_server(card->s, i);
+      size--;
+    }
+  }
+}
+
+/// Find out the user and command name of the application behind a client,
+/// used for the usage history.
+
+static void client_identify(struct clientsocket * C) {
+  struct ucred cred;
+  socklen_t len = sizeof cred;
+  char path[64];
+  int fd;
+  ssize_t r;
+
+  C->uid = (uid_t) -1;
+  strcpy(C->comm, "unknown");
+  if (getsockopt(C->sock, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+    return;
+  }
+  C->uid = cred.uid;
+  snprintf(path, sizeof path, "/proc/%i/comm", (int) cred.pid);
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  r = read(fd, C->comm, sizeof C->comm - 1);
+  close(fd);
   if (r > 0) {
-    ensureZeroTerminated(buffer, r, BUFFER_SIZE);
-    conf_key = strchr(buffer, ' ');
-    switch (buffer[0]) {
-      case 'S'://status
-        if (bb_status.errors[0] != 0) {
-          r = snprintf(buffer, BUFFER_SIZE, "Error (%s): %s\n", GITVERSION, bb_status.errors);
-        } else {
-          if (bb_is_running(bb_status.x_pid)) {
-            r = snprintf(buffer, BUFFER_SIZE, "Ready (%s). X is PID %i, %i applications using bumblebeed.\n", GITVERSION, bb_status.x_pid, bb_status.appcount);
-          } else {
-            char *card_status;
-            switch (switch_status()) {
-              case SWITCH_OFF:
-                card_status = "off";
-                break;
-              case SWITCH_ON:
-                card_status = "on";
-                break;
-              default:
-                /* no PM available, assume it's on */
-                card_status = "likely on";
-                break;
-            }
-            r = snprintf(buffer, BUFFER_SIZE, "Ready (%s). X inactive. Discrete"
-                    " video card is %s.\n", GITVERSION, card_status);
-          }
-        }
-        /* don't rely on result of snprintf, instead calculate length including
-         * null byte. We assume a succesful write */
-        socketWrite(&C->sock, buffer, strlen(buffer) + 1);
+    C->comm[r] = 0;
+    C->comm[strcspn(C->comm, "\n")] = 0;
+  }
+}
+
+/// Describe the counters of speculative starts.
+/// \param buffer Receives the description.
+/// \param len The size of buffer.
+
+static void format_prewarm(char *buffer, size_t len) {
+  unsigned int ended = prewarm.hits + prewarm.misses;
+  snprintf(buffer, len, "%u pre-warms, %u hits, %u misses, hit rate %u%%,"
+          " %.1fs start latency avoided, %.1fs warm time wasted",
+          prewarm.prewarms, prewarm.hits, prewarm.misses,
+          ended ? prewarm.hits * 100 / ended : 0, prewarm.saved / 1000.0,
+          prewarm.wasted / 1000.0);
+}
+
+/// Describe the hysteresis against power cycling the card.
+/// \param buffer Receives the description.
+/// \param len The size of buffer.
+
+static void format_hysteresis(char *buffer, size_t len) {
+  struct switch_hysteresis stats;
+  switch_hysteresis_stats(&stats);
+  snprintf(buffer, len, "cycle cost %.1fs, minimum on %.1fs, minimum off"
+          " %.1fs, %u power cycles, %u thrashes, %u cycles suppressed, %.1fs"
+          " saved", stats.cycle_cost / 1000.0, stats.on_dwell / 1000.0,
+          stats.off_dwell / 1000.0, stats.cycles, stats.thrashes,
+          stats.suppressed, stats.saved / 1000.0);
+}
+
+/// Describe the teardowns of the cards cancelled by a start.
+/// \param buffer Receives the description.
+/// \param len The size of buffer.
+
+static void format_teardown(char *buffer, size_t len) {
+  struct secondary_teardowns stats;
+  secondary_teardown_stats(&stats);
+  snprintf(buffer, len, "%u teardowns, %u cancelled, %.1fs start latency"
+          " saved", stats.teardowns, stats.cancelled, stats.saved / 1000.0);
+}
+
+/// Send an event to a subscriber without blocking. Events are queued while
+/// the socket is full and dropped once the queue is full as well, such that
+/// a slow subscriber cannot stall the daemon.
+/// \param text The event.
+
+static void subscriber_send(struct clientsocket * C, const char *text) {
+  char msg[BB_FRAME_HEADER + BB_FRAME_MAX];
+  size_t len = strlen(text);
+
+  if (C->v2) {
+    len = frameBuild(msg, sizeof msg, C->subscribe_id, text,
+            len < BB_FRAME_MAX ? len : BB_FRAME_MAX);
+  } else {
+    len = snprintf(msg, BUFFER_SIZE, "%s", text) + 1;
+  }
+  client_send(C, msg, len);
+}
+
+/// Send the queued messages of a client once its socket can take them.
+
+static void subscriber_flush(struct clientsocket * C) {
+  char text[64];
+  int r;
+
+  if (!C->queue) {
+    return;
+  }
+  r = socketWrite(&C->sock, C->queue->data, C->queue->len);
+  if (C->sock < 0) {
+    return;
+  }
+  C->queue->len -= r;
+  memmove(C->queue->data, C->queue->data + r, C->queue->len);
+  if (C->queue->len == 0 && C->queue->lost) {
+    /* tell the subscriber to read the full state again */
+    snprintf(text, sizeof text, "lost %u\n", C->queue->lost);
+    C->queue->lost = 0;
+    bb_event_mod(C->sock, EPOLLIN);
+    subscriber_send(C, text);
+  } else if (C->queue->len == 0) {
+    bb_event_mod(C->sock, EPOLLIN);
+  }
+}
+
+/// Send the events that lead from one state of the daemon to another.
+/// \param old The previous state.
+/// \param new The current state.
+/// \param only The subscriber that receives the events, or NULL for all.
+
+static void events_send(const struct status_state *old,
+        const struct status_state *new, struct clientsocket * only) {
+  static const char *power_names[] = {"unknown", "off", "on"};
+  char events[BUFFER_SIZE * 2], *event;
+  size_t pos = 0;
+  int i, j;
+
+  events[0] = 0;
+  if (new->power != old->power) {
+    pos += snprintf(events + pos, sizeof events - pos, "power %s\n",
+            power_names[new->power + 1]);
+  }
+  for (i = 0; i < new->card_count; i++) {
+    const struct status_card *o = &old->cards[i], *n = &new->cards[i];
+    if (n->tier != o->tier) {
+      pos += snprintf(events + pos, sizeof events - pos, "tier %i %s\n", i,
+              secondary_tier_name(n->tier));
+    }
+    for (j = 0; j < n->server_count && pos < sizeof events; j++) {
+      const struct status_server *ox = &o->servers[j], *nx = &n->servers[j];
+      const char *what = NULL;
+      if (nx->state == ox->state) {
+        continue;
+      }
+      switch (nx->state) {
+        case SERVER_STARTING:
+          what = "starting";
+          break;
+        case SERVER_READY:
+          what = "started";
+          break;
+        case SERVER_STOPPING:
+          what = "stopping";
+          break;
+        default:
+          what = ox->state == SERVER_STARTING ? "failed" : "stopped";
+          break;
+      }
+      pos += snprintf(events + pos, sizeof events - pos, "x %i %s %s %i\n",
+              i, nx->display, what, nx->pid);
+    }
+  }
+  if (new->appcount != old->appcount && pos < sizeof events) {
+    pos += snprintf(events + pos, sizeof events - pos, "apps %u\n",
+            new->appcount);
+  }
+  if (strcmp(new->error, old->error) && pos < sizeof events) {
+    pos += snprintf(events + pos, sizeof events - pos, "error %s\n",
+            new->error);
+  }
+  if (pos >= sizeof events) {
+    /* cut after the last complete event */
+    events[sizeof events - 1] = 0;
+    event = strrchr(events, '\n');
+    *(event ? event + 1 : events) = 0;
+  }
+  /* every event is a message of its own */
+  for (event = events; *event; event = strchr(event, '\n') + 1) {
+    char text[BUFFER_SIZE];
+    size_t len = strchr(event, '\n') - event + 1;
+    struct clientsocket *C, *next_iter;
+    snprintf(text, sizeof text, "%.*s", (int) len, event);
+    for (C = only ? only : subscribers; C; C = next_iter) {
+      next_iter = only ? NULL : C->sub_next;
+      if (C->sock >= 0) {
+        subscriber_send(C, text);
+      }
+    }
+  }
+}
+
+/// Send the changes of the state of the daemon to the subscribers and the
+/// status page. Called after an event that changed the state, see
+/// state_changed.
+
+static void state_publish(void) {
+  struct status_state state;
+  struct clientsocket *C, *next_iter;
+
+  unpublished = false;
+  status_snapshot(&state);
+  if (!memcmp(&state, &published, sizeof state)) {
+    return;
+  }
+  events_send(&published, &state, NULL);
+  status_page_publish(&state);
+  published = state;
+  for (C = subscribers; C; C = next_iter) {
+    next_iter = C->sub_next;
+    if (C->sock < 0) {
+      //the write failed, the subscriber is gone
+      client_remove(C - clients);
+    }
+  }
+}
+
+/// Make a client receive events. It first gets the events that lead from an
+/// idle daemon without cards to the current state.
+/// \param id The request ID of the Subscribe request.
+
+static void client_subscribe(struct clientsocket * C, uint32_t id) {
+  static const struct status_state idle;
+  if (C->subscribed) {
+    return;
+  }
+  C->subscribed = true;
+  C->subscribe_id = id;
+  C->sub_prev = 0;
+  C->sub_next = subscribers;
+  if (subscribers) {
+    subscribers->sub_prev = C;
+  }
+  subscribers = C;
+  client_reply(C, id, "Subscribed.\n");
+  events_send(&idle, &published, C);
+}
+
+/// Stop sending events to a client, if it receives them.
+
+static void client_unsubscribe(struct clientsocket * C) {
+  if (!C->subscribed) {
+    return;
+  }
+  if (C->sub_next) {
+    C->sub_next->sub_prev = C->sub_prev;
+  }
+  if (C->sub_prev) {
+    C->sub_prev->sub_next = C->sub_next;
+  } else {
+    subscribers = C->sub_next;
+  }
+  C->subscribed = false;
+  C->sub_prev = C->sub_next = 0;
+  free(C->queue);
+  C->queue = NULL;
+}
+
+/// Match the Protocol key of a Query request.
+/// \param key The requested key, "Protocol" or "Protocol" and a version.
+/// \param version Receives the requested version, 0 if there is none.
+/// \return Whether the key is the Protocol key.
+
+static bool protocol_key(const char *key, long *version) {
+  char *end;
+
+  *version = 0;
+  if (strcmp(key, "Protocol") == 0) {
+    return true;
+  }
+  if (strncmp(key, "Protocol ", 9) || !key[9]) {
+    return false;
+  }
+  *version = strtol(key + 9, &end, 10);
+  return !*end;
+}
+
+/// Handle a single request of a client.
+/// \param id The request ID in protocol v2, 0 in the legacy protocol.
+/// \param msg The request, null-terminated. It is modified while parsing.
+
+static void handle_request(struct clientsocket * C, uint32_t id, char *msg) {
+  char buffer[BUFFER_SIZE], *conf_key, *token, *saveptr;
+  bool need_secondary, upgrade = false;
+  struct card *card;
+  long version;
+
+  conf_key = strchr(msg, ' ');
+  switch (msg[0]) {
+    case 'S'://status
+      if (strcmp(msg, "Subscribe") == 0) {
+        /* the connection receives events from now on */
+        client_subscribe(C, id);
         break;
-      case 'F'://force VirtualGL if possible
-      case 'C'://check if VirtualGL is allowed
-        need_secondary = conf_key ? strcmp(conf_key + 1, "NoX") : true;
-        if (start_secondary(need_secondary)) {
-          r = snprintf(buffer, BUFFER_SIZE, "Yes. X is active.\n");
-          if (C->inuse == 0) {
-            C->inuse = 1;
-            bb_status.appcount++;
-          }
-        } else {
-          if (bb_status.errors[0] != 0) {
-            r = snprintf(buffer, BUFFER_SIZE, "No - error: %s\n", bb_status.errors);
-          } else {
-            r = snprintf(buffer, BUFFER_SIZE, "No, secondary X is not active.\n");
-          }
+      }
+      if (bb_status.errors[0] != 0) {
+        snprintf(buffer, BUFFER_SIZE, "Error (%s): %s\n", GITVERSION, bb_status.errors);
+      } else {
+        format_status(buffer, BUFFER_SIZE);
+      }
+      client_reply(C, id, buffer);
+      break;
+    case 'P'://Connect and send everything needed to run the application
+    case 'F'://force VirtualGL if possible
+    case 'C'://check if VirtualGL is allowed
+      /* arguments: NoX if X is not needed, Card=N or Card=any to choose
+       * the card. Clients that do not choose get the first card. Each
+       * client that needs X gets an X server of the card's pool. */
+      C->plan = msg[0] == 'P';
+      need_secondary = true;
+      card = &cards[0];
+      token = conf_key ? strtok_r(conf_key + 1, " ", &saveptr) : NULL;
+      for (; token; token = strtok_r(NULL, " ", &saveptr)) {
+        if (strcmp(token, "NoX") == 0) {
+          need_secondary = false;
+        } else if (strncmp(token, "Card=", 5) == 0) {
+          card = card_pick(token + 5);
         }
-        /* don't rely on result of snprintf, instead calculate length including
-         * null byte. We assume a succesful write */
-        socketWrite(&C->sock, buffer, strlen(buffer) + 1);
-        break;
-      case 'D'://done, close the socket.
-        socketClose(&C->sock);
+      }
+      if (C->inuse || C->waiting) {
+        /* an application does not move between cards */
+        card = C->card;
+      }
+      if (!card) {
+        client_reply(C, id, "No - error: There is no such discrete video"
+                " card.\n");
         break;
-      case 'Q': /* query for configuration details */
-        /* required since labels can only be attached on statements */;
-        if (conf_key) {
-          conf_key++;
-          if (strcmp(conf_key, "VirtualDisplay") == 0) {
-            snprintf(buffer, BUFFER_SIZE, "Value: %s\n", bb_config.x_display);
-          } else if (strcmp(conf_key, "LibraryPath") == 0) {
-            snprintf(buffer, BUFFER_SIZE, "Value: %s\n", bb_config.ld_path);
-          } else if (strcmp(conf_key, "Driver") == 0) {
-            /* note: this is not the auto-detected value, but the actual one */
-            snprintf(buffer, BUFFER_SIZE, "Value: %s\n", bb_config.driver);
-          } else {
-            snprintf(buffer, BUFFER_SIZE, "Unknown key requested.\n");
-          }
+      }
+      C->card = card;
+      C->connect_id = id;
+      if (need_secondary && C->server < 0) {
+        C->server = pool_pick(card);
+        card->server_load[C->server]++;
+      }
+      /* keep the lingering X server or driver for this client */
+      bb_timer_stop(&card->linger_timer);
+      bb_timer_stop(&card->standby_timer);
+      prewarm_hit(card);
+      if (C->inuse == 0 && !C->waiting) {
+        client_identify(C);
+        history_record(HISTORY_CONNECT, C->uid, C->comm);
+      }
+      /* the reply is sent by secondary_started, possibly right away */
+      client_wait(C);
+      secondary_start(card->s, C->server);
+      pool_balance(card);
+      break;
+    case 'D'://done, close the socket.
+      socketClose(&C->sock);
+      break;
+    case 'Q': /* query for configuration details */
+      /* required since labels can only be attached on statements */;
+      if (conf_key) {
+        conf_key++;
+        if (strcmp(conf_key, "VirtualDisplay") == 0) {
+          /* the display of the card for clients that do not choose one */
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n",
+                  secondary_server_display(cards[0].s, 0));
+        } else if (strcmp(conf_key, "LibraryPath") == 0) {
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", bb_config.ld_path);
+        } else if (strcmp(conf_key, "Driver") == 0) {
+          /* note: this is not the auto-detected value, but the actual one */
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", bb_config.driver);
+        } else if (strcmp(conf_key, "Prewarm") == 0) {
+          char counters[BUFFER_SIZE - sizeof "Value: \n"];
+          format_prewarm(counters, sizeof counters);
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", counters);
+        } else if (strcmp(conf_key, "Hysteresis") == 0) {
+          char counters[BUFFER_SIZE - sizeof "Value: \n"];
+          format_hysteresis(counters, sizeof counters);
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", counters);
+        } else if (strcmp(conf_key, "Teardown") == 0) {
+          char counters[BUFFER_SIZE - sizeof "Value: \n"];
+          format_teardown(counters, sizeof counters);
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", counters);
+        } else if (strcmp(conf_key, "Energy") == 0) {
+          char counters[BUFFER_SIZE - sizeof "Value: \n"];
+          energy_format(counters, sizeof counters);
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", counters);
+        } else if (strcmp(conf_key, "Residency") == 0) {
+          char residency[BUFFER_SIZE - sizeof "Value: \n"];
+          format_residency(residency, sizeof residency);
+          snprintf(buffer, BUFFER_SIZE, "Value: %s\n", residency);
+        } else if (protocol_key(conf_key, &version)) {
+          /* "Protocol 2" switches to protocol v2 after this reply */
+          snprintf(buffer, BUFFER_SIZE, "Value: %i\n", BB_PROTOCOL_VERSION);
+          upgrade = version == BB_PROTOCOL_VERSION;
         } else {
-          snprintf(buffer, BUFFER_SIZE, "Error: invalid protocol message.\n");
+          snprintf(buffer, BUFFER_SIZE, "Unknown key requested.\n");
         }
-        socketWrite(&C->sock, buffer, strlen(buffer) + 1);
-        break;
-      default:
-        bb_log(LOG_WARNING, "Unhandled message received: %s\n", buffer);
-        break;
+      } else {
+        snprintf(buffer, BUFFER_SIZE, "Error: invalid protocol message.\n");
+      }
+      client_reply(C, id, buffer);
+      if (upgrade && !C->v2) {
+        bb_log(LOG_DEBUG, "Client switched to protocol v%i\n",
+                BB_PROTOCOL_VERSION);
+        C->v2 = true;
+      }
+      break;
+    default:
+      bb_log(LOG_WARNING, "Unhandled message received: %s\n", msg);
+      if (C->v2) {
+        /* pipelining clients wait for a reply to every request */
+        client_reply(C, id, "Error: invalid protocol message.\n");
+      }
+      break;
+  }
+}
+
+/// Handle the first legacy message in received data. Messages end with a null
+/// byte or a newline.
+/// \param data The received data, the message is modified while parsing.
+/// \param len The number of bytes in data.
+/// \return The length of the message, 0 if it is incomplete.
+
+static size_t handle_message(struct clientsocket * C, char *data, size_t len) {
+  size_t n;
+  for (n = 0; n < len && data[n] != '\0' && data[n] != '\n'; n++);
+  if (n == len) {
+    return 0;
+  }
+  data[n] = 0;
+  handle_request(C, 0, data);
+  return n + 1;
+}
+
+/// Handle the first protocol v2 frame in received data.
+/// \param data The received data.
+/// \param len The number of bytes in data.
+/// \return The length of the frame, 0 if it is incomplete.
+
+static size_t handle_frame(struct clientsocket * C, char *data, size_t len) {
+  char msg[BUFFER_SIZE];
+  const char *payload;
+  size_t n, payload_len;
+  uint32_t id;
+
+  n = frameParse(data, len, &id, &payload, &payload_len);
+  if (n == (size_t) -1) {
+    bb_log(LOG_WARNING, "Frame too long, closing connection\n");
+    socketClose(&C->sock);
+    return len;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  memcpy(msg, payload, payload_len);
+  msg[payload_len] = 0;
+  handle_request(C, id, msg);
+  return n;
+}
+
+/// Receive and/or sent data to/from this socket. All complete messages are
+/// handled in order, the remainder of a message that is split over several
+/// reads is kept in a buffer of the client until the rest arrives.
+/// \param sock Pointer to socket. Assumed to be valid.
+
+static void handle_socket(struct clientsocket * C) {
+  /* most requests arrive whole, only a partial one needs a buffer per client */
+  static char scratch[CLIENT_INPUT_SIZE];
+  char *data = C->input ? C->input->data : scratch;
+  size_t len = C->input ? C->input->len : 0, used = 0, n;
+  int r = socketRead(&C->sock, data + len, CLIENT_INPUT_SIZE - len);
+  if (r <= 0) {
+    return;
+  }
+  len += r;
+  while (used < len && C->sock >= 0) {
+    /* the protocol can change after a message */
+    if (C->v2) {
+      n = handle_frame(C, data + used, len - used);
+    } else {
+      n = handle_message(C, data + used, len - used);
+    }
+    if (n == 0) {
+      break;
+    }
+    used += n;
+  }
+  if (C->sock < 0) {
+    return;
+  }
+  if (used == 0 && len == CLIENT_INPUT_SIZE) {
+    bb_log(LOG_WARNING, "Message too long, closing connection\n");
+    socketClose(&C->sock);
+    return;
+  }
+  if (!C->input && used < len) {
+    C->input = malloc(sizeof *C->input);
+    if (!C->input) {
+      bb_log(LOG_WARNING, "Could not allocate input buffer\n");
+      socketClose(&C->sock);
+      return;
+    }
+  }
+  if (C->input) {
+    memmove(C->input->data, data + used, len - used);
+    C->input->len = len - used;
+  }
+}
+
+/// Timer handler for the standby period, powers off the card if it has not
+/// been used again in the meantime.
+
+static void standby_expired(void *data) {
+  struct card *card = data;
+  if (card_load(card) == 0) {
+    bb_log(LOG_INFO, "Card %i in standby for %i seconds, powering it off\n",
+            secondary_index(card->s), bb_config.standby_timeout);
+    secondary_stop(card->s, TIER_OFF);
+  }
+}
+
+/// Move an unused card to a cheaper tier. If StandbyTimeout is set, only X is
+/// stopped and the card is powered off after that many seconds.
+
+static void secondary_idle(struct card *card) {
+  if (bb_config.standby_timeout > 0) {
+    secondary_stop(card->s, TIER_DRIVER);
+    bb_timer_start(&card->standby_timer, bb_config.standby_timeout * 1000,
+            standby_expired, card);
+  } else {
+    secondary_stop(card->s, TIER_OFF);
+  }
+}
+
+/// Timer handler for the linger period, stops the card if it has not been
+/// used again in the meantime.
+
+static void linger_expired(void *data) {
+  struct card *card = data;
+  if (card_load(card) == 0) {
+    bb_log(LOG_INFO, "Card %i unused for %i seconds, stopping it\n",
+            secondary_index(card->s), bb_config.linger_timeout);
+    secondary_idle(card);
+  }
+}
+
+/// Whether speculative starts are allowed now. The warm time that was not used
+/// is limited by PrewarmBudget seconds per day.
+
+static bool prewarm_allowed(void) {
+  time_t day = time(NULL) / 86400;
+  if (bb_config.prewarm_budget <= 0 || !bb_config.stop_on_exit) {
+    return false;
+  }
+  if (day != prewarm.day) {
+    prewarm.day = day;
+    prewarm.wasted_today = 0;
+  }
+  return prewarm.wasted_today < bb_config.prewarm_budget * 1000LL;
+}
+
+/// Timer handler for the end of a warm period without any application.
+
+static void prewarm_expired(void *data) {
+  long long wasted = bb_event_now() - prewarm.since;
+  (void) data; /* unused parameter */
+  if (!prewarm.active) {
+    return;
+  }
+  prewarm.active = false;
+  prewarm.misses++;
+  prewarm.wasted += wasted;
+  prewarm.wasted_today += wasted;
+  bb_log(LOG_INFO, "Predicted application did not show up, %.1f seconds of"
+          " warm time wasted\n", wasted / 1000.0);
+  if (card_load(prewarm.card) == 0) {
+    secondary_idle(prewarm.card);
+  }
+}
+
+/// Keep a card warm for an application that is expected to connect.
+/// \param card The card that is kept warm.
+/// \param reason The kind of prediction, for logging.
+
+static void prewarm_begin(struct card *card, const char *reason) {
+  bb_log(LOG_INFO, "Pre-warming card %i for a predicted application (%s)\n",
+          secondary_index(card->s), reason);
+  bb_timer_stop(&card->linger_timer);
+  bb_timer_stop(&card->standby_timer);
+  prewarm.active = true;
+  prewarm.card = card;
+  prewarm.since = bb_event_now();
+  prewarm.prewarms++;
+  bb_timer_start(&prewarm.hold, 2 * bb_config.prewarm_lead * 1000,
+          prewarm_expired, NULL);
+}
+
+/// Called on Connect, counts a warm period that was used.
+/// \param card The card the application connected to.
+
+static void prewarm_hit(struct card *card) {
+  if (!prewarm.active || card != prewarm.card) {
+    return;
+  }
+  prewarm.active = false;
+  bb_timer_stop(&prewarm.hold);
+  prewarm.hits++;
+  prewarm.saved += secondary_cold_start_cost(card->s);
+  bb_log(LOG_DEBUG, "Pre-warmed card used after %.1f seconds\n",
+          (bb_event_now() - prewarm.since) / 1000.0);
+}
+
+/// Timer handler that starts a card if an application is expected to connect
+/// soon, based on the daily usage pattern.
+
+static void prewarm_check(void *data) {
+  struct card *card = card_pick("any");
+  (void) data; /* unused parameter */
+  bb_timer_start(&prewarm.check, 60000, prewarm_check, NULL);
+  if (bb_status.appcount || waiting_count || prewarm.active ||
+          secondary_is_starting(card->s) ||
+          secondary_current_tier(card->s) == TIER_X || !prewarm_allowed() ||
+          switch_hold_off() > 0) {
+    /* switch_hold_off: a card that was powered off just now stays off */
+    return;
+  }
+  if (history_predict_daily(time(NULL), bb_config.prewarm_lead)) {
+    prewarm_begin(card, "daily");
+    secondary_start(card->s, pool_pick(card));
+  }
+}
+
+/// Drop a client whose socket has been closed, stopping X if it was the last
+/// client that used it. If LingerTimeout is set, X is stopped after that many
+/// seconds unless a new client connects.
+/// \param fd The file descriptor the client was connected on.
+
+static void client_remove(int fd) {
+  struct clientsocket *C = &clients[fd];
+  struct card *card = C->card;
+  bool was_user = C->inuse > 0 || C->waiting;
+  bb_event_remove(fd);
+  client_unwait(C);
+  if (C->inuse > 0) {
+    C->inuse = 0;
+    bb_status.appcount--;
+    card->appcount--;
+    energy_set_clients(bb_status.appcount);
+  }
+  if (C->server >= 0) {
+    card->server_load[C->server]--;
+    C->server = -1;
+  }
+  free(C->input);
+  C->input = NULL;
+  client_unsubscribe(C);
+  if (was_user) {
+    history_record(HISTORY_DISCONNECT, C->uid, C->comm);
+    state_changed();
+  }
+  //stop X / card if there is no need to keep it running
+  if (was_user && card_load(card) == 0 && (bb_config.stop_on_exit)) {
+    if (!prewarm.active && prewarm_allowed() &&
+            history_predict_followup(C->uid, C->comm, bb_config.prewarm_lead)) {
+      prewarm_begin(card, "follow-up");
+    } else if (bb_config.linger_timeout > 0) {
+      bb_log(LOG_DEBUG, "Keeping card %i for %i seconds\n",
+              secondary_index(card->s), bb_config.linger_timeout);
+      bb_timer_start(&card->linger_timer, bb_config.linger_timeout * 1000,
+              linger_expired, card);
+    } else {
+      secondary_idle(card);
+    }
+  } else if (was_user) {
+    /* drop the X server of this client if enough others are idle */
+    pool_balance(card);
+  }
+}
+
+/// Event handler for client sockets.
+
+static void client_event(int fd, unsigned int events, void *data) {
+  struct clientsocket *C = data;
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    handle_socket(C);
+  }
+  if (events & EPOLLOUT) {
+    subscriber_flush(C);
+  }
+  if (C->sock < 0) {
+    client_remove(fd);
+  }
+}
+
+/// Event handler for the listening socket. Accepts all pending connections at
+/// once instead of a single one per wakeup.
+
+static void accept_clients(int fd, unsigned int events, void *data) {
+  int optirun_socket_fd;
+  (void) events; /* unused parameter */
+  (void) data; /* unused parameter */
+
+  while ((optirun_socket_fd = socketAccept(&bb_status.bb_socket, SOCK_NOBLOCK)) >= 0) {
+    struct clientsocket *C = &clients[optirun_socket_fd];
+    bb_log(LOG_DEBUG, "Accepted new connection\n");
+    C->sock = optirun_socket_fd;
+    C->inuse = 0;
+    C->v2 = false;
+    C->plan = false;
+    C->card = NULL;
+    C->server = -1;
+    if (bb_event_add(optirun_socket_fd, EPOLLIN, client_event, C)) {
+      socketClose(&C->sock);
     }
   }
+  if (bb_status.bb_socket == -1) {
+    //accept failed fatally and closed the server socket
+    bb_event_remove(fd);
+  }
 }
 
 /* The main loop handles all connections and cleanup.
  * It returns if there are any problems with the listening socket.
  */
 static void main_loop(void) {
-  int optirun_socket_fd;
-  struct clientsocket *client;
-  struct clientsocket *last = 0; // the last client
+  int fd, max_fds = bb_event_max_fds();
 
+  /* one slot for every possible descriptor, no allocations per connection */
+  clients = calloc(max_fds, sizeof *clients);
+  if (!clients) {
+    bb_log(LOG_ERR, "Could not allocate client table\n");
+    return;
+  }
+  for (fd = 0; fd < max_fds; fd++) {
+    clients[fd].sock = -1;
+    clients[fd].server = -1;
+  }
+
+  if (bb_event_add(bb_status.bb_socket, EPOLLIN, accept_clients, NULL)) {
+    free(clients);
+    clients = NULL;
+    return;
+  }
+
+  status_page_open(bb_config.status_file);
+  switch_cache_start(power_changed, NULL);
   bb_log(LOG_INFO, "Initialization completed - now handling client requests\n");
+  systemd_notify("READY=1\nSTATUS=Handling client requests");
+  systemd_watchdog_start();
   /* Listen for Optirun conections and act accordingly */
   while (bb_status.bb_socket != -1) {
-    fd_set readfds;
-    int max_fd = 0;
-
-    FD_ZERO(&readfds);
-#define FD_SET_AND_MAX(fd)                   \
-    do if ((fd) >= 0 && (fd) < FD_SETSIZE) { \
-      FD_SET((fd), &readfds);                \
-      if (max_fd < (fd))                     \
-        max_fd = (fd);                       \
-    } while (0)
-    FD_SET_AND_MAX(bb_status.bb_socket);
-    FD_SET_AND_MAX(bb_status.x_pipe[0]);
-    for (client = last; client; client = client->prev)
-      FD_SET_AND_MAX(client->sock);
-#undef FD_SET_AND_MAX
-
-    if (select(max_fd + 1, &readfds, NULL, NULL, NULL) < 0) {
-      if (errno == EINTR)
-        continue;
-      bb_log(LOG_ERR, "select() failed: %s\n", strerror(errno));
-      break;
+    /* publish the changes made while handling the last event, if any */
+    if (unpublished) {
+      state_publish();
     }
-
-#define FD_EVENT(fd) ((fd) >= 0 && FD_ISSET((fd), &readfds))
-    if (FD_EVENT(bb_status.bb_socket)) {
-      /* Accept a connection. */
-      optirun_socket_fd = socketAccept(&bb_status.bb_socket, SOCK_NOBLOCK);
-      if (optirun_socket_fd >= 0) {
-        bb_log(LOG_DEBUG, "Accepted new connection\n", optirun_socket_fd, bb_status.appcount);
-
-        /* add to list of sockets */
-        client = malloc(sizeof (struct clientsocket));
-        client->sock = optirun_socket_fd;
-        client->inuse = 0;
-        client->prev = last;
-        client->next = 0;
-        if (last) {
-          last->next = client;
-        }
-        last = client;
-      }
-    }
-
-    //check the X output pipe, if open
-    if (FD_EVENT(bb_status.x_pipe[0]))
-      check_xorg_pipe();
-
-    /* loop through all connections, removing dead ones, receiving/sending data to the rest */
-    struct clientsocket *next_iter;
-    for (client = last; client; client = next_iter) {
-      /* set the next client here because client may be free()'d */
-      next_iter = client->prev;
-      if (FD_EVENT(client->sock))
-        handle_socket(client);
-      if (client->sock < 0) {
-        //remove from list
-        if (client->inuse > 0) {
-          bb_status.appcount--;
-          //stop X / card if there is no need to keep it running
-          if ((bb_status.appcount == 0) && (bb_config.stop_on_exit)) {
-            stop_secondary();
-          }
-        }
-        if (client->next) {
-          client->next->prev = client->prev;
-        } else {
-          last = client->prev;
-        }
-        if (client->prev) {
-          client->prev->next = client->next;
-        }
-        free(client);
-      }
+    if (bb_event_dispatch(-1) < 0) {
+      break;
     }
-#undef FD_EVENT
   }//socket server loop
+  switch_cache_stop();
+  status_page_close();
+  systemd_watchdog_stop();
+  systemd_notify("STOPPING=1");
 
   /* loop through all connections, closing all of them */
-  client = last;
-  while (client) {
-    //close socket if not already closed
-    if (client->sock >= 0) {
-      socketClose(&client->sock);
+  for (fd = 0; fd < max_fds; fd++) {
+    if (clients[fd].sock >= 0) {
+      socketClose(&clients[fd].sock);
+      bb_event_remove(fd);
     }
+    client_unwait(&clients[fd]);
     //remove from list
-    if (client->inuse > 0) {
+    if (clients[fd].inuse > 0) {
       bb_status.appcount--;
+      clients[fd].card->appcount--;
+      energy_set_clients(bb_status.appcount);
     }
-    // change the client here because after free() there is no way to know prev
-    last = client;
-    client = client->prev;
-    free(last);
+    if (clients[fd].server >= 0) {
+      clients[fd].card->server_load[clients[fd].server]--;
+    }
+    free(clients[fd].input);
+    client_unsubscribe(&clients[fd]);
   }
+  free(clients);
+  clients = NULL;
   if (bb_status.appcount != 0) {
     bb_log(LOG_WARNING, "appcount = %i (should be 0)\n", bb_status.appcount);
   }
 }
 
+/// Determine the display of an X server from VirtualDisplay, a comma-separated
+/// list of displays that are handed out to the X servers of all cards in
+/// order. X servers without an entry use the displays that follow the last
+/// entry, e.g. :8 is followed by :9.
+/// \param buffer Receives the display.
+/// \param len The size of buffer.
+/// \param idx The index of the X server, counting over all cards.
+
+static void card_display(char *buffer, size_t len, int idx) {
+  const char *entry = bb_config.x_display, *comma;
+  char *colon;
+  int i, number;
+
+  for (i = 0; i < idx && (comma = strchr(entry, ',')); i++) {
+    entry = comma + 1;
+  }
+  snprintf(buffer, len, "%.*s", (int) strcspn(entry, ","), entry);
+  colon = strrchr(buffer, ':');
+  if (i < idx && colon && sscanf(colon + 1, "%i", &number) == 1) {
+    snprintf(colon + 1, len - (colon + 1 - buffer), "%i", number + idx - i);
+  }
+}
+
 /**
  * Returns the option string for this program
  * @return An option string which can be used for getopt
@@ -438,6 +1545,10 @@ int bbconfig_parse_options(int opt, char *value) {
 }
 
 int main(int argc, char* argv[]) {
+  char residency[BUFFER_SIZE];
+  char counters[BUFFER_SIZE];
+  struct pci_bus_id *discrete[SECONDARY_MAX];
+  int discrete_count = 0, igd_nvidia_idx = -1, idx, listen_fd;
 #ifdef WITH_PIDFILE
   struct pidfh *pfh = NULL;
   pid_t otherpid;
@@ -461,6 +1572,10 @@ int main(int argc, char* argv[]) {
   init_config();
   bbconfig_parse_opts(argc, argv, PARSE_STAGE_PRECONF);
 
+  /* With socket activation, clients can connect already and are accepted once
+   * the initialization below has completed */
+  listen_fd = systemd_listen_fd();
+
   /* First look for an intel card */
   struct pci_bus_id *pci_id_igd = pci_find_gfx_by_vendor(PCI_VENDOR_ID_INTEL, 0);
   if (!pci_id_igd) {
@@ -468,6 +1583,7 @@ int main(int argc, char* argv[]) {
        dual-nvidia configuration. Let us test that.
     */
     pci_id_igd = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 1);
+    igd_nvidia_idx = 1;
     bb_log(LOG_INFO, "No Intel video card found, testing for dual-nvidia system.\n");
 
     if (!pci_id_igd) {
@@ -477,13 +1593,24 @@ int main(int argc, char* argv[]) {
       return (EXIT_FAILURE);
     }
   }
-  pci_bus_id_discrete = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 0);
-  if (!pci_bus_id_discrete) {
+  /* every other nvidia card is a discrete card */
+  for (idx = 0; discrete_count < SECONDARY_MAX; idx++) {
+    struct pci_bus_id *bus_id = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, idx);
+    if (!bus_id) {
+      break;
+    }
+    if (idx == igd_nvidia_idx) {
+      free(bus_id);
+      continue;
+    }
+    bb_log(LOG_DEBUG, "Found card: %02x:%02x.%x (discrete)\n", bus_id->bus, bus_id->slot, bus_id->func);
+    discrete[discrete_count++] = bus_id;
+  }
+  if (!discrete_count) {
     bb_log(LOG_ERR, "No discrete video card found, quitting\n");
     return (EXIT_FAILURE);
   }
 
-  bb_log(LOG_DEBUG, "Found card: %02x:%02x.%x (discrete)\n", pci_bus_id_discrete->bus, pci_bus_id_discrete->slot, pci_bus_id_discrete->func);
   bb_log(LOG_DEBUG, "Found card: %02x:%02x.%x (integrated)\n", pci_id_igd->bus, pci_id_igd->slot, pci_id_igd->func);
 
   free(pci_id_igd);
@@ -496,13 +1623,40 @@ int main(int argc, char* argv[]) {
     g_key_file_free(bbcfg);
   }
   bbconfig_parse_opts(argc, argv, PARSE_STAGE_OTHER);
-  check_pm_method();
+  check_pm_method(discrete, discrete_count);
 
   /* dump the config after detecting the driver */
   config_dump();
   if (config_validate() != 0) {
     return (EXIT_FAILURE);
   }
+  if (bb_config.pool_max > SECONDARY_POOL_MAX) {
+    bb_log(LOG_ERR, "Invalid configuration: PoolMax must be between 1 and"
+            " %i.\n", SECONDARY_POOL_MAX);
+    return (EXIT_FAILURE);
+  }
+  for (idx = 0; idx < discrete_count; idx++) {
+    char display[BUFFER_SIZE];
+    int server;
+    cards[card_count].s = secondary_add(discrete[idx]);
+    if (!cards[card_count].s) {
+      free(discrete[idx]);
+      continue;
+    }
+    energy_add_card(discrete[idx]);
+    /* every card gets a pool of PoolMax X servers on displays of its own */
+    for (server = 0; server < bb_config.pool_max; server++) {
+      card_display(display, sizeof display,
+              card_count * bb_config.pool_max + server);
+      if (secondary_add_server(cards[card_count].s, display) < 0) {
+        return (EXIT_FAILURE);
+      }
+      bb_log(LOG_INFO, "Card %i (%02x:%02x.%x) uses display %s\n",
+              card_count, discrete[idx]->bus, discrete[idx]->slot,
+              discrete[idx]->func, display);
+    }
+    card_count++;
+  }
 
 #ifdef WITH_PIDFILE
   /* only write PID if a pid file has been set */
@@ -551,11 +1705,33 @@ int main(int argc, char* argv[]) {
   pidfile_write(pfh);
 #endif
 
-  /* Initialize communication socket, enter main loop */
-  bb_status.bb_socket = socketServer(bb_config.socket_path, SOCK_NOBLOCK);
+  /* Initialize event loop and communication socket, enter main loop */
+  if (bb_event_init()) {
+    bb_closelog();
+#ifdef WITH_PIDFILE
+    pidfile_remove(pfh);
+#endif
+    exit(EXIT_FAILURE);
+  }
+  if (listen_fd != -1) {
+    bb_log(LOG_INFO, "Using the socket passed by socket activation\n");
+    bb_status.bb_socket = listen_fd;
+  } else {
+    bb_status.bb_socket = socketServer(bb_config.socket_path, SOCK_NOBLOCK);
+  }
+  bb_status.error_changed = state_changed;
+  secondary_init(secondary_started, state_changed);
+  energy_open(bb_config.energy_file);
   stop_secondary(); //turn off card, nobody is connected right now.
+  history_open(bb_config.history_file);
+  if (bb_config.prewarm_budget > 0) {
+    bb_timer_start(&prewarm.check, 60000, prewarm_check, NULL);
+  }
   main_loop();
-  unlink(bb_config.socket_path);
+  if (listen_fd == -1) {
+    /* an activated socket belongs to the service manager */
+    unlink(bb_config.socket_path);
+  }
   bb_status.runmode = BB_RUN_EXIT; //make sure all methods understand we are shutting down
   if (bb_config.card_shutdown_state) {
     //if shutdown state = 1, turn on card
@@ -564,13 +1740,29 @@ int main(int argc, char* argv[]) {
     //if shutdown state = 0, turn off card
     stop_secondary();
   }
+  format_residency(residency, sizeof residency);
+  bb_log(LOG_INFO, "Time spent per power tier: %s\n", residency);
+  if (bb_config.prewarm_budget > 0) {
+    format_prewarm(counters, sizeof counters);
+    bb_log(LOG_INFO, "Pre-warming: %s\n", counters);
+  }
+  if (switcher) {
+    format_hysteresis(counters, sizeof counters);
+    bb_log(LOG_INFO, "Power cycling: %s\n", counters);
+  }
+  format_teardown(counters, sizeof counters);
+  bb_log(LOG_INFO, "Cancelled teardowns: %s\n", counters);
+  energy_format(counters, sizeof counters);
+  bb_log(LOG_INFO, "Energy per state: %s\n", counters);
+  energy_close();
+  history_close();
   bb_closelog();
 #ifdef WITH_PIDFILE
   pidfile_remove(pfh);
 #endif
   bb_stop_all(); //stop any started processes that are left
-  //close X pipe, if any parts of it are open still
-  if (bb_status.x_pipe[0] != -1){close(bb_status.x_pipe[0]); bb_status.x_pipe[0] = -1;}
-  if (bb_status.x_pipe[1] != -1){close(bb_status.x_pipe[1]); bb_status.x_pipe[1] = -1;}
+  //close X pipes, if any parts of them are open still
+  secondary_close();
+  bb_event_close();
   return (EXIT_SUCCESS);
 }
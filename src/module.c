@@ -28,13 +28,44 @@
 #include "bblogger.h"
 #include "bbrun.h"
 
+/* Maximum number of modules whose state is kept, see module_track */
+#define MODULE_TRACKED_MAX 16
+
+/* Modules whose state is kept while it is tracked through uevents */
+static struct {
+  int enabled;
+  int count;
+  struct {
+    char name[64];
+    int loaded;
+  } modules[MODULE_TRACKED_MAX];
+} tracked;
+
 /**
- * Checks in /proc/modules whether a kernel module is loaded
+ * Looks up a tracked module
+ *
+ * @param driver The name of the driver (not a filename)
+ * @return The index of the module in tracked.modules, -1 if not tracked
+ */
+static int module_tracked(const char *driver) {
+  int i;
+
+  for (i = 0; i < tracked.count; i++) {
+    if (!strcmp(tracked.modules[i].name, driver)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Checks in /proc/modules whether a kernel module is loaded, bypassing and
+ * updating the state kept while modules are tracked
  *
  * @param driver The name of the driver (not a filename)
  * @return 1 if the module is loaded, 0 otherwise
  */
-int module_is_loaded(char *driver) {
+int module_probe(char *driver) {
   // use the same buffer length as lsmod
   char buffer[4096];
   FILE * bbs = fopen("/proc/modules", "r");
@@ -55,9 +86,63 @@ int module_is_loaded(char *driver) {
     }
   }
   fclose(bbs);
+  if (tracked.enabled) {
+    int i = module_tracked(driver);
+    if (i == -1 && tracked.count < MODULE_TRACKED_MAX &&
+            strlen(driver) < sizeof tracked.modules[0].name) {
+      i = tracked.count++;
+      strcpy(tracked.modules[i].name, driver);
+    }
+    if (i != -1) {
+      tracked.modules[i].loaded = ret;
+    }
+  }
   return ret;
 }
 
+/**
+ * Checks whether a kernel module is loaded. While modules are tracked, the
+ * state is read from /proc/modules only once
+ *
+ * @param driver The name of the driver (not a filename)
+ * @return 1 if the module is loaded, 0 otherwise
+ */
+int module_is_loaded(char *driver) {
+  if (tracked.enabled) {
+    int i = module_tracked(driver);
+    if (i != -1) {
+      return tracked.modules[i].loaded;
+    }
+  }
+  return module_probe(driver);
+}
+
+/**
+ * Starts or stops keeping the state of modules. The caller has to report
+ * every load and unload with module_changed, e.g. from kernel uevents.
+ * Restarting forgets the kept states.
+ *
+ * @param enable 1 to start, 0 to stop
+ */
+void module_track(int enable) {
+  tracked.enabled = enable;
+  tracked.count = 0;
+}
+
+/**
+ * Updates the kept state of a module after it was loaded or unloaded
+ *
+ * @param driver The name of the module
+ * @param loaded 1 if it was loaded, 0 if it was unloaded
+ */
+void module_changed(const char *driver, int loaded) {
+  int i = module_tracked(driver);
+
+  if (i != -1) {
+    tracked.modules[i].loaded = loaded;
+  }
+}
+
 /**
  * Attempts to load a module. If the module has not been loaded after ten
  * seconds, give up
@@ -67,7 +152,7 @@ int module_is_loaded(char *driver) {
  * @return 1 if the driver is successfully loaded, 0 otherwise
  */
 int module_load(char *module_name, char *driver) {
-  if (module_is_loaded(driver) == 0) {
+  if (module_probe(driver) == 0) {
     /* the module has not loaded yet, try to load it */
     bb_log(LOG_INFO, "Loading driver %s (module %s)\n", driver, module_name);
     char *mod_argv[] = {
@@ -76,7 +161,7 @@ int module_load(char *module_name, char *driver) {
       NULL
     };
     bb_run_fork_wait(mod_argv, 10);
-    if (module_is_loaded(driver) == 0) {
+    if (module_probe(driver) == 0) {
       bb_log(LOG_ERR, "Module %s could not be loaded (timeout?)\n", module_name);
       return 0;
     }
@@ -84,6 +169,29 @@ int module_load(char *module_name, char *driver) {
   return 1;
 }
 
+/**
+ * Starts loading a module without waiting for modprobe to finish. When the
+ * returned process has exited, module_probe tells whether it succeeded
+ *
+ * @param module_name The filename of the module to be loaded
+ * @param driver The name of the driver to be loaded
+ * @return The PID of modprobe, 0 if the module is loaded already or -1 if
+ * modprobe could not be started
+ */
+pid_t module_load_start(char *module_name, char *driver) {
+  if (module_is_loaded(driver) != 0) {
+    return 0;
+  }
+  bb_log(LOG_INFO, "Loading driver %s (module %s)\n", driver, module_name);
+  char *mod_argv[] = {
+    "modprobe",
+    module_name,
+    NULL
+  };
+  pid_t pid = bb_run_fork_nowait(mod_argv);
+  return pid ? pid : -1;
+}
+
 /**
  * Attempts to unload a module if loaded, for ten seconds before
  * giving up
@@ -92,7 +200,7 @@ int module_load(char *module_name, char *driver) {
  * @return 1 if the driver is successfully unloaded, 0 otherwise
  */
 int module_unload(char *driver) {
-  if (module_is_loaded(driver) == 1) {
+  if (module_probe(driver) == 1) {
     int retries = 30;
     bb_log(LOG_INFO, "Unloading %s driver\n", driver);
     char *mod_argv[] = {
@@ -101,10 +209,10 @@ int module_unload(char *driver) {
       NULL
     };
     bb_run_fork_wait(mod_argv, 10);
-    while (retries-- > 0 && module_is_loaded(driver) == 1) {
+    while (retries-- > 0 && module_probe(driver) == 1) {
       usleep(100000);
     }
-    if (module_is_loaded(driver) == 1) {
+    if (module_probe(driver) == 1) {
       bb_log(LOG_ERR, "Unloading %s driver timed out.\n", driver);
       return 0;
     }
@@ -112,6 +220,28 @@ int module_unload(char *driver) {
   return 1;
 }
 
+/**
+ * Starts unloading a module without waiting for rmmod to finish. When the
+ * returned process has exited, module_probe tells whether it succeeded
+ *
+ * @param driver The name of the driver (not a filename)
+ * @return The PID of rmmod, 0 if the module is not loaded or -1 if rmmod
+ * could not be started
+ */
+pid_t module_unload_start(char *driver) {
+  if (module_is_loaded(driver) != 1) {
+    return 0;
+  }
+  bb_log(LOG_INFO, "Unloading %s driver\n", driver);
+  char *mod_argv[] = {
+    "rmmod",
+    driver,
+    NULL
+  };
+  pid_t pid = bb_run_fork_nowait(mod_argv);
+  return pid ? pid : -1;
+}
+
 /**
  * Checks whether a kernel module is available for loading
  *
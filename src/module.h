@@ -19,8 +19,14 @@
  */
 
 #pragma once
+#include <sys/types.h>
 
 int module_is_loaded(char *driver);
+int module_probe(char *driver);
+void module_track(int enable);
+void module_changed(const char *driver, int loaded);
 int module_load(char *module_name, char *driver);
+pid_t module_load_start(char *module_name, char *driver);
 int module_unload(char *driver);
+pid_t module_unload_start(char *driver);
 int module_is_available(char *module_name);
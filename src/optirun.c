@@ -28,6 +28,8 @@
 #define _GNU_SOURCE
 
 #include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
@@ -35,10 +37,18 @@
 #include "bbconfig.h"
 #include "bbsocket.h"
 #include "bbsocketclient.h"
+#include "bbstatus.h"
 #include "bblogger.h"
 #include "bbrun.h"
+#include "bbnuma.h"
 #include "driver.h"
 
+/* PRIMUS_libGLa from the launch plan of the daemon, if any */
+static char *plan_libgl;
+
+/* CPUs and memory node of the card, if the daemon places applications */
+static struct numa_placement plan_placement = {.node = -1};
+static char *plan_cpulist;
 
 /**
  *  Handle recieved signals - except SIGCHLD, which is handled in bbrun.c
@@ -67,18 +77,118 @@ static void handle_signal(int sig) {
  */
 static int report_daemon_status(void) {
   char buffer[BUFFER_SIZE];
-  int r = snprintf(buffer, BUFFER_SIZE, "Status?");
-  socketWrite(&bb_status.bb_socket, buffer, r + 1);
-  while (bb_status.bb_socket != -1) {
-    r = socketRead(&bb_status.bb_socket, buffer, BUFFER_SIZE);
-    if (r > 0) {
-      ensureZeroTerminated(buffer, r, BUFFER_SIZE);
-      printf("Bumblebee status: %s\n", buffer);
-      socketClose(&bb_status.bb_socket);
-      return EXIT_SUCCESS;
+  uint32_t id;
+  if (bbsocket_send("Status?", &id) || bbsocket_recv(&id, buffer, BUFFER_SIZE)) {
+    return EXIT_FAILURE;
+  }
+  printf("Bumblebee status: %s\n", buffer);
+  socketClose(&bb_status.bb_socket);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Prints the status of the Bumblebee server from its status page, without
+ * contacting the server
+ * @return EXIT_SUCCESS if the status is successfully read, EXIT_FAILURE if
+ * there is no status page of a running server
+ */
+static int report_page_status(void) {
+  const struct status_page *map = status_page_map(bb_config.status_file);
+  struct status_page page;
+  char buffer[BUFFER_SIZE];
+  int ok;
+
+  if (!map) {
+    return EXIT_FAILURE;
+  }
+  ok = status_page_snapshot(map, &page) == 0 && page.state.pid != 0;
+  status_page_unmap(map);
+  /* a server that crashed could not remove its page */
+  if (!ok || (kill(page.state.pid, 0) && errno == ESRCH)) {
+    return EXIT_FAILURE;
+  }
+  status_page_format(&page.state, buffer, sizeof buffer);
+  printf("Bumblebee status: %s\n", buffer);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Retrieves the library path and display from the daemon where no option
+ * sets them
+ * @return 0 on success, non-zero on failure
+ */
+static int query_settings(void) {
+  char ld_path[BUFFER_SIZE], display[BUFFER_SIZE];
+  const char *const keys[] = {"LibraryPath", "VirtualDisplay"};
+  char *const targets[] = {ld_path, display};
+
+  if (bbsocket_query_many(keys, targets, BUFFER_SIZE, 2)) {
+    bb_log(LOG_ERR, "Failed to retrieve LibraryPath and VirtualDisplay"
+            " settings.\n");
+    return 1;
+  }
+  if (!bb_config.ld_path) {
+    set_string_value(&bb_config.ld_path, ld_path);
+  }
+  if (!bb_config.x_display) {
+    set_string_value(&bb_config.x_display, display);
+  }
+  return 0;
+}
+
+/**
+ * Takes the settings from a positive reply to a Connect or Plan request. The
+ * display of the X server chosen by the daemon is always used, the other
+ * settings only where no option sets them
+ * @param reply Lines of the form "Key: value" after the first line, which is
+ * modified while parsing
+ */
+static void apply_plan(char *reply) {
+  char *line, *saveptr, *display;
+  bool own_ld_path = bb_config.ld_path != NULL;
+
+  line = strtok_r(reply, "\n", &saveptr);
+  /* the daemon tells which display belongs to the card it chose */
+  display = line ? strstr(line, "Display: ") : NULL;
+  if (display) {
+    set_string_value(&bb_config.x_display, display + strlen("Display: "));
+  }
+  while ((line = strtok_r(NULL, "\n", &saveptr))) {
+    char *value = strstr(line, ": ");
+    if (!value) {
+      continue;
+    }
+    *value = 0;
+    value += 2;
+    if (!strcmp(line, "VirtualDisplay") && !bb_config.x_display) {
+      set_string_value(&bb_config.x_display, value);
+    } else if (!strcmp(line, "LibraryPath") && !own_ld_path) {
+      set_string_value(&bb_config.ld_path, value);
+    } else if (!strcmp(line, "LibGL") && !own_ld_path) {
+      set_string_value(&plan_libgl, value);
+    } else if (!strcmp(line, "LocalCPUs")) {
+      set_string_value(&plan_cpulist, value);
+    } else if (!strcmp(line, "NumaNode")) {
+      plan_placement.node = atoi(value);
     }
   }
-  return EXIT_FAILURE;
+}
+
+/**
+ * Places optirun next to the card if the daemon sent its placement, the
+ * bridge and the application inherit it
+ */
+static void apply_placement(void) {
+  if (!plan_cpulist && plan_placement.node == -1) {
+    return;
+  }
+  if (numa_placement_parse(plan_cpulist ? plan_cpulist : "",
+          plan_placement.node, &plan_placement) &&
+          numa_placement_apply(&plan_placement) == 0) {
+    bb_log(LOG_DEBUG, "Running on NUMA node %i, CPUs %s\n",
+            plan_placement.node, plan_placement.cpulist[0] ?
+            plan_placement.cpulist : "all");
+  }
 }
 
 /**
@@ -223,7 +333,9 @@ static int run_primus(int argc, char **argv) {
 
   /* set PRIMUS_libGLa */
   char *libgl_mesa = "/usr/$LIB/libGL.so.1:/usr/lib/$LIB/libGL.so.1:/usr/$LIB/mesa/libGL.so.1:/usr/lib/$LIB/mesa/libGL.so.1";
-  if (bb_config.ld_path[0]) { /* build new library path for PRIMUS_libGLa */
+  if (plan_libgl) { /* built by the daemon from its library path */
+    setenv("PRIMUS_libGLa", plan_libgl, 0);
+  } else if (bb_config.ld_path[0]) { /* build new library path for PRIMUS_libGLa */
     int libgl_size = strlen(bb_config.ld_path) + 1;
     { /* calculate additional memories for adding "/libGL.so.1" */
       char *p = bb_config.ld_path;
@@ -316,6 +428,7 @@ static int run_app(int argc, char *argv[]) {
   int exitcode = EXIT_FAILURE;
   char buffer[BUFFER_SIZE];
   int r;
+  uint32_t id;
   int ranapp = 0;
 
   struct optirun_bridge *back = backends;
@@ -338,12 +451,21 @@ static int run_app(int argc, char *argv[]) {
     }
   }
 
-  r = snprintf(buffer, BUFFER_SIZE, "Connect %s", bb_config.no_xorg ? "NoX" : "");
-  socketWrite(&bb_status.bb_socket, buffer, r + 1);
+  /* a daemon with protocol v2 sends all settings in the reply to a single
+   * Plan request, older ones are queried before sending Connect */
+  snprintf(buffer, BUFFER_SIZE, "Plan %sCard=%s",
+          bb_config.no_xorg ? "NoX " : "", bb_config.card);
+  if (bbsocket_negotiate(buffer, &id) != BB_PROTOCOL_VERSION) {
+    if (query_settings()) {
+      return EXIT_FAILURE;
+    }
+    snprintf(buffer, BUFFER_SIZE, "Connect %sCard=%s",
+            bb_config.no_xorg ? "NoX " : "", bb_config.card);
+    bbsocket_send(buffer, &id);
+  }
   while (bb_status.bb_socket != -1) {
-    r = socketRead(&bb_status.bb_socket, buffer, BUFFER_SIZE);
-    if (r > 0) {
-      r = ensureZeroTerminated(buffer, r, BUFFER_SIZE);
+    if (!bbsocket_recv(&id, buffer, BUFFER_SIZE)) {
+      r = strlen(buffer) + 1;
       bb_log(LOG_INFO, "Response: %s\n", buffer);
       switch (buffer[0]) {
         case 'N': //No, run normally.
@@ -355,6 +477,9 @@ static int run_app(int argc, char *argv[]) {
           }
           break;
         case 'Y': //Yes, run through vglrun
+          apply_plan(buffer);
+          apply_placement();
+          config_dump();
           bb_log(LOG_INFO, "Running application using %s.\n", back->name);
           ranapp = 1;
           exitcode = back->run(argc, argv);
@@ -396,6 +521,7 @@ const struct option *bbconfig_get_lopts(void) {
     {"vgl-options", 1, 0, OPT_VGL_OPTIONS},
     {"primus-ldpath", 1, 0, OPT_PRIMUS_LD_PATH},
     {"status", 0, 0, OPT_STATUS},
+    {"card", 1, 0, OPT_CARD},
     BBCONFIG_COMMON_LOPTS
   };
   return longOpts;
@@ -434,6 +560,9 @@ int bbconfig_parse_options(int opt, char *value) {
     case OPT_STATUS:
       bb_status.runmode = BB_RUN_STATUS;
       break;
+    case OPT_CARD:
+      set_string_value(&bb_config.card, value);
+      break;
     default:
       /* no options parsed */
       return 0;
@@ -460,6 +589,20 @@ int main(int argc, char *argv[]) {
   GKeyFile *bbcfg = bbconfig_parse_conf();
   if (bbcfg) g_key_file_free(bbcfg);
 
+  /* parse remaining common and optirun-specific options. The library path
+   * and display of the daemon are used unless these options set them */
+  free_and_set_value(&bb_config.ld_path, NULL);
+  free_and_set_value(&bb_config.x_display, NULL);
+  bbconfig_parse_opts(argc, argv, PARSE_STAGE_OTHER);
+  bb_log(LOG_DEBUG, "%s version %s starting...\n", "optirun", GITVERSION);
+
+  /* the status page of the daemon saves a connection */
+  if (bb_status.runmode == BB_RUN_STATUS &&
+          report_page_status() == EXIT_SUCCESS) {
+    bb_closelog();
+    return EXIT_SUCCESS;
+  }
+
   /* Connect to listening daemon */
   bb_status.bb_socket = socketConnect(bb_config.socket_path, SOCK_BLOCK);
   if (bb_status.bb_socket < 0) {
@@ -469,22 +612,6 @@ int main(int argc, char *argv[]) {
     return exitcode;
   }
 
-  free_and_set_value(&bb_config.ld_path, malloc(BUFFER_SIZE));
-  if (bbsocket_query("LibraryPath", bb_config.ld_path, BUFFER_SIZE)) {
-    bb_log(LOG_ERR, "Failed to retrieve LibraryPath setting.\n");
-    return EXIT_FAILURE;
-  }
-  free_and_set_value(&bb_config.x_display, malloc(BUFFER_SIZE));
-  if (bbsocket_query("VirtualDisplay", bb_config.x_display, BUFFER_SIZE)) {
-    bb_log(LOG_ERR, "Failed to retrieve VirtualDisplay setting.\n");
-    return EXIT_FAILURE;
-  }
-
-  /* parse remaining common and optirun-specific options */
-  bbconfig_parse_opts(argc, argv, PARSE_STAGE_OTHER);
-  bb_log(LOG_DEBUG, "%s version %s starting...\n", "optirun", GITVERSION);
-  config_dump();
-
   /* Request status */
   if (bb_status.runmode == BB_RUN_STATUS) {
     exitcode = report_daemon_status();
@@ -19,17 +19,30 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
 #include <errno.h>
+#include <dirent.h>
 #include "pci.h"
 #include <stdlib.h>
 #include <string.h>
 #include "bblogger.h"
 
+/* Initial number of entries of the inventory, it grows as needed */
+#define PCI_INVENTORY_INITIAL 64
+
+/* All PCI devices, sorted by Bus ID, see pci_inventory_scan */
+static struct {
+  struct pci_device *devices;
+  int count;
+  int capacity;
+  int scanned; /* 0 if the inventory has not been built yet */
+} inventory;
+
 /**
  * Builds a Bus ID like 02:f0.1 from a binary representation
  * @param dest The struct to store the Bus ID in
@@ -38,6 +51,7 @@
  */
 int pci_parse_bus_id(struct pci_bus_id *dest, int bus_id_numeric) {
   if (bus_id_numeric >= 0 && bus_id_numeric < 0x10000) {
+    dest->domain = 0;
     dest->bus = bus_id_numeric >> 8;
     dest->slot = (bus_id_numeric >> 3) & 0x1f;
     dest->func = bus_id_numeric & 0x7;
@@ -46,6 +60,223 @@ int pci_parse_bus_id(struct pci_bus_id *dest, int bus_id_numeric) {
   return 0;
 }
 
+/**
+ * Compares Bus IDs for sorting and searching the inventory
+ * @return negative, zero or positive like strcmp
+ */
+static int pci_bus_id_compare(const struct pci_bus_id *a,
+        const struct pci_bus_id *b) {
+  if (a->domain != b->domain) {
+    return a->domain - b->domain;
+  }
+  if (a->bus != b->bus) {
+    return a->bus - b->bus;
+  }
+  if (a->slot != b->slot) {
+    return a->slot - b->slot;
+  }
+  return a->func - b->func;
+}
+
+/**
+ * qsort comparator for the inventory
+ */
+static int pci_device_compare(const void *a, const void *b) {
+  return pci_bus_id_compare(&((const struct pci_device *)a)->bus_id,
+          &((const struct pci_device *)b)->bus_id);
+}
+
+/**
+ * Reads a sysfs attribute of a device
+ * @param dir_fd The opened sysfs devices directory
+ * @param name The name of the device in it, e.g. 0000:01:00.0
+ * @param attr The attribute, e.g. uevent
+ * @param buf The buffer receiving the null-terminated value
+ * @param len The size of buf
+ * @return The number of bytes read, -1 on failure
+ */
+static ssize_t pci_read_attr(int dir_fd, const char *name, const char *attr,
+        char *buf, size_t len) {
+  char path[64];
+  ssize_t r;
+  int fd;
+
+  snprintf(path, sizeof path, "%s/%s", name, attr);
+  fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  r = read(fd, buf, len - 1);
+  close(fd);
+  buf[r > 0 ? r : 0] = 0;
+  return r;
+}
+
+/**
+ * Fills an inventory entry from the attributes of a device in sysfs. The
+ * uevent attribute holds the IDs, class and driver at once
+ * @param dir_fd The opened sysfs devices directory
+ * @param name The name of the device in it
+ * @param dev The entry to fill, its Bus ID is already set
+ */
+static void pci_device_read(int dir_fd, const char *name,
+        struct pci_device *dev) {
+  char buf[512];
+  char *line;
+
+  dev->vendor = dev->device = 0;
+  dev->class = 0;
+  dev->driver[0] = 0;
+  dev->driver_valid = 1;
+  if (pci_read_attr(dir_fd, name, "uevent", buf, sizeof buf) > 0) {
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+      unsigned int vendor, device;
+
+      if (!strncmp(line, "DRIVER=", strlen("DRIVER="))) {
+        snprintf(dev->driver, sizeof dev->driver, "%s",
+                line + strlen("DRIVER="));
+      } else if (!strncmp(line, "PCI_CLASS=", strlen("PCI_CLASS="))) {
+        dev->class = strtoul(line + strlen("PCI_CLASS="), NULL, 16);
+      } else if (sscanf(line, "PCI_ID=%x:%x", &vendor, &device) == 2) {
+        dev->vendor = vendor;
+        dev->device = device;
+      }
+    }
+  } else {
+    /* uevent could not be read, the driver is read when it is needed */
+    dev->driver_valid = 0;
+  }
+  dev->numa_node = -1;
+  if (pci_read_attr(dir_fd, name, "numa_node", buf, sizeof buf) > 0) {
+    dev->numa_node = atoi(buf);
+  }
+  /* read in place, a state that does not fit is cut off */
+  dev->power_state[0] = 0;
+  if (pci_read_attr(dir_fd, name, "power_state", dev->power_state,
+          sizeof dev->power_state) > 0) {
+    dev->power_state[strcspn(dev->power_state, "\n")] = 0;
+  }
+}
+
+/**
+ * Builds the inventory of all PCI devices in a single walk of sysfs,
+ * replacing the previous one
+ * @return The number of devices found, -1 if sysfs could not be read
+ */
+int pci_inventory_scan(void) {
+  struct dirent *entry;
+  DIR *dir;
+
+  dir = opendir(PCI_DEVICES_PATH);
+  if (!dir) {
+    bb_log(LOG_WARNING, "Could not read %s: %s\n", PCI_DEVICES_PATH,
+            strerror(errno));
+    return -1;
+  }
+  inventory.count = 0;
+  inventory.scanned = 1;
+  while ((entry = readdir(dir))) {
+    unsigned int domain, bus, slot, func;
+    struct pci_device *dev;
+
+    if (sscanf(entry->d_name, "%x:%x:%x.%o", &domain, &bus, &slot,
+            &func) != 4) {
+      continue;
+    }
+    if (inventory.count == inventory.capacity) {
+      int capacity = inventory.capacity ? inventory.capacity * 2 :
+              PCI_INVENTORY_INITIAL;
+      struct pci_device *devices = realloc(inventory.devices,
+              capacity * sizeof *devices);
+      if (!devices) {
+        break;
+      }
+      inventory.devices = devices;
+      inventory.capacity = capacity;
+    }
+    dev = &inventory.devices[inventory.count++];
+    dev->bus_id.domain = domain;
+    dev->bus_id.bus = bus;
+    dev->bus_id.slot = slot;
+    dev->bus_id.func = func;
+    pci_device_read(dirfd(dir), entry->d_name, dev);
+  }
+  closedir(dir);
+  qsort(inventory.devices, inventory.count, sizeof *inventory.devices,
+          pci_device_compare);
+  bb_log(LOG_DEBUG, "Found %i PCI devices\n", inventory.count);
+  return inventory.count;
+}
+
+/**
+ * @return The number of devices in the inventory, which is built if needed
+ */
+int pci_inventory_count(void) {
+  if (!inventory.scanned) {
+    pci_inventory_scan();
+  }
+  return inventory.count;
+}
+
+/**
+ * @param index The index of a device, below pci_inventory_count
+ * @return The device, the inventory is ordered by Bus ID
+ */
+struct pci_device *pci_inventory_device(int index) {
+  return &inventory.devices[index];
+}
+
+/**
+ * Looks up a device in the inventory, which is built if needed
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @return The device or NULL if it was not found
+ */
+struct pci_device *pci_inventory_find(struct pci_bus_id *bus_id) {
+  struct pci_device key;
+
+  if (!bus_id || !pci_inventory_count()) {
+    return NULL;
+  }
+  key.bus_id = *bus_id;
+  return bsearch(&key, inventory.devices, inventory.count,
+          sizeof *inventory.devices, pci_device_compare);
+}
+
+/**
+ * Marks the cached driver binding of a device as outdated, e.g. after a
+ * module was loaded or unloaded
+ * @param bus_id A pci_bus_id struct containing a Bus ID, NULL for all devices
+ */
+void pci_driver_invalidate(struct pci_bus_id *bus_id) {
+  int i;
+
+  if (bus_id) {
+    struct pci_device *dev = pci_inventory_find(bus_id);
+    if (dev) {
+      dev->driver_valid = 0;
+    }
+    return;
+  }
+  for (i = 0; i < inventory.count; i++) {
+    inventory.devices[i].driver_valid = 0;
+  }
+}
+
+/**
+ * Records the driver bound to a device as reported by a uevent, such that no
+ * read of sysfs is needed
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @param driver The driver that was bound, empty if it was unbound
+ */
+void pci_driver_set(struct pci_bus_id *bus_id, const char *driver) {
+  struct pci_device *dev = pci_inventory_find(bus_id);
+
+  if (dev) {
+    snprintf(dev->driver, sizeof dev->driver, "%s", driver);
+    dev->driver_valid = 1;
+  }
+}
+
 /**
  * Gets the class of a device given by the Bus ID
  * @param bus_id A string containing a Bus ID like 01:00.0
@@ -53,24 +284,9 @@ int pci_parse_bus_id(struct pci_bus_id *dest, int bus_id_numeric) {
  * could not be determined
  */
 int pci_get_class(struct pci_bus_id *bus_id) {
-  /* the Bus ID is always of fixed length */
-  char class_path[40];
-  FILE *fp;
+  struct pci_device *dev = pci_inventory_find(bus_id);
 
-  snprintf(class_path, sizeof class_path,
-          "/sys/bus/pci/devices/0000:%02x:%02x.%o/class", bus_id->bus,
-          bus_id->slot, bus_id->func);
-  fp = fopen(class_path, "r");
-  if (fp) {
-    char class_buff[16];
-    int read_bytes;
-
-    read_bytes = fread(class_buff, 1, sizeof class_buff, fp);
-    class_buff[read_bytes] = 0;
-    fclose(fp);
-    return strtol(class_buff, NULL, 0) >> 8;
-  }
-  return 0;
+  return dev ? dev->class >> 8 : 0;
 }
 
 /**
@@ -81,51 +297,62 @@ int pci_get_class(struct pci_bus_id *bus_id) {
  * no memory could be allocated
  */
 struct pci_bus_id *pci_find_gfx_by_vendor(unsigned int vendor_id, unsigned int idx) {
-  FILE *fp;
-  char buf[512];
-  unsigned int bus_id_numeric, vendor_device;
   struct pci_bus_id *result;
+  int i, count = pci_inventory_count();
 
-  fp = fopen("/proc/bus/pci/devices", "r");
-  if (!fp) {
-    return NULL;
-  }
-
-  result = malloc(sizeof (struct pci_bus_id));
-  if (!result) {
-    return NULL;
-  }
+  for (i = 0; i < count; i++) {
+    struct pci_device *dev = &inventory.devices[i];
+    unsigned int pci_class = dev->class >> 8;
 
-  while (fgets(buf, sizeof(buf) - 1, fp)) {
-    if (sscanf(buf, "%x %x", &bus_id_numeric, &vendor_device) != 2) {
+    if (dev->vendor != vendor_id || (pci_class != PCI_CLASS_DISPLAY_VGA &&
+            pci_class != PCI_CLASS_DISPLAY_3D)) {
       continue;
     }
-    /* VVVVDDDD becomes VVVV */
-    if (vendor_device >> 0x10 == vendor_id) {
-      if (pci_parse_bus_id(result, bus_id_numeric)) {
-        int pci_class = pci_get_class(result);
-        if (pci_class == PCI_CLASS_DISPLAY_VGA ||
-                pci_class == PCI_CLASS_DISPLAY_3D) {
-          /* yay, found device. Now get next, or clean up and return */
-          if (idx--) {
-            /* It's not yet our device */
-            continue;
-          }
-          fclose(fp);
-          return result;
-        }
-      }
+    /* yay, found device. Now get next, or return it */
+    if (idx--) {
+      /* It's not yet our device */
+      continue;
     }
+    result = malloc(sizeof (struct pci_bus_id));
+    if (result) {
+      *result = dev->bus_id;
+    }
+    return result;
   }
-  /* no device found, clean up and return */
-  fclose(fp);
-  free(result);
+  /* no device found */
   return NULL;
 }
 
+/**
+ * Reads the driver bound to a device from sysfs
+ * @param dest The buffer to store the driver name in, empty if none is bound
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @param len The size of dest
+ */
+static void pci_read_driver(char *dest, struct pci_bus_id *bus_id,
+        size_t len) {
+  char path[1024], link[1024];
+  ssize_t read_bytes;
+
+  /* the path to the driver if one is loaded */
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME "/driver",
+          bus_id->domain, bus_id->bus, bus_id->slot, bus_id->func);
+  read_bytes = readlink(path, link, sizeof(link) - 1);
+  if (read_bytes < 0) {
+    /* error, assume that the driver is not loaded */
+    dest[0] = 0;
+    return;
+  }
+
+  /* readlink does not append a NULL according to the manpage */
+  link[read_bytes] = 0;
+  snprintf(dest, len, "%s", basename(link));
+}
+
 /**
  * Gets the driver name for a given Bus ID. If dest is not null and len is
- * larger than 0, the driver name will be stored in dest
+ * larger than 0, the driver name will be stored in dest. The binding is
+ * cached in the inventory until pci_driver_invalidate is called
  * @param dest An optional buffer to store the found driver name in
  * @param bus_id A pci_bus_id struct containing a Bus ID
  * @param len The maximum number of bytes to store in dest
@@ -133,28 +360,26 @@ struct pci_bus_id *pci_find_gfx_by_vendor(unsigned int vendor_id, unsigned int i
  * buffer was too small) or 0 on error
  */
 size_t pci_get_driver(char *dest, struct pci_bus_id *bus_id, size_t len) {
-  char path[1024];
-  ssize_t read_bytes;
-  char *name;
+  struct pci_device *dev;
+  char name[sizeof dev->driver];
 
   /* if the bus_id was invalid */
   if (!bus_id) {
     return 0;
   }
 
-  /* the path to the driver if one is loaded */
-  snprintf(path, sizeof path,  "/sys/bus/pci/devices/0000:%02x:%02x.%o/driver",
-          bus_id->bus, bus_id->slot, bus_id->func);
-  read_bytes = readlink(path, path, sizeof(path) - 1);
-  if (read_bytes < 0) {
-    /* error, assume that the driver is not loaded */
-    return 0;
+  dev = pci_inventory_find(bus_id);
+  if (!dev) {
+    /* a device that appeared after the scan is not cached */
+    pci_read_driver(name, bus_id, sizeof name);
+  } else {
+    if (!dev->driver_valid) {
+      pci_read_driver(dev->driver, bus_id, sizeof dev->driver);
+      dev->driver_valid = 1;
+    }
+    memcpy(name, dev->driver, sizeof name);
   }
 
-  /* readlink does not append a NULL according to the manpage */
-  path[read_bytes] = 0;
-
-  name = basename(path);
   /* save the name if a valid destination and buffer size was given */
   if (dest && len > 0) {
     strncpy(dest, name, len - 1);
@@ -164,109 +389,308 @@ size_t pci_get_driver(char *dest, struct pci_bus_id *bus_id, size_t len) {
   return strlen(name);
 }
 
+/**
+ * Finds all functions of a PCI device, i.e. the devices in the same slot that
+ * share its power. The functions are ordered by function number
+ * @param bus_id A pci_bus_id struct containing the Bus ID of any function
+ * @param dest An array receiving the Bus IDs of the functions
+ * @param max The number of Bus IDs that fit in dest
+ * @return The number of functions stored in dest, 0 if sysfs is unreadable
+ */
+int pci_find_functions(struct pci_bus_id *bus_id, struct pci_bus_id *dest,
+        int max) {
+  int i, count = 0, total = pci_inventory_count();
+
+  for (i = 0; i < total && count < max; i++) {
+    struct pci_bus_id *id = &inventory.devices[i].bus_id;
+
+    if (id->domain == bus_id->domain && id->bus == bus_id->bus &&
+            id->slot == bus_id->slot) {
+      dest[count++] = *id;
+    }
+  }
+  return count;
+}
+
+/**
+ * Writes the Bus ID of a device to a sysfs file of the PCI driver core
+ * @param path The file, e.g. the unbind file of a driver
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @return zero on success, non-zero on failure
+ */
+static int pci_driver_write(const char *path, struct pci_bus_id *bus_id) {
+  char id[16];
+  int fd, len;
+
+  pci_driver_invalidate(bus_id);
+  len = snprintf(id, sizeof id, PCI_DEVICE_NAME, bus_id->domain, bus_id->bus,
+          bus_id->slot, bus_id->func);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return errno;
+  }
+  if (write(fd, id, len) != len) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  close(fd);
+  return 0;
+}
+
+/**
+ * Detaches a device from its driver without unloading the driver
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @return zero on success, non-zero on failure
+ */
+int pci_unbind_driver(struct pci_bus_id *bus_id) {
+  char path[1024];
+
+  snprintf(path, sizeof path,
+          PCI_DEVICES_PATH "/" PCI_DEVICE_NAME "/driver/unbind",
+          bus_id->domain, bus_id->bus, bus_id->slot, bus_id->func);
+  return pci_driver_write(path, bus_id);
+}
+
+/**
+ * Attaches a device to a driver again after pci_unbind_driver
+ * @param bus_id A pci_bus_id struct containing a Bus ID
+ * @param driver The name of the driver
+ * @return zero on success, non-zero on failure
+ */
+int pci_bind_driver(struct pci_bus_id *bus_id, const char *driver) {
+  char path[1024];
+
+  snprintf(path, sizeof path, PCI_ROOT "/sys/bus/pci/drivers/%s/bind", driver);
+  return pci_driver_write(path, bus_id);
+}
+
 /**
  * Opens a stream to the PCI configuration space
  * @param bus_id A pci_bus_id struct containing a Bus ID
- * @param mode The mode for opening the file: O_WRONLY for writing, O_RDONLY for
- * reading
- * @return a file handle on success, or NULL on failure
+ * @param mode The mode for opening the file: O_RDWR for restoring, O_RDONLY
+ * for reading
+ * @return a file handle on success, or -1 on failure
  */
 static int pci_config_open(struct pci_bus_id *bus_id, mode_t mode) {
-  char config_path[41];
+  char config_path[1024];
 
   snprintf(config_path, sizeof config_path,
-          "/sys/bus/pci/devices/0000:%02x:%02x.%o/config", bus_id->bus,
-          bus_id->slot, bus_id->func);
-  return open(config_path, mode);
+          PCI_DEVICES_PATH "/" PCI_DEVICE_NAME "/config", bus_id->domain,
+          bus_id->bus, bus_id->slot, bus_id->func);
+  return open(config_path, mode | O_CLOEXEC);
+}
+
+/**
+ * Reads a little-endian dword of a configuration space
+ */
+static uint32_t pci_config_dword(const uint8_t *config, int offset) {
+  return config[offset] | config[offset + 1] << 8 |
+          config[offset + 2] << 16 | (uint32_t) config[offset + 3] << 24;
+}
+
+/**
+ * qsort comparator for the ranges of the configuration space, by order of
+ * restoration and then by offset
+ */
+static int pci_config_range_compare(const void *a, const void *b) {
+  const struct pci_config_range *ra = a, *rb = b;
+
+  if (ra->order != rb->order) {
+    return ra->order - rb->order;
+  }
+  return ra->start - rb->start;
 }
 
 /**
- * Reads data from the PCI configuration space of a device. Based on
- * pci_save_state in drivers/pci/pci.c
+ * Adds the ranges of a list of capabilities, each one reaching up to the
+ * next capability in the list or the end of the space
+ * @param ranges The ranges, the capabilities have their start set already
+ * @param first The index of the first capability of the space in ranges
+ * @param count The number of ranges including the capabilities
+ * @param end The end of the space the capabilities live in
+ */
+static void pci_config_cap_ends(struct pci_config_range *ranges, int first,
+        int count, int end) {
+  int i, j;
+
+  for (i = first; i < count; i++) {
+    ranges[i].end = end;
+    for (j = first; j < count; j++) {
+      if (ranges[j].start > ranges[i].start && ranges[j].start < ranges[i].end) {
+        ranges[i].end = ranges[j].start;
+      }
+    }
+  }
+}
+
+/**
+ * Splits a saved configuration space in the ranges that are restored as a
+ * unit, in the order of pci_restore_state in drivers/pci/pci.c: the PCI
+ * Express capability, the extended capabilities, the other capabilities, the
+ * header with the command register last, and MSI/MSI-X at the very end
+ * @param config The saved configuration space
+ * @param size The size of the saved space
+ * @param ranges Receives the ranges, PCI_CONFIG_RANGES_MAX of them
+ * @return The number of ranges
+ */
+int pci_config_ranges(const uint8_t *config, int size,
+        struct pci_config_range *ranges) {
+  int i, count = 0, first, offset, guard;
+
+  /* the header, the command and status registers after the BARs */
+  ranges[count++] = (struct pci_config_range){PCI_CONFIG_BARS,
+          PCI_CONFIG_HEADER, 3};
+  ranges[count++] = (struct pci_config_range){0, PCI_CONFIG_BARS, 4};
+  if (size <= PCI_CONFIG_HEADER) {
+    return count;
+  }
+
+  /* device specific registers before the first capability */
+  first = count;
+  ranges[count++] = (struct pci_config_range){PCI_CONFIG_HEADER, 0, 2};
+  offset = (config[PCI_STATUS] & PCI_STATUS_CAP_LIST) ?
+          config[PCI_CAPABILITY_LIST] & ~3 : 0;
+  for (guard = 0; offset >= PCI_CONFIG_HEADER && offset < PCI_CONFIG_SIZE &&
+          count < PCI_CONFIG_RANGES_MAX && guard < 48; guard++) {
+    int id = config[offset];
+
+    ranges[count++] = (struct pci_config_range){offset, 0,
+            id == PCI_CAP_ID_EXP ? 0 :
+            id == PCI_CAP_ID_MSI || id == PCI_CAP_ID_MSIX ? 5 : 2};
+    offset = config[offset + 1] & ~3;
+  }
+  for (i = first + 1; i < count; i++) {
+    if (ranges[i].start == PCI_CONFIG_HEADER) {
+      /* no device specific registers, a capability follows the header */
+      ranges[first] = ranges[--count];
+      break;
+    }
+  }
+  pci_config_cap_ends(ranges, first, count, PCI_CONFIG_SIZE < size ?
+          PCI_CONFIG_SIZE : size);
+
+  /* extended capabilities, starting right at the extended space */
+  first = count;
+  offset = PCI_CONFIG_SIZE;
+  for (guard = 0; offset >= PCI_CONFIG_SIZE && offset + 4 <= size &&
+          count < PCI_CONFIG_RANGES_MAX && guard < 960; guard++) {
+    uint32_t header = pci_config_dword(config, offset);
+
+    if (header == 0 || header == 0xffffffff) {
+      break;
+    }
+    ranges[count++] = (struct pci_config_range){offset, 0, 1};
+    offset = (header >> 20) & ~3;
+  }
+  pci_config_cap_ends(ranges, first, count, size);
+
+  qsort(ranges, count, sizeof *ranges, pci_config_range_compare);
+  return count;
+}
+
+/**
+ * Reads the PCI configuration space of a device with a single read, including
+ * the extended space if the kernel exposes it. Based on pci_save_state in
+ * drivers/pci/pci.c
  * @param bus_id A pci_bus_id struct containing a Bus ID
  * @param pcs A struct containing the PCI configuration state
  * @return zero on success, non-zero on failure
  */
 int pci_config_save(struct pci_bus_id *bus_id, struct pci_config_state *pcs) {
-  int i, is_saved = 1;
+  ssize_t r;
   int fd = pci_config_open(bus_id, O_RDONLY);
   if (fd == -1) {
     return errno;
   }
   bb_log(LOG_DEBUG, "Saving PCI configuration space...\n");
-  for (i = 0; i < 16; i++) {
-    /* read 32 bits (8 bytes) from the PCI configuration space */
-    if (read(fd, &pcs->saved_config_space[i], 4) != 4) {
-      bb_log(LOG_WARNING, "failed to retrieve config space value at offset"
-                " %#x - aborting\n", i);
-      is_saved = 0;
-      break;
-    }
-    /* Vendor ID and Device ID with all bits enabled is invalid and returned if
-     * a device is disabled */
-    if (i == 0 && pcs->saved_config_space[i] == (int32_t)-1) {
-      bb_log(LOG_WARNING, "invalid device state, is the discrete video card"
-              " disabled?\n");
-      is_saved = 0;
-      break;
-    }
-  }
+  pcs->state_saved = 0;
+  r = pread(fd, pcs->config, sizeof pcs->config, 0);
   close(fd);
-  pcs->state_saved = is_saved;
+  if (r < PCI_CONFIG_HEADER) {
+    /* unprivileged readers only get the header */
+    bb_log(LOG_WARNING, "failed to retrieve config space - aborting\n");
+    return 0;
+  }
+  /* Vendor ID and Device ID with all bits enabled is invalid and returned if
+   * a device is disabled */
+  if (pci_config_dword(pcs->config, 0) == 0xffffffff) {
+    bb_log(LOG_WARNING, "invalid device state, is the discrete video card"
+            " disabled?\n");
+    return 0;
+  }
+  pcs->size = r & ~3;
+  pcs->state_saved = 1;
   return 0;
 }
 
 /**
- * Writes data to the PCI configuration space of a device. Based on
- * pci_restore_state in drivers/pci/pci.c
+ * Writes back the parts of the PCI configuration space of a device that
+ * differ from the saved state. The current space is read at once, the
+ * differences are written range by range (see pci_config_ranges) with one
+ * write per run of changed dwords. Based on pci_restore_state in
+ * drivers/pci/pci.c
  * @param bus_id A pci_bus_id struct containing a Bus ID
  * @param pcs A struct containing the PCI configuration state
  * @return zero on success, non-zero on failure
  */
 int pci_config_restore(struct pci_bus_id *bus_id, struct pci_config_state *pcs) {
-  int i;
-  int fd_write, fd_read;
+  struct pci_config_range ranges[PCI_CONFIG_RANGES_MAX];
+  uint8_t current[PCI_CONFIG_EXT_SIZE];
+  int i, fd, count, writes = 0, written = 0;
+
   if (!pcs->state_saved) {
     /* nothing to restore, so success? */
     bb_log(LOG_DEBUG, "there is no PCI configuration space to restore\n");
     return 0;
   }
-  fd_write = pci_config_open(bus_id, O_WRONLY);
-  if (fd_write == -1) {
+  fd = pci_config_open(bus_id, O_RDWR);
+  if (fd == -1) {
     return errno;
   }
-  fd_read = pci_config_open(bus_id, O_RDONLY);
-  if (fd_read == -1) {
-    int err = errno;
-    close(fd_write);
-    return err;
+  if (pread(fd, current, pcs->size, 0) != pcs->size ||
+          pci_config_dword(current, 0) == 0xffffffff) {
+    bb_log(LOG_WARNING, "failed to retrieve config space - not restoring\n");
+    close(fd);
+    return EIO;
   }
 
   bb_log(LOG_DEBUG, "Restoring PCI configuration space...\n");
+  count = pci_config_ranges(pcs->config, pcs->size, ranges);
+  for (i = 0; i < count; i++) {
+    int offset = ranges[i].start;
+
+    while (offset < ranges[i].end) {
+      int start, end, same = 0;
 
-  for (i = 15; i >= 0; i--) {
-    int32_t val;
-
-    lseek(fd_read, 4 * i, SEEK_SET);
-    if (read(fd_read, &val, 4) == 0) {
-      bb_log(LOG_WARNING, "failed to retrieve config space value at offset"
-              " %#x - not writing\n", i);
-    } else if (val != pcs->saved_config_space[i]) {
-      bb_log(LOG_DEBUG, "restoring config space at offset %#x (was %#x, writing"
-              " %#x)\n", i, val, pcs->saved_config_space[i]);
-      lseek(fd_write, 4 * i, SEEK_SET);
-
-      int written_bytes = write(fd_write, &pcs->saved_config_space[i], 4) != 4;
-      if (written_bytes != 4) {
-        /* this is unlikely to happen, but not sure if it will never happen */
-        bb_log(LOG_WARNING, "The PCI config space could not be written fully at"
-                " offset %#x; %i bytes have been written; error: %s",
-                i, written_bytes, strerror(errno));
+      if (!memcmp(current + offset, pcs->config + offset, 4)) {
+        offset += 4;
+        continue;
+      }
+      /* extend the run over dwords that differ, bridging short gaps */
+      start = end = offset;
+      while (offset < ranges[i].end && same <= PCI_CONFIG_WRITE_GAP) {
+        if (memcmp(current + offset, pcs->config + offset, 4)) {
+          same = 0;
+          end = offset + 4;
+        } else {
+          same++;
+        }
+        offset += 4;
+      }
+      if (pwrite(fd, pcs->config + start, end - start, start) != end - start) {
+        bb_log(LOG_WARNING, "The PCI config space could not be written at"
+                " offset %#x; error: %s\n", start, strerror(errno));
+      } else {
+        writes++;
+        written += end - start;
       }
+      offset = end;
     }
   }
-  close(fd_read);
-  close(fd_write);
+  bb_log(LOG_DEBUG, "Restored %i bytes of PCI configuration space in %i"
+          " writes\n", written, writes);
+  close(fd);
   pcs->state_saved = 0;
   return 0;
 }
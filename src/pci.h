@@ -19,28 +19,97 @@
  */
 
 #pragma once
-#include <sys/types.h> /* necessary for int32_t */
+#include <stdint.h>
+#include <sys/types.h>
 
 #define PCI_VENDOR_ID_NVIDIA  0x10de
 #define PCI_VENDOR_ID_INTEL   0x8086
 #define PCI_CLASS_DISPLAY_VGA 0x0300
 #define PCI_CLASS_DISPLAY_3D  0x0302
 
+/* Prefix for the procfs and sysfs paths, a build can point it to a fake tree
+ * with several cards for testing */
+#ifndef PCI_ROOT
+#define PCI_ROOT ""
+#endif
+
+/* Directory with the devices in sysfs and the format of a device name in it,
+ * taking the domain, bus, slot and function of a pci_bus_id */
+#define PCI_DEVICES_PATH PCI_ROOT "/sys/bus/pci/devices"
+#define PCI_DEVICE_NAME "%04x:%02x:%02x.%o"
+
 struct pci_bus_id {
+  unsigned short domain; /* 0x0000 - 0xFFFF */
   unsigned char bus; /* 0x00 - 0xFF */
   unsigned char slot; /* 0x00 - 0x1F */
   unsigned char func; /* 0 - 7 */
 };
 
+/* A PCI device as found by pci_inventory_scan */
+struct pci_device {
+  struct pci_bus_id bus_id;
+  unsigned short vendor;
+  unsigned short device;
+  unsigned int class; /* class, subclass and programming interface */
+  int numa_node; /* -1 if unknown */
+  char power_state[8]; /* D0 to D3cold at the time of the scan, or empty */
+  char driver[32]; /* bound driver, empty if none */
+  int driver_valid; /* 0 if driver has to be read again, see
+                     * pci_driver_invalidate */
+};
+
 int pci_parse_bus_id(struct pci_bus_id *dest, int bus_id_numeric);
+int pci_inventory_scan(void);
+int pci_inventory_count(void);
+struct pci_device *pci_inventory_device(int index);
+struct pci_device *pci_inventory_find(struct pci_bus_id *bus_id);
+void pci_driver_invalidate(struct pci_bus_id *bus_id);
+void pci_driver_set(struct pci_bus_id *bus_id, const char *driver);
 int pci_get_class(struct pci_bus_id *bus_id);
 struct pci_bus_id *pci_find_gfx_by_vendor(unsigned int vendor_id, unsigned int idx);
 size_t pci_get_driver(char *dest, struct pci_bus_id *bus_id, size_t len);
+int pci_find_functions(struct pci_bus_id *bus_id, struct pci_bus_id *dest,
+        int max);
+int pci_unbind_driver(struct pci_bus_id *bus_id);
+int pci_bind_driver(struct pci_bus_id *bus_id, const char *driver);
+
+/* Sizes of the standard header, the conventional configuration space and the
+ * extended configuration space of PCI Express */
+#define PCI_CONFIG_HEADER 0x40
+#define PCI_CONFIG_SIZE 0x100
+#define PCI_CONFIG_EXT_SIZE 0x1000
+
+/* Registers and capability IDs used when restoring the configuration */
+#define PCI_STATUS 0x06
+#define PCI_STATUS_CAP_LIST 0x10
+#define PCI_CONFIG_BARS 0x10 /* first BAR, the command register is before it */
+#define PCI_CAPABILITY_LIST 0x34
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_EXP 0x10
+#define PCI_CAP_ID_MSIX 0x11
+
+/* Maximum number of ranges a configuration space is restored in */
+#define PCI_CONFIG_RANGES_MAX 64
+/* Number of unchanged dwords a single write may cover to join two runs of
+ * changed dwords */
+#define PCI_CONFIG_WRITE_GAP 1
 
 struct pci_config_state {
     int state_saved;
-    int32_t saved_config_space[16];
+    int size; /* bytes saved, up to PCI_CONFIG_EXT_SIZE */
+    uint8_t config[PCI_CONFIG_EXT_SIZE];
 };
 
+/* A part of the configuration space that is restored as a unit, lower order
+ * first */
+struct pci_config_range {
+    int start;
+    int end;
+    int order;
+};
+
+int pci_config_ranges(const uint8_t *config, int size,
+        struct pci_config_range *ranges);
+
 int pci_config_save(struct pci_bus_id *bus_id, struct pci_config_state *pcs);
 int pci_config_restore(struct pci_bus_id *bus_id, struct pci_config_state *pcs);
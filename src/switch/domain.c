@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The power domain of a card: every PCI function in the slot of the card. The
+ * HDMI audio and USB-C functions of a discrete card share its power and keep
+ * the link awake, so they are suspended and unbound together with the card.
+ * When a method cuts the power behind the back of the kernel, the
+ * configuration spaces of the functions are saved and restored around it.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bblogger.h"
+#include "../pci.h"
+#include "switching.h"
+
+/* A function in the power domain of a card */
+static struct {
+  struct pci_bus_id bus_id;
+  bool card; /* whether this is the graphics function of the card itself */
+  char unbound[64]; /* driver unbound by domain_release, empty if none */
+  struct pci_config_state *config; /* saved by domain_release, NULL if the
+                                    * card was never powered off that way */
+} functions[DOMAIN_FUNCTIONS_MAX];
+static int function_count;
+
+/**
+ * Discovers the functions that share the slots of the cards
+ *
+ * @param cards The discrete cards
+ * @param card_count The number of discrete cards
+ * @return The number of functions in the domains, including the cards
+ */
+int domain_init(struct pci_bus_id **cards, int card_count) {
+  int i, j;
+
+  function_count = 0;
+  for (i = 0; i < card_count; i++) {
+    struct pci_bus_id ids[8];
+    char companions[256] = "";
+    size_t len = 0;
+    int count = pci_find_functions(cards[i], ids, 8);
+
+    if (count == 0) {
+      /* sysfs could not be read, the card is a domain on its own */
+      ids[0] = *cards[i];
+      count = 1;
+    }
+    for (j = 0; j < count && function_count < DOMAIN_FUNCTIONS_MAX; j++) {
+      char driver[64] = "none";
+
+      functions[function_count].bus_id = ids[j];
+      functions[function_count].card = ids[j].func == cards[i]->func;
+      functions[function_count].unbound[0] = 0;
+      function_count++;
+      if (ids[j].func == cards[i]->func || len >= sizeof companions) {
+        continue;
+      }
+      pci_get_driver(driver, &ids[j], sizeof driver);
+      len += snprintf(companions + len, sizeof companions - len, "%s%02x:%02x.%o"
+              " (%s)", len ? ", " : "", ids[j].bus, ids[j].slot, ids[j].func,
+              driver);
+    }
+    if (len) {
+      bb_log(LOG_INFO, "Card %02x:%02x.%o shares its power with %s\n",
+              cards[i]->bus, cards[i]->slot, cards[i]->func, companions);
+    }
+  }
+  return function_count;
+}
+
+/**
+ * @return The number of functions in the domains of all cards
+ */
+int domain_count(void) {
+  return function_count;
+}
+
+/**
+ * @param index The index of a function, below domain_count
+ * @return The Bus ID of the function
+ */
+struct pci_bus_id *domain_function(int index) {
+  return &functions[index].bus_id;
+}
+
+/**
+ * @param index The index of a function, below domain_count
+ * @return 1 if the function is the graphics function of a card, 0 if it is a
+ * companion function in its slot
+ */
+int domain_is_card(int index) {
+  return functions[index].card;
+}
+
+/**
+ * Unbinds the drivers of the companion functions and saves the configuration
+ * spaces of all functions before the card is powered off by a method that
+ * cuts the power behind the back of the kernel. The driver of the card itself
+ * is unloaded by the caller.
+ */
+void domain_release(void) {
+  int i;
+
+  for (i = 0; i < function_count; i++) {
+    struct pci_bus_id *id = &functions[i].bus_id;
+
+    if (!functions[i].card && !functions[i].unbound[0] &&
+            pci_get_driver(functions[i].unbound, id,
+            sizeof functions[i].unbound)) {
+      bb_log(LOG_DEBUG, "Unbinding %s from %02x:%02x.%o\n",
+              functions[i].unbound, id->bus, id->slot, id->func);
+      if (pci_unbind_driver(id)) {
+        bb_log(LOG_WARNING, "Could not unbind %s from %02x:%02x.%o, the card"
+                " may not power off\n", functions[i].unbound, id->bus,
+                id->slot, id->func);
+        functions[i].unbound[0] = 0;
+      }
+    }
+    if (!functions[i].config) {
+      functions[i].config = calloc(1, sizeof *functions[i].config);
+    }
+    if (functions[i].config && pci_config_save(id, functions[i].config)) {
+      bb_log(LOG_WARNING, "Could not save the PCI configuration space of"
+              " %02x:%02x.%o\n", id->bus, id->slot, id->func);
+    }
+  }
+}
+
+/**
+ * Restores the configuration spaces saved by domain_release and binds the
+ * unbound drivers again once the card is on
+ */
+void domain_restore(void) {
+  int i;
+
+  for (i = 0; i < function_count; i++) {
+    struct pci_bus_id *id = &functions[i].bus_id;
+
+    if (functions[i].config && functions[i].config->state_saved &&
+            pci_config_restore(id, functions[i].config)) {
+      bb_log(LOG_WARNING, "Could not restore the PCI configuration space of"
+              " %02x:%02x.%o\n", id->bus, id->slot, id->func);
+    }
+    if (!functions[i].unbound[0]) {
+      continue;
+    }
+    bb_log(LOG_DEBUG, "Binding %s to %02x:%02x.%o\n", functions[i].unbound,
+            id->bus, id->slot, id->func);
+    if (pci_bind_driver(id, functions[i].unbound)) {
+      bb_log(LOG_WARNING, "Could not bind %s to %02x:%02x.%o\n",
+              functions[i].unbound, id->bus, id->slot, id->func);
+    }
+    functions[i].unbound[0] = 0;
+  }
+}
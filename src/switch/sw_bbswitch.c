@@ -28,7 +28,7 @@
 #include "switching.h"
 #include "../module.h"
 
-#define BBSWITCH_PATH "/proc/acpi/bbswitch"
+static struct switch_file bbswitch_file = {BBSWITCH_PATH, -1, ""};
 
 /**
  * Reports the status of bbswitch
@@ -37,47 +37,26 @@
  * if bbswitch not available
  */
 enum switch_state bbswitch_status(void) {
-  char buffer[BBS_BUFFER];
-  int ret = SWITCH_UNAVAIL;
-  FILE * bbs = fopen(BBSWITCH_PATH, "r");
-  if (bbs == 0) {
+  const char *contents = switch_file_read(&bbswitch_file);
+  size_t skip = strlen("0000:00:00.0 O");
+
+  // skip the PCI Bus ID, a space and 'O'
+  if (!contents || strlen(contents) <= skip) {
     return SWITCH_UNAVAIL;
   }
-  memset(buffer, 0, BBS_BUFFER);
-  // skip the PCI Bus ID, a space and 'O'
-  if (fseek(bbs, strlen("0000:00:00.0 O"), SEEK_SET) != -1) {
-    switch (fgetc(bbs)) {
-      case 'F': // value was 0000:00:00.0 OFF
-        ret = SWITCH_OFF;
-        break;
-      case 'N': // value was 0000:00:00.0 ON
-        ret = SWITCH_ON;
-        break;
-      default:
-        // this should never happen unless the behavior of the bbswitch kernel
-        // module has changed. If no device was registered, the procfs entry
-        // should not exist either
-        break;
-    }
+  switch (contents[skip]) {
+    case 'F': // value was 0000:00:00.0 OFF
+      return SWITCH_OFF;
+    case 'N': // value was 0000:00:00.0 ON
+      return SWITCH_ON;
+    default:
+      // this should never happen unless the behavior of the bbswitch kernel
+      // module has changed. If no device was registered, the procfs entry
+      // should not exist either
+      return SWITCH_UNAVAIL;
   }
-  fclose(bbs);
-  return ret;
 }//bbswitch_status
 
-static void bbswitch_write(char *msg) {
-  FILE *bbs = fopen(BBSWITCH_PATH, "w");
-  if (bbs == 0) {
-    bb_log(LOG_ERR, "Could not open %s: %s\n", BBSWITCH_PATH, strerror(errno));
-    return;
-  }
-  fwrite(msg, sizeof msg, strlen(msg) + 1, bbs);
-  if (ferror(bbs)) {
-    bb_log(LOG_WARNING, "Could not write to %s: %s\n", BBSWITCH_PATH,
-            strerror(errno));
-  }
-  fclose(bbs);
-}
-
 /**
  * Whether bbswitch is available for use
  *
@@ -113,12 +92,12 @@ int bbswitch_is_available(struct switch_info info) {
  * Turns card on if not already on
  */
 void bbswitch_on(void) {
-  bbswitch_write("ON\n");
+  switch_file_write(&bbswitch_file, "ON\n");
 }//bbswitch_on
 
 /**
  * Turns card off if not already off
  */
 void bbswitch_off(void) {
-  bbswitch_write("OFF\n");
+  switch_file_write(&bbswitch_file, "OFF\n");
 }//bbswitch_off
@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../bblogger.h"
+#include "../pci.h"
+#include "switching.h"
+
+/* The runtime power management attributes of a function in sysfs */
+struct runtimepm_function {
+  char control_path[PATH_MAX];
+  char status_path[PATH_MAX];
+  char delay_path[PATH_MAX];
+  char d3cold_path[PATH_MAX];
+  struct switch_file control; /* power/control: "on" or "auto" */
+  struct switch_file status; /* power/runtime_status */
+  struct switch_file delay; /* power/autosuspend_delay_ms */
+  struct switch_file d3cold; /* d3cold_allowed */
+  bool has_d3cold; /* whether the kernel supports D3cold for the function */
+  bool has_delay; /* whether the function has an autosuspend delay */
+  bool card; /* whether this is the graphics function of a card */
+};
+
+/* All functions in the power domains of the cards, see domain_init */
+static struct runtimepm_function functions[DOMAIN_FUNCTIONS_MAX];
+static int function_count;
+/* Functions found awake while the cards were suspended, as last logged */
+static unsigned int blockers;
+
+/* power/control of the first card, watched for external changes */
+char runtimepm_path[PATH_MAX];
+
+/**
+ * Sets up a file of a function in sysfs
+ *
+ * @param file The file to set up
+ * @param path A buffer of PATH_MAX bytes for the path of the file
+ * @param dir The sysfs directory of the function
+ * @param name The name of the file, relative to dir
+ * @return 1 if the path fits, 0 otherwise
+ */
+static int runtimepm_file_init(struct switch_file *file, char *path,
+        const char *dir, const char *name) {
+  if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+    return 0;
+  }
+  file->path = path;
+  file->fd = -1;
+  return 1;
+}
+
+/**
+ * Sets up the files of a function in sysfs
+ *
+ * @param function The function to set up
+ * @param bus_id The PCI Bus ID of the function
+ * @return 1 if the paths of the files fit, 0 otherwise
+ */
+static int runtimepm_function_init(struct runtimepm_function *function,
+        struct pci_bus_id *bus_id) {
+  char dir[PATH_MAX];
+
+  if (snprintf(dir, sizeof dir, PCI_DEVICES_PATH "/" PCI_DEVICE_NAME,
+          bus_id->domain, bus_id->bus, bus_id->slot, bus_id->func) >=
+          (int)sizeof dir) {
+    return 0;
+  }
+  return runtimepm_file_init(&function->control, function->control_path,
+          dir, "power/control") &&
+          runtimepm_file_init(&function->status, function->status_path,
+          dir, "power/runtime_status") &&
+          runtimepm_file_init(&function->delay, function->delay_path,
+          dir, "power/autosuspend_delay_ms") &&
+          runtimepm_file_init(&function->d3cold, function->d3cold_path,
+          dir, "d3cold_allowed");
+}
+
+/**
+ * Logs the functions that keep the link awake while the cards themselves are
+ * suspended, once whenever that set changes
+ *
+ * @param awake Bit mask of the awake companion functions
+ */
+static void runtimepm_log_blockers(unsigned int awake) {
+  char list[256] = "";
+  size_t len = 0;
+  int i;
+
+  if (awake == blockers) {
+    return;
+  }
+  blockers = awake;
+  for (i = 0; i < function_count && len < sizeof list; i++) {
+    struct pci_bus_id *id = domain_function(i);
+    char driver[64] = "no driver";
+
+    if (!(awake & (1u << i))) {
+      continue;
+    }
+    pci_get_driver(driver, id, sizeof driver);
+    len += snprintf(list + len, sizeof list - len, "%s%02x:%02x.%o (%s)",
+            len ? ", " : "", id->bus, id->slot, id->func, driver);
+  }
+  if (len) {
+    bb_log(LOG_INFO, "The dedicated card is kept awake by %s\n", list);
+  }
+}
+
+/**
+ * Reports the runtime power state of the cards. The cards are off only when
+ * every function in their slots is suspended, a function that is suspending
+ * or resuming still draws power and counts as on
+ *
+ * @return SWITCH_OFF if all functions are suspended, SWITCH_ON if a function
+ * is on and SWITCH_UNAVAIL if the state of a card cannot be read
+ */
+enum switch_state runtimepm_status(void) {
+  bool card_awake = false;
+  unsigned int awake = 0;
+  int i;
+
+  for (i = 0; i < function_count; i++) {
+    const char *status = switch_file_read(&functions[i].status);
+
+    if (!status) {
+      if (functions[i].card) {
+        return SWITCH_UNAVAIL;
+      }
+      continue;
+    }
+    if (!strncmp(status, "suspended", strlen("suspended"))) {
+      continue;
+    }
+    if (!functions[i].card) {
+      // a companion with runtime PM disabled ("unsupported") keeps the link
+      // awake just like an active one
+      awake |= 1u << i;
+    } else if (!strncmp(status, "active", strlen("active")) ||
+            !strncmp(status, "suspending", strlen("suspending")) ||
+            !strncmp(status, "resuming", strlen("resuming"))) {
+      card_awake = true;
+    } else {
+      // "unsupported" if runtime PM is disabled for the device, or "error"
+      return SWITCH_UNAVAIL;
+    }
+  }
+  runtimepm_log_blockers(card_awake ? 0 : awake);
+  return card_awake || awake ? SWITCH_ON : SWITCH_OFF;
+}//runtimepm_status
+
+/**
+ * Whether runtime power management is available for use. It is picked by
+ * auto-detection only if the kernel can put the cards in D3cold, otherwise
+ * the cards would stay powered in D3hot
+ *
+ * @param info A struct containing information which would help with the
+ * decision whether runtime power management is usable or not
+ * @return 1 if available for use for PM, 0 otherwise
+ */
+int runtimepm_is_available(struct switch_info info) {
+  int i, count = domain_count();
+
+  if (count <= 0) {
+    bb_log(LOG_DEBUG, "runtimepm has no cards to control\n");
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    struct runtimepm_function *function = &functions[i];
+    struct pci_bus_id *id = domain_function(i);
+
+    if (!runtimepm_function_init(function, id)) {
+      bb_log(LOG_DEBUG, "The sysfs path of %02x:%02x.%o is too long\n",
+              id->bus, id->slot, id->func);
+      return 0;
+    }
+    function->card = domain_is_card(i);
+    if (access(function->control_path, F_OK | R_OK | W_OK) != 0 ||
+            access(function->status_path, F_OK | R_OK) != 0) {
+      bb_log(LOG_DEBUG, "Runtime power management is not available for"
+              " %02x:%02x.%o\n", id->bus, id->slot, id->func);
+      return 0;
+    }
+    function->has_d3cold = access(function->d3cold_path, F_OK) == 0;
+    function->has_delay = access(function->delay_path, F_OK | W_OK) == 0;
+    if (strcmp(info.configured_pm, "runtimepm") != 0 && function->card &&
+            !function->has_d3cold) {
+      bb_log(LOG_INFO, "Skipping runtimepm PM method because the kernel"
+              " does not support D3cold.\n");
+      return 0;
+    }
+  }
+  function_count = count;
+  for (i = 0; i < count; i++) {
+    if (functions[i].card) {
+      snprintf(runtimepm_path, sizeof runtimepm_path, "%s",
+              functions[i].control_path);
+      break;
+    }
+  }
+  bb_log(LOG_DEBUG, "Runtime power management has been detected.\n");
+  return 1;
+}
+
+/**
+ * Turns cards on by keeping them out of runtime suspend, the kernel resumes
+ * them before the write returns. The companion functions stay under runtime
+ * PM and are resumed by their drivers when used.
+ */
+void runtimepm_on(void) {
+  int i;
+
+  for (i = 0; i < function_count; i++) {
+    if (functions[i].card) {
+      switch_file_write(&functions[i].control, "on\n");
+    }
+  }
+}//runtimepm_on
+
+/**
+ * Lets the kernel suspend the cards and their companion functions as soon as
+ * they are idle, in D3cold if the platform supports it. The drivers stay
+ * loaded.
+ */
+void runtimepm_off(void) {
+  char delay[16];
+  int i;
+
+  snprintf(delay, sizeof delay, "%i\n", RUNTIMEPM_AUTOSUSPEND_DELAY);
+  for (i = 0; i < function_count; i++) {
+    if (functions[i].has_d3cold) {
+      switch_file_write(&functions[i].d3cold, "1\n");
+    }
+    if (functions[i].has_delay) {
+      switch_file_write(&functions[i].delay, delay);
+    }
+    switch_file_write(&functions[i].control, "auto\n");
+  }
+}//runtimepm_off
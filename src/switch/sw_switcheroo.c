@@ -26,7 +26,7 @@
 #include "../bblogger.h"
 #include "switching.h"
 
-#define SWITCHEROO_PATH "/sys/kernel/debug/vgaswitcheroo/switch"
+static struct switch_file switcheroo_file = {SWITCHEROO_PATH, -1, ""};
 
 /**
  * Reports the status of vga switcheroo
@@ -35,17 +35,16 @@
  * if switcheroo not available
  */
 int switcheroo_status(void) {
-  char buffer[BBS_BUFFER];
   int ret = SWITCH_UNAVAIL;
-  FILE * bbs = fopen(SWITCHEROO_PATH, "r");
-  if (bbs == 0) {
+  const char *line = switch_file_read(&switcheroo_file);
+  if (!line) {
     return SWITCH_UNAVAIL;
   }
-  while (fgets(buffer, BBS_BUFFER, bbs)) {
-    if (strlen(buffer) > strlen("0:DIS: :Pwr") &&
-            !strncmp(buffer + 2, "DIS", 3)) {//found the DIS line
-      // compare the first char after "0:DIS: :"
-      switch (buffer[strlen("0:DIS: :")]) {
+  while (*line) {
+    size_t len = strcspn(line, "\n");
+    if (len > strlen("0:DIS: :Pwr") && !strncmp(line + 2, "DIS", 3)) {
+      //found the DIS line, compare the first char after "0:DIS: :"
+      switch (line[strlen("0:DIS: :")]) {
         case 'P': // Pwr
           ret = SWITCH_ON;
           break;
@@ -54,26 +53,14 @@ int switcheroo_status(void) {
           break;
       }
     }
+    line += len;
+    if (*line) {
+      line++;
+    }
   }
-  fclose(bbs);
   return ret;
 }//switcheroo_status
 
-static void switcheroo_write(char *msg) {
-  FILE * bbs = fopen(SWITCHEROO_PATH, "w");
-  if (bbs == 0) {
-    bb_log(LOG_ERR, "Could not open %s: %s\n", SWITCHEROO_PATH,
-            strerror(errno));
-    return;
-  }
-  fwrite(msg, sizeof msg, strlen(msg) + 1, bbs);
-  if (ferror(bbs)) {
-    bb_log(LOG_WARNING, "Could not write to %s: %s\n", SWITCHEROO_PATH,
-            strerror(errno));
-  }
-  fclose(bbs);
-}
-
 /**
  * Whether vga_switcheroo is available for use
  *
@@ -94,12 +81,12 @@ int switcheroo_is_available(struct switch_info info) {
  * Turns card on if not already on
  */
 void switcheroo_on(void) {
-  switcheroo_write("ON\n");
+  switch_file_write(&switcheroo_file, "ON\n");
 }//switcheroo_on
 
 /**
  * Turns card off if not already off.
  */
 void switcheroo_off(void) {
-  switcheroo_write("OFF\n");
+  switch_file_write(&switcheroo_file, "OFF\n");
 }//switcheroo_off
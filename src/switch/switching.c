@@ -19,18 +19,71 @@
  */
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
 #include "../bblogger.h"
+#include "../bbevent.h"
 #include "switching.h"
 
 /* increase SWITCHERS_COUNT in switching.h when more methods are added */
 struct switching_method switching_methods[SWITCHERS_COUNT] = {
   {"bbswitch", 1, bbswitch_status, bbswitch_is_available,
-          bbswitch_on, bbswitch_off},
+          bbswitch_on, bbswitch_off, BBSWITCH_PATH, 0},
   {"switcheroo", 0, switcheroo_status, switcheroo_is_available,
-          switcheroo_on, switcheroo_off}
+          switcheroo_on, switcheroo_off, SWITCHEROO_PATH, 0},
+  /* the kernel suspends and resumes idle cards by itself */
+  {"runtimepm", 0, runtimepm_status, runtimepm_is_available,
+          runtimepm_on, runtimepm_off, runtimepm_path, 1}
 };
 
+/* Power state of the card as last read from or set through the switcher, so
+ * that status queries do not read the kernel interface every time */
+static struct {
+  bool active; /* whether the cache is used, see switch_cache_start */
+  bool valid; /* whether state can be returned without reading it again */
+  enum switch_state state;
+  int notify_fd; /* inotify descriptor watching the status file, -1 if none */
+  struct bb_timer resync;
+  switch_callback changed; /* told about changes, see switch_cache_start */
+  void *data;
+  enum switch_state reported; /* state last passed to changed */
+} cache = {false, false, SWITCH_UNAVAIL, -1, {0}, NULL, NULL, SWITCH_UNAVAIL};
+
+/* A caller waiting for a power transition, see switch_request */
+struct switch_waiter {
+  enum switch_state target;
+  switch_callback callback;
+  void *data;
+};
+
+/* The power transition in progress and the callers waiting for it or for a
+ * transition in the other direction after it */
+static struct {
+  bool active;
+  enum switch_state target;
+  long long begin; /* time at which the transition was started */
+  long long deadline; /* time at which the transition is considered failed */
+  int interval; /* ms until the next check whether the transition completed */
+  struct bb_timer poll;
+  struct switch_waiter waiters[SWITCH_WAITERS_MAX];
+  int waiter_count;
+} transition;
+
+/* Measurements for the hysteresis, see switch_hold_on */
+static struct {
+  struct switch_hysteresis stats;
+  long long on_cost; /* average duration of a power on transition */
+  long long off_cost; /* average duration of a power off transition */
+  long long extra_cost; /* average cost of a cycle reported by the caller */
+  long long on_since; /* time at which the card was last powered on, 0 if not */
+  long long off_since; /* time at which the card was last powered off */
+  int factor; /* multiplier of the minimum on time */
+} hysteresis = {.factor = 1};
+
 /**
  * Enumerates through available switching methods and try a method
  * 
@@ -44,6 +97,7 @@ struct switching_method *switcher_detect(const char *name,
         struct switch_info info) {
   int i;
   switcher = NULL;
+  domain_init(info.cards, info.card_count);
   for (i = 0; i<SWITCHERS_COUNT; ++i) {
     /* If the status is 0 or 1, the method is usable */
     if ((!name || strcmp(name, switching_methods[i].name) == 0) &&
@@ -55,33 +109,481 @@ struct switching_method *switcher_detect(const char *name,
   return switcher;
 }
 
+/**
+ * (Re)opens a control file for reading and writing
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int switch_file_open(struct switch_file *file) {
+  if (file->fd != -1) {
+    close(file->fd);
+  }
+  file->fd = open(file->path, O_RDWR | O_CLOEXEC);
+  return file->fd == -1 ? -1 : 0;
+}
+
+/**
+ * Reads the contents of a control file into its buffer. The file is reopened
+ * if reading fails, as happens when the kernel module was reloaded
+ *
+ * @return The null-terminated contents, NULL on failure
+ */
+const char *switch_file_read(struct switch_file *file) {
+  int attempt;
+
+  for (attempt = 0; attempt < 2; attempt++) {
+    ssize_t r;
+
+    if ((attempt || file->fd == -1) && switch_file_open(file)) {
+      return NULL;
+    }
+    r = pread(file->fd, file->buffer, sizeof file->buffer - 1, 0);
+    if (r >= 0) {
+      file->buffer[r] = 0;
+      return file->buffer;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Writes a command to a control file, reopening it if needed like
+ * switch_file_read
+ *
+ * @return 0 on success, -1 on failure
+ */
+int switch_file_write(struct switch_file *file, const char *msg) {
+  size_t len = strlen(msg);
+  int attempt;
+
+  for (attempt = 0; attempt < 2; attempt++) {
+    if ((attempt || file->fd == -1) && switch_file_open(file)) {
+      bb_log(LOG_ERR, "Could not open %s: %s\n", file->path, strerror(errno));
+      return -1;
+    }
+    if (pwrite(file->fd, msg, len, 0) == (ssize_t) len) {
+      return 0;
+    }
+  }
+  bb_log(LOG_WARNING, "Could not write to %s: %s\n", file->path,
+          strerror(errno));
+  return -1;
+}
+
+/**
+ * Records the power state of the card, it is kept if the cache is active and
+ * the switcher does not change it by itself
+ *
+ * @param state The state that was just read from the switcher
+ * @return state
+ */
+static enum switch_state cache_set(enum switch_state state) {
+  cache.state = state;
+  cache.valid = cache.active && !switcher->autonomous;
+  return state;
+}
+
+/**
+ * Tells the caller of switch_cache_start about a change of the power state
+ *
+ * @param state The current state of the card
+ */
+static void cache_report(enum switch_state state) {
+  if (cache.changed && state != cache.reported) {
+    cache.reported = state;
+    cache.changed(state, cache.data);
+  }
+}
+
+/**
+ * Called when the status file was written to, possibly by another process
+ */
+static void cache_notified(int fd, unsigned int events, void *data) {
+  char buf[sizeof(struct inotify_event) + BBS_BUFFER];
+  (void) events;
+  (void) data;
+
+  /* the events themselves do not matter, only that something changed */
+  while (read(fd, buf, sizeof buf) > 0) {
+  }
+  cache.valid = false;
+  cache_report(switch_status());
+}
+
+/**
+ * Called periodically to read the state again, for changes that are not
+ * notified such as a card that was disabled or suspended by the kernel
+ */
+static void cache_resync(void *data) {
+  cache.valid = false;
+  cache_report(switch_status());
+  bb_timer_start(&cache.resync, switcher->autonomous ? SWITCH_WATCH_INTERVAL :
+          SWITCH_RESYNC_INTERVAL, cache_resync, data);
+}
+
+/**
+ * Starts caching the power state of the card and reporting its changes. The
+ * cache is updated by the transitions made through switch_on and switch_off
+ * and invalidated by writes to the status file of the switcher and a periodic
+ * resync. The state of a switcher that changes it by itself is always read,
+ * and read periodically to report the changes. Requires the event loop.
+ *
+ * @param changed Called with the new state when the power state has changed,
+ * may be NULL
+ * @param data Passed to changed
+ */
+void switch_cache_start(switch_callback changed, void *data) {
+  if (!switcher || cache.active) {
+    return;
+  }
+  cache.active = true;
+  cache.valid = false;
+  cache.changed = changed;
+  cache.data = data;
+  cache.reported = switch_status();
+  if (switcher->autonomous) {
+    bb_log(LOG_DEBUG, "Not caching the power state, %s changes it by"
+            " itself\n", switcher->name);
+    bb_timer_start(&cache.resync, SWITCH_WATCH_INTERVAL, cache_resync, NULL);
+    return;
+  }
+  cache.notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (cache.notify_fd == -1) {
+    bb_log(LOG_DEBUG, "Could not initialize inotify: %s\n", strerror(errno));
+  } else if (inotify_add_watch(cache.notify_fd, switcher->path,
+          IN_MODIFY) == -1 || bb_event_add(cache.notify_fd, EPOLLIN,
+          cache_notified, NULL)) {
+    bb_log(LOG_DEBUG, "Could not watch %s for changes: %s\n", switcher->path,
+            strerror(errno));
+    close(cache.notify_fd);
+    cache.notify_fd = -1;
+  }
+  bb_timer_start(&cache.resync, SWITCH_RESYNC_INTERVAL, cache_resync, NULL);
+}
+
+/**
+ * Stops caching the power state, every query reads it from the switcher again
+ */
+void switch_cache_stop(void) {
+  if (!cache.active) {
+    return;
+  }
+  bb_timer_stop(&cache.resync);
+  if (cache.notify_fd != -1) {
+    bb_event_remove(cache.notify_fd);
+    close(cache.notify_fd);
+    cache.notify_fd = -1;
+  }
+  cache.active = false;
+  cache.valid = false;
+  cache.changed = NULL;
+}
+
+/**
+ * Forgets the cached power state, for when it is known to have changed in a
+ * way that is not notified
+ */
+void switch_cache_invalidate(void) {
+  cache.valid = false;
+}
+
+/**
+ * Reports the power state of the card, from the cache if it is up to date
+ *
+ * @return SWITCH_OFF if card is off, SWITCH_ON if card is on and SWITCH_UNAVAIL
+ * if no switcher is available
+ */
 enum switch_state switch_status(void) {
   if (switcher) {
-    return switcher->status();
+    if (cache.valid) {
+      return cache.state;
+    }
+    return cache_set(switcher->status());
   }
   return SWITCH_UNAVAIL;
 }
 
-enum switch_state switch_on(void) {
-  if (switcher) {
-    if (switcher->status() == SWITCH_ON) {
-      return SWITCH_ON;
+/**
+ * Adds a sample to a running average that follows changes of the machine
+ */
+static void cost_average(long long *average, long long sample) {
+  *average = *average ? (3 * *average + sample) / 4 : sample;
+}
+
+/**
+ * Derives the minimum on and off times from the measured cost of a cycle
+ */
+static void hysteresis_update(void) {
+  struct switch_hysteresis *stats = &hysteresis.stats;
+
+  stats->cycle_cost = hysteresis.on_cost + hysteresis.off_cost +
+          hysteresis.extra_cost;
+  stats->off_dwell = SWITCH_DWELL_RATIO * stats->cycle_cost;
+  stats->on_dwell = hysteresis.factor * stats->off_dwell;
+  if (stats->on_dwell > SWITCH_DWELL_MAX) {
+    stats->on_dwell = SWITCH_DWELL_MAX;
+  }
+}
+
+/**
+ * Accounts a completed power transition. A power on soon after a power off
+ * makes the card stay on longer next time, long off periods relax it again.
+ */
+static void hysteresis_transition(enum switch_state state, long long duration) {
+  long long now = bb_event_now();
+  struct switch_hysteresis *stats = &hysteresis.stats;
+
+  if (state == SWITCH_ON) {
+    cost_average(&hysteresis.on_cost, duration);
+    hysteresis.on_since = now;
+    if (hysteresis.off_since && now - hysteresis.off_since < stats->off_dwell) {
+      stats->thrashes++;
+      if (hysteresis.factor < SWITCH_DWELL_FACTOR_MAX) {
+        hysteresis.factor *= 2;
+      }
+      bb_log(LOG_DEBUG, "Card was powered on %lli ms after power off, keeping"
+              " it on for at least %i times the cycle cost\n",
+              now - hysteresis.off_since, hysteresis.factor * SWITCH_DWELL_RATIO);
+    } else if (hysteresis.off_since && hysteresis.factor > 1 &&
+            now - hysteresis.off_since > 4 * stats->on_dwell) {
+      hysteresis.factor /= 2;
     }
+  } else {
+    cost_average(&hysteresis.off_cost, duration);
+    hysteresis.on_since = 0;
+    hysteresis.off_since = now;
+    stats->cycles++;
+  }
+  hysteresis_update();
+}
+
+/**
+ * Returns the time in ms the card should still be kept on before it is powered
+ * off, 0 if it may be powered off now
+ */
+long long switch_hold_on(void) {
+  long long left;
+
+  if (!hysteresis.on_since) {
+    return 0;
+  }
+  left = hysteresis.on_since + hysteresis.stats.on_dwell - bb_event_now();
+  return left > 0 ? left : 0;
+}
+
+/**
+ * Returns the time in ms the card should still stay off before it is powered
+ * on without an application needing it, 0 if it may be powered on now
+ */
+long long switch_hold_off(void) {
+  long long left;
+
+  if (hysteresis.on_since || !hysteresis.off_since) {
+    return 0;
+  }
+  left = hysteresis.off_since + hysteresis.stats.off_dwell - bb_event_now();
+  return left > 0 ? left : 0;
+}
+
+/**
+ * Reports the cost of a power cycle besides the transitions themselves, such
+ * as unloading and loading the driver
+ * @param cost The cost in ms as measured by the caller
+ */
+void switch_cycle_extra(long long cost) {
+  cost_average(&hysteresis.extra_cost, cost);
+  hysteresis_update();
+}
+
+/**
+ * Counts a power cycle that was avoided because the card was needed again
+ * while it was kept on for the minimum on time
+ */
+void switch_cycle_suppressed(void) {
+  hysteresis.stats.suppressed++;
+  hysteresis.stats.saved += hysteresis.stats.cycle_cost;
+}
+
+/**
+ * Returns the minimum on and off times and the counters of the hysteresis
+ */
+void switch_hysteresis_stats(struct switch_hysteresis *stats) {
+  *stats = hysteresis.stats;
+}
+
+static void transition_poll(void *data);
+
+/**
+ * Writes the requested state to the switcher and starts checking for the
+ * card to reach it
+ */
+static void transition_start(enum switch_state target) {
+  transition.active = true;
+  transition.target = target;
+  transition.interval = SWITCH_POLL_MIN;
+  if (target == SWITCH_ON) {
     bb_log(LOG_INFO, "Switching dedicated card ON [%s]\n", switcher->name);
     switcher->on();
-    return switcher->status();
+  } else {
+    bb_log(LOG_INFO, "Switching dedicated card OFF [%s]\n", switcher->name);
+    if (switcher->need_driver_unloaded) {
+      domain_release();
+    }
+    switcher->off();
   }
-  return SWITCH_UNAVAIL;
+  transition.begin = bb_event_now();
+  transition.deadline = transition.begin + SWITCH_TRANSITION_TIMEOUT;
+  transition_poll(NULL);
 }
 
-enum switch_state switch_off(void) {
-  if (switcher) {
-    if (switcher->status() == SWITCH_OFF) {
-      return SWITCH_OFF;
+/**
+ * Ends the transition in progress, notifying the callers that waited for it
+ * and starting the transition that waits behind it, if any
+ * @param state The state the card has reached
+ */
+static void transition_complete(enum switch_state state) {
+  struct switch_waiter done[SWITCH_WAITERS_MAX];
+  int i, done_count = 0, count = 0;
+
+  bb_timer_stop(&transition.poll);
+  transition.active = false;
+  if (state == transition.target) {
+    hysteresis_transition(state, bb_event_now() - transition.begin);
+  }
+  if (state == SWITCH_ON) {
+    domain_restore();
+  }
+  cache_report(state);
+  /* the callbacks may request transitions, take the waiters out first */
+  for (i = 0; i < transition.waiter_count; i++) {
+    if (transition.waiters[i].target == transition.target) {
+      done[done_count++] = transition.waiters[i];
+    } else {
+      transition.waiters[count++] = transition.waiters[i];
     }
-    bb_log(LOG_INFO, "Switching dedicated card OFF [%s]\n", switcher->name);
-    switcher->off();
-    return switcher->status();
   }
-  return SWITCH_UNAVAIL;
+  transition.waiter_count = count;
+  for (i = 0; i < done_count; i++) {
+    done[i].callback(state, done[i].data);
+  }
+  if (!transition.active && transition.waiter_count) {
+    transition_start(transition.waiters[0].target);
+  }
+}
+
+/**
+ * Timer handler that checks whether the card has reached the requested
+ * state, backing off while it has not
+ */
+static void transition_poll(void *data) {
+  enum switch_state state = cache_set(switcher->status());
+  (void) data;
+
+  if (state == transition.target) {
+    transition_complete(state);
+    return;
+  }
+  if (bb_event_now() >= transition.deadline) {
+    bb_log(LOG_WARNING, "Dedicated card did not switch %s in %i ms\n",
+            transition.target == SWITCH_ON ? "ON" : "OFF",
+            SWITCH_TRANSITION_TIMEOUT);
+    transition_complete(state);
+    return;
+  }
+  bb_timer_start(&transition.poll, transition.interval, transition_poll, NULL);
+  transition.interval *= 2;
+  if (transition.interval > SWITCH_POLL_MAX) {
+    transition.interval = SWITCH_POLL_MAX;
+  }
+}
+
+/**
+ * Requests the card to be switched on or off without blocking. A transition
+ * in the other direction that is in progress is completed first.
+ *
+ * @param target SWITCH_ON or SWITCH_OFF
+ * @param callback Called when the transition has completed or failed, right
+ * away if the card is in the requested state already
+ * @param data Passed to callback
+ */
+void switch_request(enum switch_state target, switch_callback callback,
+        void *data) {
+  struct switch_waiter *waiter;
+
+  if (!switcher) {
+    callback(SWITCH_UNAVAIL, data);
+    return;
+  }
+  if (!transition.active && switch_status() == target) {
+    callback(target, data);
+    return;
+  }
+  if (transition.waiter_count == SWITCH_WAITERS_MAX) {
+    bb_log(LOG_ERR, "Too many pending power transitions\n");
+    callback(switch_status(), data);
+    return;
+  }
+  waiter = &transition.waiters[transition.waiter_count++];
+  waiter->target = target;
+  waiter->callback = callback;
+  waiter->data = data;
+  if (!transition.active) {
+    transition_start(target);
+  }
+}
+
+/**
+ * Stops waiting for a transition requested with switch_request. The
+ * transition itself cannot be undone and continues.
+ */
+void switch_cancel(switch_callback callback, void *data) {
+  int i, count = 0;
+
+  for (i = 0; i < transition.waiter_count; i++) {
+    struct switch_waiter *waiter = &transition.waiters[i];
+    if (waiter->callback != callback || waiter->data != data) {
+      transition.waiters[count++] = *waiter;
+    }
+  }
+  transition.waiter_count = count;
+}
+
+/**
+ * Callback for the blocking transitions, stores the reached state
+ */
+static void switch_sync_done(enum switch_state state, void *data) {
+  *(enum switch_state *)data = state;
+}
+
+/**
+ * Switches the card and waits for the transition to complete, checking the
+ * state at the same intervals as the event loop would
+ */
+static enum switch_state switch_sync(enum switch_state target) {
+  enum switch_state state = SWITCH_UNAVAIL;
+
+  switch_request(target, switch_sync_done, &state);
+  while (transition.active) {
+    long long wait = transition.poll.expires - bb_event_now();
+    if (wait > 0) {
+      usleep(wait * 1000);
+    }
+    bb_timer_stop(&transition.poll);
+    transition_poll(NULL);
+  }
+  return state;
+}
+
+/**
+ * Switches the card on, blocking until it is on or the transition failed
+ */
+enum switch_state switch_on(void) {
+  return switch_sync(SWITCH_ON);
+}
+
+/**
+ * Switches the card off, blocking until it is off or the transition failed
+ */
+enum switch_state switch_off(void) {
+  return switch_sync(SWITCH_OFF);
 }
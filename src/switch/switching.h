@@ -20,9 +20,49 @@
 
 
 #pragma once
+#include "../pci.h"
 
 /* Buffer size for result from reading files for switching methods */
-#define BBS_BUFFER 100
+#define BBS_BUFFER 512
+
+/* Files through which the switching methods control the card */
+#define BBSWITCH_PATH PCI_ROOT "/proc/acpi/bbswitch"
+#define SWITCHEROO_PATH PCI_ROOT "/sys/kernel/debug/vgaswitcheroo/switch"
+
+/* Maximum number of PCI functions in the power domains of all cards */
+#define DOMAIN_FUNCTIONS_MAX 32
+
+/* Delay in ms after which the kernel suspends an idle card with runtime power
+ * management. The daemon already keeps the card on against power cycling, so
+ * the (usually several seconds long) default of the driver only wastes power */
+#define RUNTIMEPM_AUTOSUSPEND_DELAY 100
+
+/* Interval in ms at which the cached power state is read again, to catch
+ * changes that are not notified (e.g. by the kernel itself) */
+#define SWITCH_RESYNC_INTERVAL 60000
+
+/* Interval in ms at which the state of a switcher that changes it by itself is
+ * read, to report the changes made by the kernel */
+#define SWITCH_WATCH_INTERVAL 1000
+
+/* Time in ms a power transition may take before it is considered failed */
+#define SWITCH_TRANSITION_TIMEOUT 5000
+
+/* First and largest interval in ms between checks whether a power transition
+ * has completed, the interval doubles after every check */
+#define SWITCH_POLL_MIN 5
+#define SWITCH_POLL_MAX 250
+
+/* Maximum number of callers waiting for power transitions at the same time */
+#define SWITCH_WAITERS_MAX 16
+
+/* The minimum time the card stays on (and off) is this many times the cost of
+ * a power cycle, the on time is multiplied further while the card thrashes */
+#define SWITCH_DWELL_RATIO 5
+/* Upper bound for the multiplier of the minimum on time */
+#define SWITCH_DWELL_FACTOR_MAX 16
+/* Upper bound in ms for the minimum on time */
+#define SWITCH_DWELL_MAX 600000
 
 enum switch_state {
   SWITCH_ON = 1,
@@ -30,10 +70,37 @@ enum switch_state {
   SWITCH_UNAVAIL = -1
 };
 
+/* A control file of a switching method, opened on first use and kept open
+ * such that power transitions and status reads need a single system call */
+struct switch_file {
+  const char *path;
+  int fd; /* -1 if not opened yet or if it could not be opened */
+  char buffer[BBS_BUFFER]; /* contents as of the last switch_file_read */
+};
+
+/* Called when a power transition requested with switch_request has completed
+ * or failed. state is the state the card reached, SWITCH_UNAVAIL if there is
+ * no switching method. */
+typedef void (*switch_callback)(enum switch_state state, void *data);
+
+/* State and counters of the hysteresis against power cycling the card */
+struct switch_hysteresis {
+  long long cycle_cost; /* ms a power off and on again costs on this machine */
+  long long on_dwell; /* minimum ms the card stays on before a power off */
+  long long off_dwell; /* minimum ms the card stays off before a speculative
+                        * power on, a shorter off period is a thrash */
+  unsigned int cycles; /* number of times the card was powered off */
+  unsigned int thrashes; /* power ons within off_dwell of the power off */
+  unsigned int suppressed; /* power offs skipped because of on_dwell */
+  long long saved; /* estimated ms saved by the skipped cycles */
+};
+
 /* information that could be useful for use in is_available */
 struct switch_info {
   char *driver; /* possible values are nouveau and nvidia */
   const char *configured_pm; /* configured PM method, NOT the detected one */
+  struct pci_bus_id **cards; /* the discrete cards */
+  int card_count;
 };
 
 struct switching_method {
@@ -46,6 +113,9 @@ struct switching_method {
                                             * 0 otherwise */
   void (*on)(void); /* attempts to enable a card */
   void (*off)(void); /* attempts to disable a card */
+  char *path; /* file reporting the status, watched for external changes */
+  int autonomous; /* 1 if the kernel changes the state without path being
+                   * written, such that the state cannot be cached */
 };
 
 enum switch_state bbswitch_status(void);
@@ -58,14 +128,41 @@ int switcheroo_is_available(struct switch_info);
 void switcheroo_on(void);
 void switcheroo_off(void);
 
+/* power/control file of the first card, set by runtimepm_is_available */
+extern char runtimepm_path[];
+enum switch_state runtimepm_status(void);
+int runtimepm_is_available(struct switch_info);
+void runtimepm_on(void);
+void runtimepm_off(void);
+
 /* number of switchers as defined in switching.c */
-#define SWITCHERS_COUNT 2
+#define SWITCHERS_COUNT 3
 struct switching_method switching_methods[SWITCHERS_COUNT];
 
 /* A switching method that can be used or NULL if none */
 struct switching_method *switcher;
 
+int domain_init(struct pci_bus_id **cards, int card_count);
+int domain_count(void);
+struct pci_bus_id *domain_function(int index);
+int domain_is_card(int index);
+void domain_release(void);
+void domain_restore(void);
+
 struct switching_method *switcher_detect(const char *name, struct switch_info);
+const char *switch_file_read(struct switch_file *file);
+int switch_file_write(struct switch_file *file, const char *msg);
 enum switch_state switch_status(void);
 enum switch_state switch_on(void);
 enum switch_state switch_off(void);
+void switch_request(enum switch_state target, switch_callback callback,
+        void *data);
+void switch_cancel(switch_callback callback, void *data);
+long long switch_hold_on(void);
+long long switch_hold_off(void);
+void switch_cycle_extra(long long cost);
+void switch_cycle_suppressed(void);
+void switch_hysteresis_stats(struct switch_hysteresis *stats);
+void switch_cache_start(switch_callback changed, void *data);
+void switch_cache_stop(void);
+void switch_cache_invalidate(void);
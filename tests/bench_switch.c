@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * bench_switch.c: counts the system calls of status reads and power
+ * transitions of the bbswitch and vga_switcheroo backends. Regular files in
+ * the fake tree stand in for the control files. The calls are made by a child
+ * that is traced by the benchmark, getppid calls mark the start and end of
+ * each measured loop. Built by make check but not run as a test:
+ *   tests/bench_switch [calls]
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+#include "test.h"
+#include "../src/switch/switching.h"
+#include "../src/module.h"
+
+/* Number of calls per measured loop if not given */
+#define BENCH_CALLS 1000
+
+static const char *bench_names[] = {
+  "bbswitch status",
+  "bbswitch transition",
+  "switcheroo status",
+  "switcheroo transition",
+};
+#define BENCH_COUNT (int) (sizeof bench_names / sizeof *bench_names)
+
+/**
+ * Replaces module_load, the benchmark never loads bbswitch
+ */
+int module_load(char *module_name, char *driver) {
+  (void) module_name;
+  (void) driver;
+  return 0;
+}
+
+/**
+ * Makes the calls that are measured, every loop is preceded by a getppid
+ */
+static void bench_child(int calls) {
+  int i;
+
+  if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+    _exit(TEST_SKIP);
+  }
+  raise(SIGSTOP);
+  /* the control files are opened on first use, which is not measured */
+  bbswitch_status();
+  switcheroo_status();
+
+  getppid();
+  for (i = 0; i < calls; i++) {
+    bbswitch_status();
+  }
+  getppid();
+  for (i = 0; i < calls; i++) {
+    bbswitch_off();
+    bbswitch_on();
+  }
+  getppid();
+  for (i = 0; i < calls; i++) {
+    switcheroo_status();
+  }
+  getppid();
+  for (i = 0; i < calls; i++) {
+    switcheroo_off();
+    switcheroo_on();
+  }
+  getppid();
+  _exit(0);
+}
+
+/**
+ * Traces the child and counts the system calls it enters in every loop
+ * @return 0 on success, TEST_SKIP if system calls cannot be traced
+ */
+static int bench_trace(pid_t child, long *counts) {
+  int status, loop = -1;
+
+  if (waitpid(child, &status, 0) != child || !WIFSTOPPED(status) ||
+          ptrace(PTRACE_SETOPTIONS, child, NULL, PTRACE_O_TRACESYSGOOD |
+          PTRACE_O_EXITKILL) == -1) {
+    return TEST_SKIP;
+  }
+  while (ptrace(PTRACE_SYSCALL, child, NULL, NULL) == 0 &&
+          waitpid(child, &status, 0) == child && WIFSTOPPED(status)) {
+    struct ptrace_syscall_info info;
+
+    if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+      continue;
+    }
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, child, sizeof info, &info) <= 0) {
+      kill(child, SIGKILL);
+      return TEST_SKIP;
+    }
+    if (info.op != PTRACE_SYSCALL_INFO_ENTRY) {
+      continue;
+    }
+    if (info.entry.nr == SYS_getppid) {
+      loop++;
+    } else if (loop >= 0 && loop < BENCH_COUNT) {
+      counts[loop]++;
+    }
+  }
+  waitpid(child, &status, 0);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  long counts[BENCH_COUNT] = {0};
+  int i, result, calls = argc > 1 ? atoi(argv[1]) : BENCH_CALLS;
+  pid_t child;
+
+  if (calls < 1) {
+    fprintf(stderr, "Usage: %s [calls]\n", argv[0]);
+    return 1;
+  }
+  fake_tree_create();
+  fake_write(BBSWITCH_PATH, "0000:01:00.0 ON\n");
+  fake_write(SWITCHEROO_PATH, "0:IGD:+:Pwr:0000:00:02.0\n"
+          "1:DIS: :Pwr:0000:01:00.0\n1:DIS-Audio: :Pwr:0000:01:00.1\n");
+
+  child = fork();
+  if (child == 0) {
+    bench_child(calls);
+  }
+  result = child == -1 ? TEST_SKIP : bench_trace(child, counts);
+  if (result) {
+    fprintf(stderr, "Cannot trace system calls: %s\n", strerror(errno));
+  }
+  fake_tree_remove();
+  if (result) {
+    return result;
+  }
+  printf("%-24s %8s %14s\n", "", "calls", "syscalls/call");
+  for (i = 0; i < BENCH_COUNT; i++) {
+    /* a transition loop makes a power off and a power on per iteration */
+    int made = strstr(bench_names[i], "transition") ? 2 * calls : calls;
+
+    printf("%-24s %8i %14.2f\n", bench_names[i], made,
+            (double) counts[i] / made);
+  }
+  return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test.c: checks and fake sysfs trees for the tests
+ */
+
+#define _XOPEN_SOURCE 700
+#include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "test.h"
+#include "../src/bblogger.h"
+#include "../src/pci.h"
+
+/* Number of failed checks */
+int test_failures;
+
+/**
+ * Replaces bb_log of the daemon, messages are only shown if TEST_VERBOSE is
+ * set in the environment
+ */
+void bb_log(int priority, char *msg_format, ...) {
+  va_list args;
+
+  if (!getenv("TEST_VERBOSE")) {
+    return;
+  }
+  fprintf(stderr, "[%i] ", priority);
+  va_start(args, msg_format);
+  vfprintf(stderr, msg_format, args);
+  va_end(args);
+}
+
+/**
+ * @return The exit status of the test, non-zero if any check failed
+ */
+int test_result(void) {
+  if (test_failures) {
+    fprintf(stderr, "%i checks failed\n", test_failures);
+    return 1;
+  }
+  return 0;
+}
+
+static int fake_tree_unlink(const char *path, const struct stat *sb,
+        int type, struct FTW *ftw) {
+  (void) sb; (void) type; (void) ftw;
+  return remove(path);
+}
+
+/**
+ * Removes the fake tree of the test if it exists
+ */
+void fake_tree_remove(void) {
+  nftw(PCI_ROOT, fake_tree_unlink, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Creates an empty fake tree for the test, replacing any leftover of an
+ * earlier run
+ */
+void fake_tree_create(void) {
+  fake_tree_remove();
+  mkdir(PCI_ROOT, 0755);
+}
+
+/**
+ * Creates the parent directories of a path
+ */
+static void fake_parents(const char *path) {
+  char dir[1024];
+  char *slash;
+
+  snprintf(dir, sizeof dir, "%s", path);
+  for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = 0;
+    mkdir(dir, 0755);
+    *slash = '/';
+  }
+}
+
+/**
+ * Writes a file of the fake tree, replacing its contents
+ * @param path The path of the file, including PCI_ROOT
+ * @param data The contents
+ * @param len The length of data
+ * @return 0 on success, -1 on failure
+ */
+int fake_write_data(const char *path, const void *data, size_t len) {
+  int fd;
+  ssize_t r;
+
+  fake_parents(path);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "cannot create %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  r = write(fd, data, len);
+  close(fd);
+  return r == (ssize_t) len ? 0 : -1;
+}
+
+/**
+ * Writes a formatted string to a file of the fake tree
+ * @return 0 on success, -1 on failure
+ */
+int fake_write(const char *path, const char *format, ...) {
+  char buf[4096];
+  va_list args;
+  int len;
+
+  va_start(args, format);
+  len = vsnprintf(buf, sizeof buf, format, args);
+  va_end(args);
+  return fake_write_data(path, buf, len);
+}
+
+/**
+ * Reads a file of the fake tree
+ * @param buf The buffer receiving the null-terminated contents
+ * @return buf, NULL if the file could not be read
+ */
+char *fake_read(const char *path, char *buf, size_t len) {
+  ssize_t r;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1) {
+    return NULL;
+  }
+  r = read(fd, buf, len - 1);
+  close(fd);
+  buf[r > 0 ? r : 0] = 0;
+  return r >= 0 ? buf : NULL;
+}
+
+/**
+ * Creates a symbolic link in the fake tree, replacing an existing one
+ * @return 0 on success, -1 on failure
+ */
+int fake_symlink(const char *target, const char *path) {
+  fake_parents(path);
+  unlink(path);
+  return symlink(target, path);
+}
+
+/**
+ * Adds a device to the fake sysfs with the uevent attribute the inventory is
+ * built from and a link to its driver
+ * @param name The name of the device, e.g. 0000:01:00.0
+ * @param vendor The vendor ID
+ * @param device The device ID
+ * @param class The class, subclass and programming interface
+ * @param driver The bound driver, NULL if none is bound
+ * @return 0 on success, -1 on failure
+ */
+int fake_pci_device(const char *name, unsigned int vendor,
+        unsigned int device, unsigned int class, const char *driver) {
+  char path[1024], target[256];
+
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/%s/uevent", name);
+  if (fake_write(path, "%s%s%sPCI_CLASS=%X\nPCI_ID=%04X:%04X\n"
+          "PCI_SLOT_NAME=%s\n", driver ? "DRIVER=" : "",
+          driver ? driver : "", driver ? "\n" : "", class, vendor, device,
+          name)) {
+    return -1;
+  }
+  if (!driver) {
+    return 0;
+  }
+  snprintf(path, sizeof path, PCI_ROOT "/sys/bus/pci/drivers/%s/bind", driver);
+  fake_write(path, "%s", "");
+  snprintf(path, sizeof path, PCI_ROOT "/sys/bus/pci/drivers/%s/unbind",
+          driver);
+  fake_write(path, "%s", "");
+  snprintf(path, sizeof path, PCI_DEVICES_PATH "/%s/driver", name);
+  snprintf(target, sizeof target, "../../drivers/%s", driver);
+  return fake_symlink(target, path);
+}
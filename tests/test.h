@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test.h: checks and fake sysfs trees for the tests. Each test is built with
+ * PCI_ROOT pointing to its own tree below the build directory
+ */
+
+#pragma once
+#include <stdio.h>
+#include <string.h>
+
+/* Exit status of a test that cannot run here, see the automake manual */
+#define TEST_SKIP 77
+
+extern int test_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, \
+              #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_INT(actual, expected) do { \
+    long long a_ = (actual), e_ = (expected); \
+    if (a_ != e_) { \
+      fprintf(stderr, "%s:%i: %s is %lli, expected %lli\n", __FILE__, \
+              __LINE__, #actual, a_, e_); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_STR(actual, expected) do { \
+    const char *a_ = (actual), *e_ = (expected); \
+    if (!a_ || strcmp(a_, e_)) { \
+      fprintf(stderr, "%s:%i: %s is \"%s\", expected \"%s\"\n", __FILE__, \
+              __LINE__, #actual, a_ ? a_ : "(null)", e_); \
+      test_failures++; \
+    } \
+  } while (0)
+
+int test_result(void);
+
+void fake_tree_create(void);
+void fake_tree_remove(void);
+int fake_write(const char *path, const char *format, ...)
+        __attribute__((format(printf, 2, 3)));
+int fake_write_data(const char *path, const void *data, size_t len);
+char *fake_read(const char *path, char *buf, size_t len);
+int fake_symlink(const char *target, const char *path);
+int fake_pci_device(const char *name, unsigned int vendor,
+        unsigned int device, unsigned int class, const char *driver);
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_config.c: the PCI configuration space is split in ranges and restored
+ * with coalesced writes, for a 256 byte space and a 4 KiB one with a chain of
+ * capabilities and extended capabilities
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "test.h"
+#include "../src/pci.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+
+/* The writes to the configuration space, recorded by pwrite below */
+static struct {
+  int offset;
+  int len;
+} writes[64];
+static int write_count;
+
+/**
+ * Replaces pwrite of the C library to record the writes of
+ * pci_config_restore. Off_t is 64 bits wide on LP64 only, elsewhere the
+ * daemon calls pwrite64 and the writes are not recorded
+ */
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if (write_count < (int) (sizeof writes / sizeof *writes)) {
+    writes[write_count].offset = offset;
+    writes[write_count].len = count;
+  }
+  write_count++;
+  return syscall(SYS_pwrite64, fd, buf, count, offset);
+}
+
+/**
+ * Stores a little-endian dword
+ */
+static void put_dword(uint8_t *config, int offset, uint32_t value) {
+  config[offset] = value;
+  config[offset + 1] = value >> 8;
+  config[offset + 2] = value >> 16;
+  config[offset + 3] = value >> 24;
+}
+
+/**
+ * Builds a configuration space with device specific registers at 0x40 and the
+ * capabilities power management at 0x60, MSI at 0x68 and PCI Express at
+ * 0x78. A 4 KiB space has the extended capabilities AER at 0x100, a
+ * vendor specific one at 0x140 and LTR at 0x200
+ */
+static void fake_space(uint8_t *config, int size) {
+  int i;
+
+  for (i = 0; i < size; i++) {
+    config[i] = i * 7 + 1;
+  }
+  put_dword(config, 0, PCI_VENDOR_ID_NVIDIA | 0x1c8d << 16);
+  config[PCI_STATUS] = PCI_STATUS_CAP_LIST;
+  config[PCI_CAPABILITY_LIST] = 0x60;
+  config[0x60] = 0x01;
+  config[0x61] = 0x68;
+  config[0x68] = PCI_CAP_ID_MSI;
+  config[0x69] = 0x78;
+  config[0x78] = PCI_CAP_ID_EXP;
+  config[0x79] = 0;
+  if (size <= PCI_CONFIG_SIZE) {
+    return;
+  }
+  /* ID, version 1 and the offset of the next capability */
+  put_dword(config, 0x100, 0x0001 | 1 << 16 | 0x140 << 20);
+  put_dword(config, 0x140, 0x000b | 1 << 16 | 0x200 << 20);
+  put_dword(config, 0x200, 0x0018 | 1 << 16);
+}
+
+#define CHECK_RANGE(range, s, e, o) do { \
+    CHECK_INT((range).start, s); \
+    CHECK_INT((range).end, e); \
+    CHECK_INT((range).order, o); \
+  } while (0)
+
+static void test_ranges(void) {
+  struct pci_config_range ranges[PCI_CONFIG_RANGES_MAX];
+  uint8_t config[PCI_CONFIG_EXT_SIZE];
+
+  /* PCI Express, other capabilities, header, command register, MSI */
+  fake_space(config, PCI_CONFIG_SIZE);
+  CHECK_INT(pci_config_ranges(config, PCI_CONFIG_SIZE, ranges), 6);
+  CHECK_RANGE(ranges[0], 0x78, 0x100, 0);
+  CHECK_RANGE(ranges[1], 0x40, 0x60, 2);
+  CHECK_RANGE(ranges[2], 0x60, 0x68, 2);
+  CHECK_RANGE(ranges[3], PCI_CONFIG_BARS, PCI_CONFIG_HEADER, 3);
+  CHECK_RANGE(ranges[4], 0, PCI_CONFIG_BARS, 4);
+  CHECK_RANGE(ranges[5], 0x68, 0x78, 5);
+
+  /* the extended capabilities right after PCI Express */
+  fake_space(config, PCI_CONFIG_EXT_SIZE);
+  CHECK_INT(pci_config_ranges(config, PCI_CONFIG_EXT_SIZE, ranges), 9);
+  CHECK_RANGE(ranges[0], 0x78, 0x100, 0);
+  CHECK_RANGE(ranges[1], 0x100, 0x140, 1);
+  CHECK_RANGE(ranges[2], 0x140, 0x200, 1);
+  CHECK_RANGE(ranges[3], 0x200, PCI_CONFIG_EXT_SIZE, 1);
+  CHECK_RANGE(ranges[4], 0x40, 0x60, 2);
+  CHECK_RANGE(ranges[5], 0x60, 0x68, 2);
+  CHECK_RANGE(ranges[6], PCI_CONFIG_BARS, PCI_CONFIG_HEADER, 3);
+  CHECK_RANGE(ranges[7], 0, PCI_CONFIG_BARS, 4);
+  CHECK_RANGE(ranges[8], 0x68, 0x78, 5);
+
+  /* a capability right after the header leaves no device specific range */
+  fake_space(config, PCI_CONFIG_SIZE);
+  config[PCI_CAPABILITY_LIST] = 0x40;
+  config[0x40] = 0x09;
+  config[0x41] = 0x60;
+  CHECK_INT(pci_config_ranges(config, PCI_CONFIG_SIZE, ranges), 6);
+  CHECK_RANGE(ranges[1], 0x40, 0x60, 2);
+  CHECK_RANGE(ranges[2], 0x60, 0x68, 2);
+
+  /* the header only, without the capability list */
+  config[PCI_STATUS] = 0;
+  CHECK_INT(pci_config_ranges(config, PCI_CONFIG_SIZE, ranges), 3);
+  CHECK_RANGE(ranges[1], PCI_CONFIG_BARS, PCI_CONFIG_HEADER, 3);
+  CHECK_INT(pci_config_ranges(config, PCI_CONFIG_HEADER, ranges), 2);
+}
+
+/**
+ * Checks that the configuration space of the card holds the expected bytes
+ */
+static void check_space(const uint8_t *expected, int size) {
+  uint8_t config[PCI_CONFIG_EXT_SIZE];
+  int fd = open(CARD "/config", O_RDONLY);
+
+  CHECK_INT(read(fd, config, sizeof config), size);
+  close(fd);
+  CHECK(memcmp(config, expected, size) == 0);
+}
+
+#define CHECK_WRITE(index, o, l) do { \
+    CHECK_INT(writes[index].offset, o); \
+    CHECK_INT(writes[index].len, l); \
+  } while (0)
+
+static void test_restore(void) {
+  static struct pci_config_state pcs;
+  struct pci_bus_id card = {0, 1, 0, 0};
+  uint8_t config[PCI_CONFIG_EXT_SIZE], lost[PCI_CONFIG_EXT_SIZE];
+
+  fake_space(config, PCI_CONFIG_EXT_SIZE);
+  fake_write_data(CARD "/config", config, sizeof config);
+  CHECK_INT(pci_config_save(&card, &pcs), 0);
+  CHECK_INT(pcs.state_saved, 1);
+  CHECK_INT(pcs.size, PCI_CONFIG_EXT_SIZE);
+
+  /* nothing changed, nothing is written */
+  write_count = 0;
+  CHECK_INT(pci_config_restore(&card, &pcs), 0);
+  CHECK_INT(write_count, 0);
+  CHECK_INT(pcs.state_saved, 0);
+
+  memcpy(lost, config, sizeof lost);
+  lost[0x04] ^= 0x07; /* command register */
+  memset(lost + PCI_CONFIG_BARS, 0, 16); /* four BARs */
+  lost[0x6c] ^= 0xff; /* MSI address */
+  lost[0x80] ^= 0xff; /* PCI Express, one unchanged dword in between */
+  lost[0x88] ^= 0xff;
+  lost[0x104] ^= 0xff; /* AER, two unchanged dwords in between */
+  lost[0x110] ^= 0xff;
+  fake_write_data(CARD "/config", lost, sizeof lost);
+  CHECK_INT(pci_config_save(&card, &pcs), 0);
+  memcpy(pcs.config, config, sizeof config);
+
+  write_count = 0;
+  CHECK_INT(pci_config_restore(&card, &pcs), 0);
+  check_space(config, PCI_CONFIG_EXT_SIZE);
+  CHECK_INT(write_count, 6);
+  CHECK_WRITE(0, 0x80, 12);
+  CHECK_WRITE(1, 0x104, 4);
+  CHECK_WRITE(2, 0x110, 4);
+  CHECK_WRITE(3, PCI_CONFIG_BARS, 16);
+  CHECK_WRITE(4, 0x04, 4);
+  CHECK_WRITE(5, 0x6c, 4);
+
+  /* a 256 byte space, as read without the extended space */
+  fake_space(config, PCI_CONFIG_SIZE);
+  fake_write_data(CARD "/config", config, PCI_CONFIG_SIZE);
+  CHECK_INT(pci_config_save(&card, &pcs), 0);
+  CHECK_INT(pcs.size, PCI_CONFIG_SIZE);
+  memcpy(lost, config, PCI_CONFIG_SIZE);
+  memset(lost + PCI_CONFIG_BARS, 0, 8);
+  lost[0x44] ^= 0xff;
+  fake_write_data(CARD "/config", lost, PCI_CONFIG_SIZE);
+  write_count = 0;
+  CHECK_INT(pci_config_restore(&card, &pcs), 0);
+  check_space(config, PCI_CONFIG_SIZE);
+  CHECK_INT(write_count, 2);
+  CHECK_WRITE(0, 0x44, 4);
+  CHECK_WRITE(1, PCI_CONFIG_BARS, 8);
+
+  /* a disabled card reads as all ones and is left alone */
+  memset(lost, 0xff, PCI_CONFIG_SIZE);
+  fake_write_data(CARD "/config", lost, PCI_CONFIG_SIZE);
+  pcs.state_saved = 1;
+  write_count = 0;
+  CHECK(pci_config_restore(&card, &pcs) != 0);
+  CHECK_INT(write_count, 0);
+}
+
+int main(void) {
+  fake_tree_create();
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nvidia");
+
+  test_ranges();
+#ifdef __LP64__
+  test_restore();
+#endif
+
+  fake_tree_remove();
+  return test_result();
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_domain.c: the power domain of a card with its HDMI audio function in a
+ * fake sysfs tree, released and restored around a power cut
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "test.h"
+#include "../src/pci.h"
+#include "../src/switch/switching.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+#define AUDIO PCI_DEVICES_PATH "/0000:01:00.1"
+#define DRIVERS PCI_ROOT "/sys/bus/pci/drivers"
+
+/**
+ * Writes a configuration space with a distinct pattern per function
+ */
+static void fake_config(const char *dir, int seed, uint8_t *config) {
+  char path[256];
+  int i;
+
+  for (i = 0; i < PCI_CONFIG_SIZE; i++) {
+    config[i] = seed + i;
+  }
+  /* a valid vendor and no capabilities */
+  config[0] = 0xde;
+  config[1] = 0x10;
+  config[PCI_STATUS] = 0;
+  snprintf(path, sizeof path, "%s/config", dir);
+  fake_write_data(path, config, PCI_CONFIG_SIZE);
+}
+
+/**
+ * Checks that a configuration space in the fake tree holds the expected bytes
+ */
+static void check_config(const char *dir, const uint8_t *expected) {
+  uint8_t config[PCI_CONFIG_SIZE];
+  char path[256];
+  int fd;
+
+  snprintf(path, sizeof path, "%s/config", dir);
+  fd = open(path, O_RDONLY);
+  CHECK_INT(read(fd, config, sizeof config), PCI_CONFIG_SIZE);
+  close(fd);
+  CHECK(memcmp(config, expected, PCI_CONFIG_SIZE) == 0);
+}
+
+/**
+ * Loses the state of a function like a power cut does, the BARs and the
+ * device specific registers are cleared
+ */
+static void fake_power_cut(const char *dir, const uint8_t *config) {
+  uint8_t lost[PCI_CONFIG_SIZE];
+  char path[256];
+
+  memcpy(lost, config, sizeof lost);
+  memset(lost + PCI_CONFIG_BARS, 0, PCI_CONFIG_SIZE - PCI_CONFIG_BARS);
+  snprintf(path, sizeof path, "%s/config", dir);
+  fake_write_data(path, lost, sizeof lost);
+}
+
+static void test_init(struct pci_bus_id *card) {
+  CHECK_INT(domain_init(&card, 1), 2);
+  CHECK_INT(domain_count(), 2);
+  CHECK(domain_function(0)->bus == 1 && domain_function(0)->slot == 0 &&
+          domain_function(0)->func == 0);
+  CHECK(domain_function(1)->bus == 1 && domain_function(1)->slot == 0 &&
+          domain_function(1)->func == 1);
+  CHECK_INT(domain_is_card(0), 1);
+  CHECK_INT(domain_is_card(1), 0);
+}
+
+static void test_release_restore(void) {
+  uint8_t card_config[PCI_CONFIG_SIZE], audio_config[PCI_CONFIG_SIZE];
+  char buf[64];
+
+  fake_config(CARD, 0x20, card_config);
+  fake_config(AUDIO, 0x80, audio_config);
+
+  domain_release();
+  /* the companion is unbound, the driver of the card is left to the caller */
+  CHECK_STR(fake_read(DRIVERS "/snd_hda_intel/unbind", buf, sizeof buf),
+          "0000:01:00.1");
+  CHECK_STR(fake_read(DRIVERS "/nouveau/unbind", buf, sizeof buf), "");
+  unlink(AUDIO "/driver");
+
+  fake_power_cut(CARD, card_config);
+  fake_power_cut(AUDIO, audio_config);
+  domain_restore();
+  check_config(CARD, card_config);
+  check_config(AUDIO, audio_config);
+  CHECK_STR(fake_read(DRIVERS "/snd_hda_intel/bind", buf, sizeof buf),
+          "0000:01:00.1");
+  CHECK_STR(fake_read(DRIVERS "/nouveau/bind", buf, sizeof buf), "");
+
+  /* the saved state is used once, a second restore leaves everything be */
+  fake_symlink("../../drivers/snd_hda_intel", AUDIO "/driver");
+  fake_write(DRIVERS "/snd_hda_intel/bind", "%s", "");
+  fake_power_cut(AUDIO, audio_config);
+  domain_restore();
+  CHECK_STR(fake_read(DRIVERS "/snd_hda_intel/bind", buf, sizeof buf), "");
+  CHECK(fake_read(AUDIO "/config", buf, sizeof buf) != NULL);
+  CHECK_INT((uint8_t) buf[PCI_CONFIG_BARS], 0);
+}
+
+int main(void) {
+  struct pci_bus_id *card;
+
+  fake_tree_create();
+  fake_pci_device("0000:00:02.0", PCI_VENDOR_ID_INTEL, 0x3e9b, 0x030000,
+          "i915");
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nouveau");
+  fake_pci_device("0000:01:00.1", PCI_VENDOR_ID_NVIDIA, 0x0fb9, 0x040300,
+          "snd_hda_intel");
+  fake_pci_device("0000:02:00.0", PCI_VENDOR_ID_INTEL, 0x2723, 0x028000,
+          "iwlwifi");
+
+  card = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 0);
+  if (!card) {
+    CHECK(card != NULL);
+    return test_result();
+  }
+  test_init(card);
+  test_release_restore();
+
+  free(card);
+  fake_tree_remove();
+  return test_result();
+}
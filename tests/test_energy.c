@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_energy.c: energy and residency accounting over a series of power
+ * state transitions, with a fake clock and fake power sensors and batteries
+ */
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "test.h"
+#include "../src/bbenergy.h"
+#include "../src/bbevent.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+#define HWMON CARD "/hwmon/hwmon3"
+#define SUPPLY PCI_ROOT "/sys/class/power_supply"
+#define LOG PCI_ROOT "/energy.log"
+
+/* The fake clock and the timer of the accounting that samples the power */
+static long long now;
+static struct bb_timer *timer;
+
+long long bb_event_now(void) {
+  return now;
+}
+
+void bb_timer_start(struct bb_timer *t, int msecs, bb_timer_handler handler,
+        void *data) {
+  t->expires = now + msecs;
+  t->handler = handler;
+  t->data = data;
+  timer = t;
+}
+
+void bb_timer_stop(struct bb_timer *t) {
+  t->expires = 0;
+}
+
+/**
+ * Advances the fake clock, running the timer when it expires
+ */
+static void advance_to(long long t) {
+  while (timer && timer->expires && timer->expires <= t) {
+    now = timer->expires;
+    timer->expires = 0;
+    timer->handler(timer->data);
+  }
+  now = t;
+}
+
+/* A record of the energy log, see struct energy_record in bbenergy.c */
+struct record {
+  uint32_t time;
+  uint32_t duration;
+  uint32_t energy;
+  uint8_t state;
+  uint8_t next;
+  uint8_t source;
+  uint8_t reserved;
+};
+
+static void test_accounting(void) {
+  struct pci_bus_id card = {0, 1, 0, 0};
+  struct energy_stats stats;
+  char text[512];
+
+  /* running on two batteries, one reports its power, the other current and
+   * voltage, 5 W + 3 W; the mains adapter has no status */
+  fake_write(SUPPLY "/BAT0/status", "Discharging\n");
+  fake_write(SUPPLY "/BAT0/power_now", "5000000\n");
+  fake_write(SUPPLY "/BAT1/status", "Discharging\n");
+  fake_write(SUPPLY "/BAT1/current_now", "1000000\n");
+  fake_write(SUPPLY "/BAT1/voltage_now", "3000000\n");
+  fake_write(SUPPLY "/AC/online", "0\n");
+
+  CHECK_INT(energy_open(LOG), 0);
+  energy_add_card(&card);
+  energy_stats(&stats);
+  CHECK_INT(stats.state, ENERGY_STATES);
+  /* clients do not make a state before the cards reported one */
+  energy_set_clients(1);
+  energy_stats(&stats);
+  CHECK_INT(stats.state, ENERGY_STATES);
+  energy_set_clients(0);
+
+  /* off for 2 s on battery power, the card has no sensor */
+  energy_set_state(ENERGY_OFF);
+  energy_stats(&stats);
+  CHECK_INT(stats.source, ENERGY_SOURCE_BATTERY);
+  CHECK_INT(stats.power, 8000);
+  advance_to(2000);
+  /* on for 1 s at 20 W, the sensor is preferred over the batteries */
+  fake_write(HWMON "/power1_average", "20000000\n");
+  energy_set_state(ENERGY_ON);
+  advance_to(3000);
+  /* driver for 2 s at 25 W, from a sensor without an average */
+  unlink(HWMON "/power1_average");
+  fake_write(HWMON "/power1_input", "25000000\n");
+  energy_set_state(ENERGY_DRIVER);
+  energy_stats(&stats);
+  CHECK_INT(stats.source, ENERGY_SOURCE_HWMON);
+  CHECK_INT(stats.power, 25000);
+  advance_to(5000);
+  /* X without clients for 1 s at 30 W */
+  fake_write(HWMON "/power1_input", "30000000\n");
+  energy_set_state(ENERGY_X);
+  advance_to(6000);
+  /* two clients for 6 s: 30 W until the sample at 10 s, then 40 W */
+  energy_set_clients(2);
+  fake_write(HWMON "/power1_input", "40000000\n");
+  advance_to(12000);
+  energy_stats(&stats);
+  CHECK_INT(stats.power, 40000);
+  /* five clients count as four or more, for 1 s */
+  energy_set_clients(5);
+  advance_to(13000);
+  /* the sensor is gone with the driver, the card draws nothing when off */
+  unlink(HWMON "/power1_input");
+  energy_set_state(ENERGY_OFF);
+  energy_set_clients(0);
+  advance_to(14000);
+
+  energy_stats(&stats);
+  CHECK_INT(stats.state, ENERGY_OFF);
+  CHECK_INT(stats.source, ENERGY_SOURCE_HWMON);
+  CHECK_INT(stats.power, 0);
+  CHECK_INT(stats.residency[ENERGY_OFF], 3000);
+  CHECK_INT(stats.residency[ENERGY_ON], 1000);
+  CHECK_INT(stats.residency[ENERGY_DRIVER], 2000);
+  CHECK_INT(stats.residency[ENERGY_X], 1000);
+  CHECK_INT(stats.residency[ENERGY_X + 1], 0);
+  CHECK_INT(stats.residency[ENERGY_X + 2], 6000);
+  CHECK_INT(stats.residency[ENERGY_X + ENERGY_CLIENTS_MAX], 1000);
+  CHECK_INT(stats.transitions[ENERGY_OFF], 2);
+  CHECK_INT(stats.transitions[ENERGY_X + 2], 1);
+  CHECK_INT(stats.transitions[ENERGY_X + 3], 0);
+  CHECK_INT(stats.energy[ENERGY_OFF], 16000);
+  CHECK_INT(stats.energy[ENERGY_ON], 20000);
+  CHECK_INT(stats.energy[ENERGY_DRIVER], 50000);
+  CHECK_INT(stats.energy[ENERGY_X], 30000);
+  CHECK_INT(stats.energy[ENERGY_X + 2], 200000);
+  CHECK_INT(stats.energy[ENERGY_X + ENERGY_CLIENTS_MAX], 40000);
+
+  energy_format(text, sizeof text);
+  CHECK_STR(text, "off 3.0s 2x 16.0J, on 1.0s 1x 20.0J, driver 2.0s 1x 50.0J,"
+          " X/0 1.0s 1x 30.0J, X/1 0.0s 0x 0.0J, X/2 6.0s 1x 200.0J,"
+          " X/3 0.0s 0x 0.0J, X/4+ 1.0s 1x 40.0J (hwmon 0.0W)");
+  energy_format(text, 24);
+  CHECK_INT(strlen(text), 23);
+  energy_close();
+}
+
+static void test_log(void) {
+  static const struct {
+    int state, next, duration, energy, source;
+  } expected[] = {
+    {ENERGY_OFF, ENERGY_ON, 2000, 16000, ENERGY_SOURCE_BATTERY},
+    {ENERGY_ON, ENERGY_DRIVER, 1000, 20000, ENERGY_SOURCE_HWMON},
+    {ENERGY_DRIVER, ENERGY_X, 2000, 50000, ENERGY_SOURCE_HWMON},
+    {ENERGY_X, ENERGY_X + 2, 1000, 30000, ENERGY_SOURCE_HWMON},
+    {ENERGY_X + 2, ENERGY_X + 4, 6000, 200000, ENERGY_SOURCE_HWMON},
+    {ENERGY_X + 4, ENERGY_OFF, 1000, 40000, ENERGY_SOURCE_HWMON},
+    {ENERGY_OFF, ENERGY_STATES, 1000, 0, ENERGY_SOURCE_HWMON},
+  };
+  struct record records[8];
+  int i, count;
+  FILE *log = fopen(LOG, "r");
+
+  CHECK(sizeof (struct record) == 16);
+  if (!log) {
+    CHECK(log != NULL);
+    return;
+  }
+  count = fread(records, sizeof *records, 8, log);
+  fclose(log);
+  CHECK_INT(count, 7);
+  for (i = 0; i < count && i < 7; i++) {
+    CHECK(records[i].time > 0);
+    CHECK_INT(records[i].state, expected[i].state);
+    CHECK_INT(records[i].next, expected[i].next);
+    CHECK_INT(records[i].duration, expected[i].duration);
+    CHECK_INT(records[i].energy, expected[i].energy);
+    CHECK_INT(records[i].source, expected[i].source);
+  }
+}
+
+static void test_rotate(void) {
+  static char full[ENERGY_FILE_MAX];
+  struct stat st;
+
+  /* a full log is moved away before the next record */
+  fake_write_data(LOG, full, sizeof full);
+  CHECK_INT(energy_open(LOG), 0);
+  energy_set_state(ENERGY_ON);
+  advance_to(now + 1000);
+  energy_set_state(ENERGY_OFF);
+  energy_close();
+  CHECK(stat(LOG ".old", &st) == 0 && st.st_size == ENERGY_FILE_MAX);
+  CHECK(stat(LOG, &st) == 0 && st.st_size == 3 * sizeof (struct record));
+}
+
+int main(void) {
+  fake_tree_create();
+  test_accounting();
+  test_log();
+  test_rotate();
+  fake_tree_remove();
+  return test_result();
+}
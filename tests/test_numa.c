@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_numa.c: the NUMA placement of a card read from a fake sysfs tree, its
+ * application to a child process and the NumaPolicy setting of the
+ * configuration file
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/mempolicy.h>
+#include "test.h"
+#include "../src/bbconfig.h"
+#include "../src/bbnuma.h"
+#include "../src/module.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+#define OTHER PCI_DEVICES_PATH "/0000:02:00.0"
+#define CONF PCI_ROOT "/bumblebee.conf"
+
+/* Replace the option tables of the programs, bbconfig.c is linked alone */
+const char *bbconfig_get_optstr(void) {
+  return "";
+}
+
+const struct option *bbconfig_get_lopts(void) {
+  static const struct option lopts[] = {{NULL, 0, NULL, 0}};
+  return lopts;
+}
+
+int bbconfig_parse_options(int opt, char *value) {
+  (void) opt;
+  (void) value;
+  return 0;
+}
+
+int module_is_available(char *module_name) {
+  (void) module_name;
+  return 0;
+}
+
+static void test_parse(void) {
+  struct numa_placement placement;
+  char long_list[NUMA_CPULIST_MAX + 8];
+
+  CHECK(numa_placement_parse("0-3,8,10-11", 1, &placement));
+  CHECK_INT(placement.node, 1);
+  CHECK_STR(placement.cpulist, "0-3,8,10-11");
+
+  /* invalid lists are dropped, the node alone still places */
+  CHECK(numa_placement_parse("3-1", 0, &placement));
+  CHECK_STR(placement.cpulist, "");
+  CHECK(numa_placement_parse("0-3,x", 2, &placement));
+  CHECK_STR(placement.cpulist, "");
+  CHECK(!numa_placement_parse("", -1, &placement));
+  CHECK_INT(placement.node, -1);
+
+  /* nodes beyond the node mask and lists beyond the buffer are ignored */
+  CHECK(!numa_placement_parse("", 5000, &placement));
+  CHECK_INT(placement.node, -1);
+  memset(long_list, 0, sizeof long_list);
+  strcpy(long_list, "0");
+  while (strlen(long_list) < NUMA_CPULIST_MAX) {
+    strcat(long_list, ",0");
+  }
+  CHECK(!numa_placement_parse(long_list, -1, &placement));
+}
+
+static void test_read(void) {
+  struct pci_bus_id card = {0, 1, 0, 0}, other = {0, 2, 0, 0};
+  struct pci_bus_id missing = {0, 3, 0, 0};
+  struct numa_placement placement;
+
+  CHECK(numa_placement_read(&card, &placement));
+  CHECK_INT(placement.node, 1);
+  CHECK_STR(placement.cpulist, "8-15");
+
+  /* local to all online CPUs and no node, as on a single node system */
+  CHECK(!numa_placement_read(&other, &placement));
+  CHECK_STR(placement.cpulist, "");
+  fake_write(OTHER "/numa_node", "0\n");
+  CHECK(numa_placement_read(&other, &placement));
+  CHECK_INT(placement.node, 0);
+  CHECK_STR(placement.cpulist, "");
+
+  CHECK(!numa_placement_read(&missing, &placement));
+}
+
+/**
+ * Applies a placement in a child, the test itself stays where it is
+ * @param placement The placement to apply
+ * @param node The preferred node the child is expected to end up with, -1 if
+ * the kernel cannot set memory policies
+ * @return The number of failed checks in the child
+ */
+static int apply_in_child(const struct numa_placement *placement, int node) {
+  int status;
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    cpu_set_t expected, set;
+    unsigned long nodemask = 0;
+    int mode = -1;
+
+    CHECK_INT(numa_placement_apply(placement), 0);
+    CPU_ZERO(&expected);
+    CPU_SET(atoi(placement->cpulist), &expected);
+    CHECK_INT(sched_getaffinity(0, sizeof set, &set), 0);
+    CHECK(CPU_EQUAL(&set, &expected));
+    if (node != -1) {
+      syscall(SYS_get_mempolicy, &mode, &nodemask, sizeof nodemask * 8, NULL,
+              0);
+      CHECK_INT(mode, MPOL_PREFERRED);
+      CHECK_INT(nodemask, 1UL << node);
+    }
+    _exit(test_failures);
+  }
+  if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+    return 1;
+  }
+  return WEXITSTATUS(status);
+}
+
+static void test_apply(void) {
+  struct numa_placement placement;
+  char cpu[16];
+  cpu_set_t set;
+  int i, node = 0;
+
+  /* run on the first CPU the test may use, node 0 exists everywhere */
+  CHECK_INT(sched_getaffinity(0, sizeof set, &set), 0);
+  for (i = 0; i < CPU_SETSIZE - 1 && !CPU_ISSET(i, &set); i++) {
+    continue;
+  }
+  snprintf(cpu, sizeof cpu, "%i", i);
+  if (syscall(SYS_get_mempolicy, NULL, NULL, 0, NULL, 0) && errno == ENOSYS) {
+    node = -1;
+  }
+  CHECK(numa_placement_parse(cpu, node, &placement));
+  CHECK_INT(apply_in_child(&placement, node), 0);
+
+  /* CPUs that cannot be used are reported */
+  CHECK(numa_placement_parse("1023", -1, &placement));
+  CHECK_INT(numa_placement_apply(&placement), -1);
+}
+
+static void test_policy(void) {
+  GKeyFile *bbcfg;
+
+  init_config();
+  CHECK_INT(bb_config.numa_policy, NUMA_XORG);
+  set_string_value(&bb_config.bb_conf_file, CONF);
+
+  fake_write(CONF, "[bumblebeed]\nNumaPolicy=all\n");
+  bbcfg = bbconfig_parse_conf();
+  CHECK(bbcfg != NULL);
+  CHECK_INT(bb_config.numa_policy, NUMA_ALL);
+  g_key_file_free(bbcfg);
+
+  fake_write(CONF, "[bumblebeed]\nNumaPolicy=none\n");
+  g_key_file_free(bbconfig_parse_conf());
+  CHECK_INT(bb_config.numa_policy, NUMA_NONE);
+
+  fake_write(CONF, "[bumblebeed]\nNumaPolicy=xorg\n");
+  g_key_file_free(bbconfig_parse_conf());
+  CHECK_INT(bb_config.numa_policy, NUMA_XORG);
+
+  /* an unknown policy places nothing */
+  fake_write(CONF, "[bumblebeed]\nNumaPolicy=nearest\n");
+  g_key_file_free(bbconfig_parse_conf());
+  CHECK_INT(bb_config.numa_policy, NUMA_NONE);
+
+  /* a file without the key keeps the setting */
+  bb_config.numa_policy = NUMA_ALL;
+  fake_write(CONF, "[bumblebeed]\nPoolMax=2\n");
+  g_key_file_free(bbconfig_parse_conf());
+  CHECK_INT(bb_config.numa_policy, NUMA_ALL);
+  CHECK_STR(bb_numa_policy_string[bb_config.numa_policy], "all");
+}
+
+int main(void) {
+  fake_tree_create();
+  fake_write(PCI_ROOT "/sys/devices/system/cpu/online", "0-15\n");
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nvidia");
+  fake_write(CARD "/numa_node", "1\n");
+  fake_write(CARD "/local_cpulist", "8-15\n");
+  fake_pci_device("0000:02:00.0", PCI_VENDOR_ID_NVIDIA, 0x1f95, 0x030200,
+          "nvidia");
+  fake_write(OTHER "/numa_node", "-1\n");
+  fake_write(OTHER "/local_cpulist", "0-15\n");
+
+  test_parse();
+  test_read();
+  test_apply();
+  test_policy();
+
+  fake_tree_remove();
+  return test_result();
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_pci.c: the PCI inventory against a fake sysfs tree with an integrated
+ * Intel card and two NVIDIA cards, one of them with an audio function
+ */
+
+#include <stdlib.h>
+#include "test.h"
+#include "../src/pci.h"
+
+static void test_inventory(void) {
+  struct pci_device *dev;
+  int i;
+
+  CHECK_INT(pci_inventory_scan(), 5);
+  CHECK_INT(pci_inventory_count(), 5);
+  /* ordered by Bus ID whatever the order of readdir */
+  for (i = 1; i < pci_inventory_count(); i++) {
+    struct pci_bus_id *a = &pci_inventory_device(i - 1)->bus_id;
+    struct pci_bus_id *b = &pci_inventory_device(i)->bus_id;
+    CHECK(a->bus < b->bus || (a->bus == b->bus && (a->slot < b->slot ||
+            (a->slot == b->slot && a->func < b->func))));
+  }
+
+  dev = pci_inventory_device(2);
+  CHECK_INT(dev->bus_id.bus, 1);
+  CHECK_INT(dev->bus_id.func, 0);
+  CHECK_INT(dev->vendor, PCI_VENDOR_ID_NVIDIA);
+  CHECK_INT(dev->device, 0x1c8d);
+  CHECK_INT(dev->numa_node, 1);
+  CHECK_STR(dev->power_state, "D0");
+  CHECK_STR(dev->driver, "nvidia");
+  CHECK_INT(pci_inventory_device(4)->numa_node, -1);
+  CHECK_STR(pci_inventory_device(4)->power_state, "D3cold");
+  CHECK_STR(pci_inventory_device(4)->driver, "");
+}
+
+static void test_find_gfx(void) {
+  struct pci_bus_id *id;
+
+  id = pci_find_gfx_by_vendor(PCI_VENDOR_ID_INTEL, 0);
+  CHECK(id && id->bus == 0 && id->slot == 2 && id->func == 0);
+  free(id);
+  CHECK(pci_find_gfx_by_vendor(PCI_VENDOR_ID_INTEL, 1) == NULL);
+
+  /* the VGA card and then the 3D controller, never the audio function */
+  id = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 0);
+  CHECK(id && id->bus == 1 && id->slot == 0 && id->func == 0);
+  CHECK_INT(pci_get_class(id), PCI_CLASS_DISPLAY_VGA);
+  free(id);
+  id = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 1);
+  CHECK(id && id->bus == 2 && id->slot == 0 && id->func == 0);
+  CHECK_INT(pci_get_class(id), PCI_CLASS_DISPLAY_3D);
+  free(id);
+  CHECK(pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 2) == NULL);
+}
+
+static void test_functions(void) {
+  struct pci_bus_id card = {0, 1, 0, 1}, other = {0, 2, 0, 0};
+  struct pci_bus_id functions[8];
+
+  CHECK_INT(pci_find_functions(&card, functions, 8), 2);
+  CHECK_INT(functions[0].func, 0);
+  CHECK_INT(functions[1].func, 1);
+  CHECK_INT(pci_find_functions(&card, functions, 1), 1);
+  CHECK_INT(pci_find_functions(&other, functions, 8), 1);
+}
+
+static void test_driver(void) {
+  struct pci_bus_id card = {0, 1, 0, 0}, other = {0, 2, 0, 0};
+  char driver[32], buf[64];
+
+  CHECK_INT(pci_get_driver(driver, &card, sizeof driver), strlen("nvidia"));
+  CHECK_STR(driver, "nvidia");
+  CHECK_INT(pci_get_driver(driver, &card, 4), strlen("nvidia"));
+  CHECK_STR(driver, "nvi");
+  CHECK_INT(pci_get_driver(NULL, &other, 0), 0);
+
+  /* the cached binding holds until it is invalidated */
+  fake_symlink("../../drivers/nouveau",
+          PCI_DEVICES_PATH "/0000:01:00.0/driver");
+  pci_get_driver(driver, &card, sizeof driver);
+  CHECK_STR(driver, "nvidia");
+  pci_driver_invalidate(&card);
+  pci_get_driver(driver, &card, sizeof driver);
+  CHECK_STR(driver, "nouveau");
+  pci_driver_set(&card, "");
+  CHECK_INT(pci_get_driver(driver, &card, sizeof driver), 0);
+
+  /* unbinding writes the device name to the driver core */
+  fake_symlink("../../drivers/nvidia",
+          PCI_DEVICES_PATH "/0000:01:00.0/driver");
+  CHECK_INT(pci_unbind_driver(&card), 0);
+  CHECK_STR(fake_read(PCI_ROOT "/sys/bus/pci/drivers/nvidia/unbind", buf,
+          sizeof buf), "0000:01:00.0");
+  CHECK_INT(pci_bind_driver(&other, "nvidia"), 0);
+  CHECK_STR(fake_read(PCI_ROOT "/sys/bus/pci/drivers/nvidia/bind", buf,
+          sizeof buf), "0000:02:00.0");
+}
+
+int main(void) {
+  fake_tree_create();
+  fake_pci_device("0000:00:02.0", PCI_VENDOR_ID_INTEL, 0x3e9b, 0x030000,
+          "i915");
+  fake_pci_device("0000:00:1f.0", PCI_VENDOR_ID_INTEL, 0xa30d, 0x060100,
+          NULL);
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nvidia");
+  fake_write(PCI_DEVICES_PATH "/0000:01:00.0/numa_node", "1\n");
+  fake_write(PCI_DEVICES_PATH "/0000:01:00.0/power_state", "D0\n");
+  fake_pci_device("0000:01:00.1", PCI_VENDOR_ID_NVIDIA, 0x0fb9, 0x040300,
+          "snd_hda_intel");
+  fake_pci_device("0000:02:00.0", PCI_VENDOR_ID_NVIDIA, 0x1f95, 0x030200,
+          NULL);
+  fake_write(PCI_DEVICES_PATH "/0000:02:00.0/numa_node", "-1\n");
+  fake_write(PCI_DEVICES_PATH "/0000:02:00.0/power_state", "D3cold\n");
+
+  test_inventory();
+  test_find_gfx();
+  test_functions();
+  test_driver();
+
+  fake_tree_remove();
+  return test_result();
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_runtimepm.c: the runtime power management switcher against a fake
+ * sysfs tree with a card and its HDMI audio function
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "test.h"
+#include "../src/bbevent.h"
+#include "../src/pci.h"
+#include "../src/module.h"
+#include "../src/switch/switching.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+#define AUDIO PCI_DEVICES_PATH "/0000:01:00.1"
+
+/* Checks the start of an attribute, the switcher overwrites it in place */
+#define CHECK_ATTR(path, expected) do { \
+    char buf_[64]; \
+    CHECK_STR(fake_read(path, buf_, sizeof expected), expected); \
+  } while (0)
+
+/**
+ * Replaces module_load, bbswitch is never available here
+ */
+int module_load(char *module_name, char *driver) {
+  (void) module_name;
+  (void) driver;
+  return 0;
+}
+
+/**
+ * Sets the runtime PM attributes of a function
+ */
+static void fake_runtimepm(const char *dir, const char *control,
+        const char *status) {
+  char path[256];
+
+  snprintf(path, sizeof path, "%s/power/control", dir);
+  fake_write(path, "%s\n", control);
+  snprintf(path, sizeof path, "%s/power/runtime_status", dir);
+  fake_write(path, "%s\n", status);
+}
+
+static void test_available(struct switch_info info) {
+  info.configured_pm = "auto";
+  unlink(CARD "/d3cold_allowed");
+  /* a card that stays in D3hot is only used if asked for */
+  CHECK(switcher_detect(NULL, info) == NULL);
+  info.configured_pm = "runtimepm";
+  CHECK(switcher_detect("runtimepm", info) == &switching_methods[2]);
+  CHECK_INT(domain_count(), 2);
+
+  /* runtime PM has to be there for every function in the slot */
+  unlink(AUDIO "/power/control");
+  CHECK(switcher_detect("runtimepm", info) == NULL);
+  fake_runtimepm(AUDIO, "auto", "active");
+
+  info.configured_pm = "auto";
+  fake_write(CARD "/d3cold_allowed", "0\n");
+  CHECK(switcher_detect(NULL, info) == &switching_methods[2]);
+  CHECK_STR(runtimepm_path, CARD "/power/control");
+  CHECK_STR(switcher->path, CARD "/power/control");
+}
+
+static void test_status(void) {
+  fake_runtimepm(CARD, "on", "active");
+  fake_runtimepm(AUDIO, "auto", "active");
+  CHECK_INT(runtimepm_status(), SWITCH_ON);
+  /* the audio function keeps the link awake */
+  fake_runtimepm(CARD, "auto", "suspended");
+  CHECK_INT(runtimepm_status(), SWITCH_ON);
+  fake_runtimepm(AUDIO, "auto", "unsupported");
+  CHECK_INT(runtimepm_status(), SWITCH_ON);
+  fake_runtimepm(AUDIO, "auto", "suspended");
+  CHECK_INT(runtimepm_status(), SWITCH_OFF);
+  /* still drawing power while suspending */
+  fake_runtimepm(CARD, "auto", "suspending");
+  CHECK_INT(runtimepm_status(), SWITCH_ON);
+  fake_runtimepm(CARD, "auto", "unsupported");
+  CHECK_INT(runtimepm_status(), SWITCH_UNAVAIL);
+  fake_runtimepm(CARD, "auto", "error");
+  CHECK_INT(runtimepm_status(), SWITCH_UNAVAIL);
+  fake_runtimepm(CARD, "auto", "suspended");
+  CHECK_INT(runtimepm_status(), SWITCH_OFF);
+}
+
+static void test_switch(void) {
+  fake_runtimepm(CARD, "on", "active");
+  fake_runtimepm(AUDIO, "on", "active");
+  fake_write(CARD "/d3cold_allowed", "0\n");
+  fake_write(CARD "/power/autosuspend_delay_ms", "5000\n");
+
+  runtimepm_off();
+  CHECK_ATTR(CARD "/power/control", "auto\n");
+  CHECK_ATTR(CARD "/d3cold_allowed", "1\n");
+  CHECK_ATTR(CARD "/power/autosuspend_delay_ms", "100\n");
+  CHECK_ATTR(AUDIO "/power/control", "auto\n");
+  /* the audio function has neither D3cold nor an autosuspend delay */
+  CHECK(access(AUDIO "/d3cold_allowed", F_OK) != 0);
+  CHECK(access(AUDIO "/power/autosuspend_delay_ms", F_OK) != 0);
+
+  /* only the card is kept on, its companions are resumed by their drivers */
+  runtimepm_on();
+  CHECK_ATTR(CARD "/power/control", "on\n");
+  CHECK_ATTR(AUDIO "/power/control", "auto\n");
+}
+
+static void power_changed(enum switch_state state, void *data) {
+  *(enum switch_state *) data = state;
+}
+
+static void test_uncached(void) {
+  enum switch_state reported = SWITCH_UNAVAIL;
+
+  /* the kernel suspends the card by itself, which is not notified */
+  fake_runtimepm(CARD, "auto", "active");
+  fake_runtimepm(AUDIO, "auto", "suspended");
+  switch_cache_start(power_changed, &reported);
+  CHECK_INT(switch_status(), SWITCH_ON);
+  fake_runtimepm(CARD, "auto", "suspended");
+  CHECK_INT(switch_status(), SWITCH_OFF);
+  CHECK_INT(reported, SWITCH_UNAVAIL);
+
+  /* the state is read periodically to report the change */
+  if (bb_event_init() == 0) {
+    bb_event_dispatch(2 * SWITCH_WATCH_INTERVAL);
+    CHECK_INT(reported, SWITCH_OFF);
+    bb_event_close();
+  }
+  switch_cache_stop();
+}
+
+int main(void) {
+  struct pci_bus_id *card;
+  struct switch_info info = {"nouveau", "auto", &card, 1};
+
+  fake_tree_create();
+  fake_pci_device("0000:00:02.0", PCI_VENDOR_ID_INTEL, 0x3e9b, 0x030000,
+          "i915");
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nouveau");
+  fake_pci_device("0000:01:00.1", PCI_VENDOR_ID_NVIDIA, 0x0fb9, 0x040300,
+          "snd_hda_intel");
+  fake_runtimepm(CARD, "on", "active");
+  fake_runtimepm(AUDIO, "auto", "active");
+  fake_write(CARD "/power/autosuspend_delay_ms", "5000\n");
+
+  card = pci_find_gfx_by_vendor(PCI_VENDOR_ID_NVIDIA, 0);
+  if (!card) {
+    CHECK(card != NULL);
+    return test_result();
+  }
+  test_available(info);
+  test_status();
+  test_switch();
+  test_uncached();
+
+  free(card);
+  fake_tree_remove();
+  return test_result();
+}
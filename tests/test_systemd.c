@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_systemd.c: readiness and watchdog notifications and socket activation,
+ * with the service manager played by a datagram socket of the test
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "test.h"
+#include "../src/bbsystemd.h"
+#include "../src/bbevent.h"
+
+/**
+ * Creates the socket of the fake service manager and points NOTIFY_SOCKET
+ * to it
+ * @param name The address, a leading @ denotes the abstract namespace
+ * @return The socket, -1 on failure
+ */
+static int manager_open(const char *name) {
+  struct sockaddr_un addr;
+  int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof addr.sun_path, "%s", name);
+  if (name[0] == '@') {
+    addr.sun_path[0] = 0;
+  } else {
+    unlink(name);
+  }
+  if (sock == -1 || bind(sock, (struct sockaddr *) &addr,
+          offsetof(struct sockaddr_un, sun_path) + strlen(name)) == -1) {
+    perror("cannot create notification socket");
+    exit(TEST_SKIP);
+  }
+  setenv("NOTIFY_SOCKET", name, 1);
+  return sock;
+}
+
+/**
+ * Receives the next notification without blocking
+ * @return The notification, empty if none was sent
+ */
+static const char *manager_recv(int sock) {
+  static char buf[256];
+  ssize_t r = recv(sock, buf, sizeof buf - 1, MSG_DONTWAIT);
+
+  buf[r > 0 ? r : 0] = 0;
+  return buf;
+}
+
+/**
+ * Runs the event loop for some time such that timers can expire
+ */
+static void run_loop(int msecs) {
+  long long end = bb_event_now() + msecs;
+
+  while (bb_event_now() < end) {
+    bb_event_dispatch(end - bb_event_now());
+  }
+}
+
+static void test_notify(void) {
+  char name[64], path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+  int sock;
+
+  /* not running under a service manager */
+  unsetenv("NOTIFY_SOCKET");
+  systemd_notify("READY=1");
+
+  snprintf(name, sizeof name, "@bumblebee-test-%i", (int) getpid());
+  sock = manager_open(name);
+  systemd_notify("READY=1");
+  CHECK_STR(manager_recv(sock), "READY=1");
+  systemd_notify("STOPPING=1");
+  CHECK_STR(manager_recv(sock), "STOPPING=1");
+  CHECK_STR(manager_recv(sock), "");
+  /* relative paths are not accepted */
+  setenv("NOTIFY_SOCKET", name + 1, 1);
+  systemd_notify("READY=1");
+  CHECK_STR(manager_recv(sock), "");
+  close(sock);
+
+  snprintf(path, sizeof path, "/tmp/bumblebee-test-%i.notify", (int) getpid());
+  sock = manager_open(path);
+  systemd_notify("READY=1");
+  CHECK_STR(manager_recv(sock), "READY=1");
+  close(sock);
+  unlink(path);
+}
+
+static void test_watchdog(void) {
+  char name[64], pid[16];
+  int sock;
+
+  snprintf(name, sizeof name, "@bumblebee-test-%i", (int) getpid());
+  sock = manager_open(name);
+  snprintf(pid, sizeof pid, "%i", (int) getpid());
+
+  /* the watchdog belongs to another process */
+  setenv("WATCHDOG_USEC", "200000", 1);
+  setenv("WATCHDOG_PID", "1", 1);
+  systemd_watchdog_start();
+  run_loop(150);
+  CHECK_STR(manager_recv(sock), "");
+
+  /* pinged right away and then at half the timeout */
+  setenv("WATCHDOG_PID", pid, 1);
+  systemd_watchdog_start();
+  CHECK_STR(manager_recv(sock), "WATCHDOG=1");
+  CHECK_STR(manager_recv(sock), "");
+  run_loop(150);
+  CHECK_STR(manager_recv(sock), "WATCHDOG=1");
+  CHECK_STR(manager_recv(sock), "");
+  systemd_watchdog_stop();
+  run_loop(150);
+  CHECK_STR(manager_recv(sock), "");
+
+  /* without WATCHDOG_PID the watchdog applies to this process */
+  unsetenv("WATCHDOG_PID");
+  systemd_watchdog_start();
+  CHECK_STR(manager_recv(sock), "WATCHDOG=1");
+  systemd_watchdog_stop();
+
+  unsetenv("WATCHDOG_USEC");
+  systemd_watchdog_start();
+  CHECK_STR(manager_recv(sock), "");
+  close(sock);
+}
+
+static void test_listen(void) {
+  struct sockaddr_un addr;
+  char pid[16];
+  int sock;
+
+  snprintf(pid, sizeof pid, "%i", (int) getpid());
+  unsetenv("LISTEN_PID");
+  CHECK_INT(systemd_listen_fd(), -1);
+
+  /* a socket that is not listening is refused */
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(dup2(sock, SYSTEMD_LISTEN_FDS_START) == SYSTEMD_LISTEN_FDS_START);
+  setenv("LISTEN_PID", pid, 1);
+  setenv("LISTEN_FDS", "1", 1);
+  CHECK_INT(systemd_listen_fd(), -1);
+  CHECK(getenv("LISTEN_FDS") == NULL);
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path + 1, sizeof addr.sun_path - 1,
+          "bumblebee-test-%i.socket", (int) getpid());
+  CHECK_INT(bind(SYSTEMD_LISTEN_FDS_START, (struct sockaddr *) &addr,
+          sizeof addr), 0);
+  CHECK_INT(listen(SYSTEMD_LISTEN_FDS_START, 1), 0);
+  setenv("LISTEN_PID", "1", 1);
+  setenv("LISTEN_FDS", "1", 1);
+  CHECK_INT(systemd_listen_fd(), -1);
+  setenv("LISTEN_PID", pid, 1);
+  CHECK_INT(systemd_listen_fd(), SYSTEMD_LISTEN_FDS_START);
+  CHECK(getenv("LISTEN_PID") == NULL);
+  close(SYSTEMD_LISTEN_FDS_START);
+  close(sock);
+}
+
+int main(void) {
+  /* before the event loop takes the first free descriptor */
+  test_listen();
+  if (bb_event_init()) {
+    return TEST_SKIP;
+  }
+  test_notify();
+  test_watchdog();
+  bb_event_close();
+  return test_result();
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2011-2013, The Bumblebee Project
+ *
+ * This file is part of Bumblebee.
+ *
+ * Bumblebee is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bumblebee is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bumblebee. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * test_uevent.c: synthetic uevent messages fed through a local socket update
+ * the PCI inventory of a fake sysfs tree and the module states
+ */
+
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "test.h"
+#include "../src/bbevent.h"
+#include "../src/bbuevent.h"
+#include "../src/module.h"
+#include "../src/pci.h"
+
+#define CARD PCI_DEVICES_PATH "/0000:01:00.0"
+#define WIFI PCI_DEVICES_PATH "/0000:02:00.0"
+#define DEVPATH "/devices/pci0000:00/0000:00:01.0/0000:01:00.0"
+
+static int sender = -1;
+static int notified;
+static char last_action[16];
+static int tracked;
+static char changed_module[32];
+static int changed_loaded = -1;
+
+/**
+ * Replaces module_track, module.c needs the whole daemon
+ */
+void module_track(int enable) {
+  tracked = enable;
+}
+
+/**
+ * Replaces module_changed, records the last change
+ */
+void module_changed(const char *driver, int loaded) {
+  snprintf(changed_module, sizeof changed_module, "%s", driver);
+  changed_loaded = loaded;
+}
+
+static void uevent_notified(const struct uevent *event) {
+  notified++;
+  snprintf(last_action, sizeof last_action, "%s",
+          event ? event->action : "(lost)");
+}
+
+/**
+ * Sends a uevent message made of a header and null-terminated fields, the
+ * list of fields ends with NULL, and lets the event loop receive it
+ * @return The number of callbacks caused by the message
+ */
+static int send_uevent(const char *header, ...) {
+  char msg[UEVENT_BUFFER];
+  const char *field;
+  size_t len = 0;
+  va_list args;
+  int before = notified;
+
+  va_start(args, header);
+  for (field = header; field && len < sizeof msg;
+          field = va_arg(args, const char *)) {
+    len += snprintf(msg + len, sizeof msg - len, "%s", field) + 1;
+  }
+  va_end(args);
+  CHECK(send(sender, msg, len, 0) == (ssize_t) len);
+  bb_event_dispatch(0);
+  return notified - before;
+}
+
+static void test_parse(void) {
+  char msg[] = "bind@" DEVPATH "\0ACTION=bind\0DEVPATH=" DEVPATH
+          "\0SUBSYSTEM=pci\0DRIVER=nouveau\0PCI_SLOT_NAME=0000:01:00.0";
+  struct uevent event;
+
+  CHECK_INT(uevent_parse(msg, sizeof msg - 1, &event), 0);
+  CHECK_STR(event.action, "bind");
+  CHECK_STR(event.devpath, DEVPATH);
+  CHECK_STR(event.subsystem, "pci");
+  CHECK_STR(event.driver, "nouveau");
+  CHECK_STR(event.slot, "0000:01:00.0");
+}
+
+static void test_pci_events(void) {
+  struct pci_bus_id card = {0, 1, 0, 0};
+  char driver[64];
+
+  /* the driver comes from the message, sysfs still names the old one */
+  CHECK_INT(send_uevent("bind@" DEVPATH, "ACTION=bind", "DEVPATH=" DEVPATH,
+          "SUBSYSTEM=pci", "DRIVER=nouveau", "PCI_SLOT_NAME=0000:01:00.0",
+          NULL), 1);
+  CHECK_STR(last_action, "bind");
+  pci_get_driver(driver, &card, sizeof driver);
+  CHECK_STR(driver, "nouveau");
+
+  CHECK_INT(send_uevent("unbind@" DEVPATH, "ACTION=unbind",
+          "DEVPATH=" DEVPATH, "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:01:00.0",
+          NULL), 1);
+  CHECK_INT(pci_get_driver(driver, &card, sizeof driver), 0);
+
+  /* any other action reads the driver from sysfs again */
+  CHECK_INT(send_uevent("change@" DEVPATH, "ACTION=change",
+          "DEVPATH=" DEVPATH, "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:01:00.0",
+          NULL), 1);
+  pci_get_driver(driver, &card, sizeof driver);
+  CHECK_STR(driver, "nvidia");
+
+  /* add and remove scan the inventory again */
+  fake_pci_device("0000:02:00.0", PCI_VENDOR_ID_INTEL, 0x2723, 0x028000,
+          "iwlwifi");
+  CHECK_INT(send_uevent("add@/devices/pci0000:00/0000:02:00.0", "ACTION=add",
+          "DEVPATH=/devices/pci0000:00/0000:02:00.0", "SUBSYSTEM=pci",
+          "PCI_SLOT_NAME=0000:02:00.0", NULL), 1);
+  CHECK_INT(pci_inventory_count(), 3);
+  unlink(WIFI "/uevent");
+  unlink(WIFI "/driver");
+  rmdir(WIFI);
+  CHECK_INT(send_uevent("remove@/devices/pci0000:00/0000:02:00.0",
+          "ACTION=remove", "DEVPATH=/devices/pci0000:00/0000:02:00.0",
+          "SUBSYSTEM=pci", "PCI_SLOT_NAME=0000:02:00.0", NULL), 1);
+  CHECK_INT(pci_inventory_count(), 2);
+  CHECK_STR(last_action, "remove");
+}
+
+static void test_module_events(void) {
+  CHECK_INT(send_uevent("add@/module/nvidia", "ACTION=add",
+          "DEVPATH=/module/nvidia", "SUBSYSTEM=module", NULL), 1);
+  CHECK_STR(changed_module, "nvidia");
+  CHECK_INT(changed_loaded, 1);
+  CHECK_INT(send_uevent("remove@/module/nvidia", "ACTION=remove",
+          "DEVPATH=/module/nvidia", "SUBSYSTEM=module", NULL), 1);
+  CHECK_INT(changed_loaded, 0);
+}
+
+static void test_ignored(void) {
+  struct pci_bus_id card = {0, 1, 0, 0};
+  char driver[64];
+
+  /* messages of udev and incomplete ones are dropped */
+  CHECK_INT(send_uevent("libudev", "ACTION=bind", "DEVPATH=" DEVPATH,
+          "SUBSYSTEM=pci", "DRIVER=nouveau", "PCI_SLOT_NAME=0000:01:00.0",
+          NULL), 0);
+  CHECK_INT(send_uevent("bind@" DEVPATH, "ACTION=bind", "DEVPATH=" DEVPATH,
+          "DRIVER=nouveau", "PCI_SLOT_NAME=0000:01:00.0", NULL), 0);
+  pci_get_driver(driver, &card, sizeof driver);
+  CHECK_STR(driver, "nvidia");
+}
+
+int main(void) {
+  int fds[2];
+
+  fake_tree_create();
+  fake_pci_device("0000:00:02.0", PCI_VENDOR_ID_INTEL, 0x3e9b, 0x030000,
+          "i915");
+  fake_pci_device("0000:01:00.0", PCI_VENDOR_ID_NVIDIA, 0x1c8d, 0x030000,
+          "nvidia");
+  CHECK_INT(pci_inventory_scan(), 2);
+
+  if (bb_event_init() || socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK |
+          SOCK_CLOEXEC, 0, fds)) {
+    return TEST_SKIP;
+  }
+  sender = fds[1];
+  CHECK_INT(uevent_listen(fds[0], uevent_notified), 0);
+  CHECK_INT(tracked, 1);
+
+  test_parse();
+  test_pci_events();
+  test_module_events();
+  test_ignored();
+
+  uevent_close();
+  CHECK_INT(tracked, 0);
+  close(sender);
+  bb_event_close();
+  fake_tree_remove();
+  return test_result();
+}